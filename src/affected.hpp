@@ -0,0 +1,207 @@
+#ifndef AFFECTED_HPP
+#define AFFECTED_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "map_delta.hpp"
+#include "output_file.hpp"
+#include "snapshot.hpp"
+
+/*
+ * Objects affected by an update (directly or through their members) and
+ * the map tiles that have to be rendered again.
+ */
+
+typedef std::vector<osmium::unsigned_object_id_type> id_list;
+
+inline void sort_unique(id_list& ids) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+/**
+ * Look up all keys (sorted) in the map of the generation of the manifest
+ * (map file and delta) and return the sorted values. The keys are split
+ * into num_threads consecutive parts, each looked up in its own thread.
+ * Returns nothing if there is no such map.
+ */
+inline id_list lookup_map_parallel(const std::string& database, const SnapshotManifest& manifest, const std::string& name, const id_list& keys, unsigned int num_threads) {
+    id_list result;
+    const auto files = snapshot_map_files(database, manifest, name);
+    if (keys.empty() || (files.base.empty() && files.delta.empty())) {
+        return result;
+    }
+
+    const MapSnapshot map{database, files};
+
+    num_threads = std::max(1u, std::min(num_threads, unsigned(keys.size() / 1024 + 1)));
+    const std::size_t part_size = (keys.size() + num_threads - 1) / num_threads;
+
+    std::vector<std::future<id_list>> parts;
+    for (unsigned int t = 0; t < num_threads; ++t) {
+        const auto first = keys.cbegin() + std::min(keys.size(), t * part_size);
+        const auto last = keys.cbegin() + std::min(keys.size(), (t + 1) * part_size);
+        parts.push_back(std::async(std::launch::async, [&map, first, last]() {
+            id_list values;
+            map.find_parents(first, last, values);
+            return values;
+        }));
+    }
+
+    for (auto& part : parts) {
+        const id_list values{part.get()};
+        result.insert(result.end(), values.cbegin(), values.cend());
+    }
+    sort_unique(result);
+
+    return result;
+}
+
+/**
+ * Objects changed in an update and objects affected by them.
+ */
+struct AffectedObjects {
+
+    id_list nodes;     // changed nodes
+    id_list ways;      // changed ways and ways with changed nodes
+    id_list relations; // changed relations and relations with affected members (transitive)
+
+    /// Write one line per object: type letter (n, w, r) and ID.
+    void write(const std::string& filename) const {
+        OutputFile file{filename};
+        std::string line;
+        const auto write_ids = [&](char type, const id_list& ids) {
+            for (const auto id : ids) {
+                line = type + std::to_string(id) + '\n';
+                file.write(line.data(), line.size());
+            }
+        };
+        write_ids('n', nodes);
+        write_ids('w', ways);
+        write_ids('r', relations);
+        file.close();
+    }
+
+}; // struct AffectedObjects
+
+/**
+ * Find all objects affected by the changed objects (each list sorted)
+ * through the maps of the generation of the manifest. The closure is computed level by level: Ways and
+ * relations of the changed nodes, relations of the affected ways, and
+ * then the parent relations of the relations found in the last level
+ * until no new ones are found.
+ */
+inline AffectedObjects find_affected_objects(const std::string& database, const SnapshotManifest& manifest, const id_list& nodes, const id_list& ways, const id_list& relations, unsigned int num_threads) {
+    AffectedObjects affected;
+    affected.nodes = nodes;
+
+    affected.ways = ways;
+    const id_list node_ways{lookup_map_parallel(database, manifest, "node2way", nodes, num_threads)};
+    affected.ways.insert(affected.ways.end(), node_ways.cbegin(), node_ways.cend());
+    sort_unique(affected.ways);
+
+    id_list level{relations};
+    for (const auto& lookup : {std::make_pair("node2relation", &affected.nodes), std::make_pair("way2relation", &affected.ways)}) {
+        const id_list found{lookup_map_parallel(database, manifest, lookup.first, *lookup.second, num_threads)};
+        level.insert(level.end(), found.cbegin(), found.cend());
+    }
+    sort_unique(level);
+
+    while (!level.empty()) {
+        id_list all;
+        std::set_union(affected.relations.cbegin(), affected.relations.cend(), level.cbegin(), level.cend(), std::back_inserter(all));
+        affected.relations.swap(all);
+
+        const id_list parents{lookup_map_parallel(database, manifest, "relation2relation", level, num_threads)};
+        level.clear();
+        std::set_difference(parents.cbegin(), parents.cend(), affected.relations.cbegin(), affected.relations.cend(), std::back_inserter(level));
+    }
+
+    return affected;
+}
+
+/**
+ * Web mercator tiles on one zoom level that have to be rendered again.
+ */
+class ExpiredTiles {
+
+    unsigned int m_zoom;
+    std::vector<uint64_t> m_tiles; // x << 32 | y
+
+public:
+
+    explicit ExpiredTiles(unsigned int zoom) :
+        m_zoom(zoom) {
+    }
+
+    void add(const osmium::Location& location) {
+        if (!location.valid()) {
+            return;
+        }
+
+        const double max_lat = 85.0511287798;
+        const double pi = 3.14159265358979323846;
+        const double n = double(1ull << m_zoom);
+        const double lat = std::max(-max_lat, std::min(max_lat, location.lat())) * pi / 180.0;
+
+        const double x = (location.lon() + 180.0) / 360.0 * n;
+        const double y = (1.0 - std::log(std::tan(lat) + 1.0 / std::cos(lat)) / pi) / 2.0 * n;
+
+        const auto clamp = [n](double v) {
+            return uint64_t(std::max(0.0, std::min(n - 1.0, std::floor(v))));
+        };
+        m_tiles.push_back((clamp(x) << 32) | clamp(y));
+    }
+
+    /// Write the tiles as sorted list of "zoom/x/y" lines.
+    void write(const std::string& filename) {
+        std::sort(m_tiles.begin(), m_tiles.end());
+        m_tiles.erase(std::unique(m_tiles.begin(), m_tiles.end()), m_tiles.end());
+
+        OutputFile file{filename};
+        std::string line;
+        for (const auto tile : m_tiles) {
+            line = std::to_string(m_zoom) + '/' + std::to_string(tile >> 32) + '/' + std::to_string(tile & 0xffffffff) + '\n';
+            file.write(line.data(), line.size());
+        }
+        file.close();
+    }
+
+}; // class ExpiredTiles
+
+#endif // AFFECTED_HPP
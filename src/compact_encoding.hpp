@@ -0,0 +1,506 @@
+#ifndef COMPACT_ENCODING_HPP
+#define COMPACT_ENCODING_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// protozero
+#include <protozero/varint.hpp>
+
+// osmium
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Compact storage encoding for OSM objects
+ *
+ * Each object is stored as a record:
+ *
+ *   varint   length of the rest of the record
+ *   byte     item type (1=node, 2=way, 3=relation), 0x80 set if visible
+ *   zvarint  id
+ *   varint   version, changeset, timestamp, uid
+ *   string   user
+ *   varint   number of tags, followed by key and value strings
+ *
+ * followed by the type specific part:
+ *
+ *   node:     zvarint x, zvarint y
+ *   way:      varint number of nodes, zvarint delta encoded node refs
+ *   relation: varint number of members, for each member: byte type,
+ *             zvarint delta encoded ref, string role
+ *
+ * Strings are stored as a varint v. If the lowest bit of v is 0, v >> 1
+ * is an index into the global string dictionary, otherwise v >> 1 is the
+ * length of the string which follows directly.
+ */
+
+/**
+ * Count how often strings are used. Once the number of different
+ * strings gets larger than the limit, rare strings are thrown away
+ * ("lossy counting"), so this works with bounded memory on large
+ * inputs.
+ */
+class StringCounter {
+
+    std::unordered_map<std::string, uint64_t> m_counts;
+    std::size_t m_max_entries;
+    uint64_t m_prune_below = 2;
+
+    void prune() {
+        for (auto it = m_counts.begin(); it != m_counts.end();) {
+            if (it->second < m_prune_below) {
+                it = m_counts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        ++m_prune_below;
+    }
+
+public:
+
+    explicit StringCounter(std::size_t max_entries = 10 * 1000 * 1000) :
+        m_max_entries(max_entries) {
+    }
+
+    void add(const char* str) {
+        ++m_counts[str];
+        if (m_counts.size() > m_max_entries) {
+            prune();
+        }
+    }
+
+    void add(const osmium::OSMObject& object) {
+        add(object.user());
+        for (const auto& tag : object.tags()) {
+            add(tag.key());
+            add(tag.value());
+        }
+        if (object.type() == osmium::item_type::relation) {
+            for (const auto& member : static_cast<const osmium::Relation&>(object).members()) {
+                add(member.role());
+            }
+        }
+    }
+
+    /**
+     * Return the strings used at least min_count times, most common
+     * first, but at most max_size of them.
+     */
+    std::vector<std::string> most_common(uint64_t min_count, std::size_t max_size) const {
+        std::vector<std::pair<uint64_t, const std::string*>> candidates;
+        for (const auto& c : m_counts) {
+            // strings of length one are never worth a dictionary entry
+            if (c.second >= min_count && c.first.size() > 1) {
+                candidates.emplace_back(c.second, &c.first);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const std::pair<uint64_t, const std::string*>& lhs, const std::pair<uint64_t, const std::string*>& rhs) {
+            return lhs.first > rhs.first || (lhs.first == rhs.first && *lhs.second < *rhs.second);
+        });
+        if (candidates.size() > max_size) {
+            candidates.resize(max_size);
+        }
+
+        std::vector<std::string> result;
+        result.reserve(candidates.size());
+        for (const auto& c : candidates) {
+            result.push_back(*c.second);
+        }
+        return result;
+    }
+
+}; // class StringCounter
+
+/**
+ * Global string dictionary. The file format is a varint with the number
+ * of strings followed by each string as varint length and data.
+ */
+class StringDictionary {
+
+    std::vector<std::string> m_strings;
+    std::unordered_map<std::string, uint32_t> m_lookup;
+
+public:
+
+    StringDictionary() = default;
+
+    explicit StringDictionary(std::vector<std::string>&& strings) :
+        m_strings(std::move(strings)) {
+        for (uint32_t i = 0; i < m_strings.size(); ++i) {
+            m_lookup.emplace(m_strings[i], i);
+        }
+    }
+
+    std::size_t size() const noexcept {
+        return m_strings.size();
+    }
+
+    const std::string& get(uint32_t index) const {
+        if (index >= m_strings.size()) {
+            throw std::runtime_error{"invalid string dictionary reference"};
+        }
+        return m_strings[index];
+    }
+
+    /// Index of the string or -1 if it is not in the dictionary.
+    int64_t find(const char* str) const {
+        const auto it = m_lookup.find(str);
+        return it == m_lookup.end() ? -1 : int64_t(it->second);
+    }
+
+    void write(const std::string& filename) const {
+        std::string out;
+        protozero::write_varint(std::back_inserter(out), m_strings.size());
+        for (const auto& str : m_strings) {
+            protozero::write_varint(std::back_inserter(out), str.size());
+            out += str;
+        }
+
+        OutputFile file{filename};
+        file.write(out.data(), out.size());
+        file.close();
+    }
+
+    void read(const std::string& filename) {
+        MappedFile mf{filename};
+        const char* data = reinterpret_cast<const char*>(mf.data());
+        const char* end = data + mf.size();
+
+        std::vector<std::string> strings;
+        auto count = protozero::decode_varint(&data, end);
+        strings.reserve(count);
+        while (count--) {
+            const auto length = protozero::decode_varint(&data, end);
+            if (length > std::size_t(end - data)) {
+                throw std::runtime_error{"string dictionary file is truncated"};
+            }
+            strings.emplace_back(data, length);
+            data += length;
+        }
+
+        *this = StringDictionary{std::move(strings)};
+    }
+
+}; // class StringDictionary
+
+/**
+ * Encode OSM objects into the compact format.
+ */
+class CompactEncoder {
+
+    const StringDictionary& m_dictionary;
+    std::string m_body;
+    std::string m_record;
+
+    void add_varint(uint64_t value) {
+        protozero::write_varint(std::back_inserter(m_body), value);
+    }
+
+    void add_zigzag(int64_t value) {
+        add_varint(protozero::encode_zigzag64(value));
+    }
+
+    void add_string(const char* str) {
+        const int64_t index = m_dictionary.find(str);
+        if (index >= 0) {
+            add_varint(uint64_t(index) << 1);
+        } else {
+            const std::size_t length = std::strlen(str);
+            add_varint((uint64_t(length) << 1) | 1);
+            m_body.append(str, length);
+        }
+    }
+
+public:
+
+    explicit CompactEncoder(const StringDictionary& dictionary) :
+        m_dictionary(dictionary) {
+    }
+
+    /**
+     * Encode an object. The returned record is only valid until the
+     * next call.
+     */
+    const std::string& operator()(const osmium::OSMObject& object) {
+        m_body.clear();
+
+        m_body += char(uint8_t(object.type()) | (object.visible() ? 0x80 : 0x00));
+        add_zigzag(object.id());
+        add_varint(object.version());
+        add_varint(object.changeset());
+        add_varint(object.timestamp().seconds_since_epoch());
+        add_varint(object.uid());
+        add_string(object.user());
+
+        add_varint(object.tags().size());
+        for (const auto& tag : object.tags()) {
+            add_string(tag.key());
+            add_string(tag.value());
+        }
+
+        switch (object.type()) {
+            case osmium::item_type::node: {
+                    const auto& location = static_cast<const osmium::Node&>(object).location();
+                    add_zigzag(location.x());
+                    add_zigzag(location.y());
+                }
+                break;
+            case osmium::item_type::way: {
+                    const auto& nodes = static_cast<const osmium::Way&>(object).nodes();
+                    add_varint(nodes.size());
+                    osmium::object_id_type last = 0;
+                    for (const auto& node_ref : nodes) {
+                        add_zigzag(node_ref.ref() - last);
+                        last = node_ref.ref();
+                    }
+                }
+                break;
+            case osmium::item_type::relation: {
+                    const auto& members = static_cast<const osmium::Relation&>(object).members();
+                    add_varint(members.size());
+                    osmium::object_id_type last = 0;
+                    for (const auto& member : members) {
+                        m_body += char(member.type());
+                        add_zigzag(member.ref() - last);
+                        last = member.ref();
+                        add_string(member.role());
+                    }
+                }
+                break;
+            default:
+                throw std::runtime_error{"compact encoding only supports nodes, ways, and relations"};
+        }
+
+        m_record.clear();
+        protozero::write_varint(std::back_inserter(m_record), m_body.size());
+        m_record += m_body;
+
+        return m_record;
+    }
+
+}; // class CompactEncoder
+
+/**
+ * Decode objects in compact format back into an osmium::memory::Buffer.
+ */
+class CompactDecoder {
+
+    const StringDictionary& m_dictionary;
+
+    struct string_ref {
+        const char* data;
+        std::size_t size;
+    };
+
+    static uint64_t get_varint(const char** data, const char* end) {
+        return protozero::decode_varint(data, end);
+    }
+
+    static int64_t get_zigzag(const char** data, const char* end) {
+        return protozero::decode_zigzag64(protozero::decode_varint(data, end));
+    }
+
+    static uint8_t get_byte(const char** data, const char* end) {
+        if (*data == end) {
+            throw std::runtime_error{"compact record is truncated"};
+        }
+        return uint8_t(*(*data)++);
+    }
+
+    string_ref get_string(const char** data, const char* end) const {
+        const uint64_t value = get_varint(data, end);
+        if ((value & 1) == 0) {
+            const std::string& str = m_dictionary.get(uint32_t(value >> 1));
+            return string_ref{str.data(), str.size()};
+        }
+        const std::size_t size = value >> 1;
+        if (size > std::size_t(end - *data)) {
+            throw std::runtime_error{"compact record is truncated"};
+        }
+        const string_ref str{*data, size};
+        *data += size;
+        return str;
+    }
+
+    template <typename TBuilder>
+    void decode_common(const char** data, const char* end, TBuilder& builder, bool visible) const {
+        auto& object = builder.object();
+        object.set_id(get_zigzag(data, end));
+        object.set_visible(visible);
+        object.set_version(osmium::object_version_type(get_varint(data, end)));
+        object.set_changeset(osmium::changeset_id_type(get_varint(data, end)));
+        object.set_timestamp(osmium::Timestamp{uint32_t(get_varint(data, end))});
+        object.set_uid(osmium::user_id_type(get_varint(data, end)));
+
+        const string_ref user = get_string(data, end);
+        builder.set_user(user.data, osmium::string_size_type(user.size));
+
+        auto num_tags = get_varint(data, end);
+        if (num_tags > 0) {
+            osmium::builder::TagListBuilder tl_builder{builder};
+            while (num_tags--) {
+                const string_ref key = get_string(data, end);
+                const string_ref value = get_string(data, end);
+                tl_builder.add_tag(key.data, key.size, value.data, value.size);
+            }
+        }
+    }
+
+public:
+
+    explicit CompactDecoder(const StringDictionary& dictionary) :
+        m_dictionary(dictionary) {
+    }
+
+    /**
+     * Decode the record starting at data and add the object to the
+     * buffer. Returns a pointer to the start of the next record.
+     */
+    const char* operator()(const char* data, const char* end, osmium::memory::Buffer& buffer) const {
+        const uint64_t length = get_varint(&data, end);
+        if (length > uint64_t(end - data)) {
+            throw std::runtime_error{"compact record is truncated"};
+        }
+        end = data + length;
+
+        const uint8_t type_and_flags = get_byte(&data, end);
+        const bool visible = (type_and_flags & 0x80) != 0;
+
+        switch (osmium::item_type(type_and_flags & 0x7f)) {
+            case osmium::item_type::node: {
+                    osmium::builder::NodeBuilder builder{buffer};
+                    decode_common(&data, end, builder, visible);
+                    const auto x = int32_t(get_zigzag(&data, end));
+                    const auto y = int32_t(get_zigzag(&data, end));
+                    builder.object().set_location(osmium::Location{x, y});
+                }
+                break;
+            case osmium::item_type::way: {
+                    osmium::builder::WayBuilder builder{buffer};
+                    decode_common(&data, end, builder, visible);
+                    auto num_nodes = get_varint(&data, end);
+                    osmium::builder::WayNodeListBuilder wnl_builder{builder};
+                    osmium::object_id_type ref = 0;
+                    while (num_nodes--) {
+                        ref += get_zigzag(&data, end);
+                        wnl_builder.add_node_ref(ref);
+                    }
+                }
+                break;
+            case osmium::item_type::relation: {
+                    osmium::builder::RelationBuilder builder{buffer};
+                    decode_common(&data, end, builder, visible);
+                    auto num_members = get_varint(&data, end);
+                    osmium::builder::RelationMemberListBuilder rml_builder{builder};
+                    osmium::object_id_type ref = 0;
+                    while (num_members--) {
+                        const auto type = osmium::item_type(get_byte(&data, end));
+                        ref += get_zigzag(&data, end);
+                        const string_ref role = get_string(&data, end);
+                        rml_builder.add_member(type, ref, role.data, role.size);
+                    }
+                }
+                break;
+            default:
+                throw std::runtime_error{"unknown object type in compact record"};
+        }
+        buffer.commit();
+
+        return end;
+    }
+
+}; // class CompactDecoder
+
+/**
+ * Random access to the objects in the compact data file through the
+ * nodes.compact.sparse.idx, ways.compact.sparse.idx, and
+ * relations.compact.sparse.idx indexes written by eodb_compact.
+ */
+class CompactData {
+
+    typedef std::pair<osmium::unsigned_object_id_type, std::size_t> element_type;
+
+    StringDictionary m_dictionary;
+    std::unique_ptr<MappedFile> m_data;
+    std::unique_ptr<MappedFile> m_indexes[3];
+
+public:
+
+    explicit CompactData(const std::string& database) :
+        m_data(new MappedFile{database + DEFAULT_COMPACT_DATA_FILE}) {
+        m_dictionary.read(database + DEFAULT_COMPACT_DICT_FILE);
+        const char* names[3] = {"nodes.compact", "ways.compact", "relations.compact"};
+        for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+            m_indexes[nwr].reset(new MappedFile{index_name(database, names[nwr], false)});
+        }
+    }
+
+    /**
+     * Decode the object with the given type and ID and add it to the
+     * buffer. Returns false if it is not in the compact data.
+     */
+    bool get(osmium::item_type type, osmium::unsigned_object_id_type id, osmium::memory::Buffer& buffer) const {
+        const MappedFile& index = *m_indexes[osmium::item_type_to_nwr_index(type)];
+        const auto* first = reinterpret_cast<const element_type*>(index.data());
+        const auto* last = first + index.size() / sizeof(element_type);
+        const auto it = std::lower_bound(first, last, id, [](const element_type& element, osmium::unsigned_object_id_type value) {
+            return element.first < value;
+        });
+        if (it == last || it->first != id) {
+            return false;
+        }
+
+        const char* data = reinterpret_cast<const char*>(m_data->data());
+        if (it->second >= m_data->size()) {
+            throw std::runtime_error{"offset is beyond end of compact data file"};
+        }
+        const CompactDecoder decoder{m_dictionary};
+        decoder(data + it->second, data + m_data->size(), buffer);
+        return true;
+    }
+
+}; // class CompactData
+
+#endif // COMPACT_ENCODING_HPP
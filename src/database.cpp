@@ -0,0 +1,277 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+// c++
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+// osmium
+#include <osmium/index/index.hpp>
+
+// eodb
+#include "database.hpp"
+#include "eodb.hpp"
+#include "index_reader.hpp"
+#include "map_delta.hpp"
+#include "mapped_file.hpp"
+#include "snapshot.hpp"
+#include "way_geometry.hpp"
+
+namespace eodb {
+
+    namespace {
+
+        const char* const index_names[3] = {"nodes", "ways", "relations"};
+        const char* const map_names[4] = {"node2way", "node2relation", "way2relation", "relation2relation"};
+
+        /**
+         * One map of the generation: the map file with its membership
+         * filter and the delta written by updates (if any).
+         */
+        class MapFile {
+
+            MapSnapshot m_map;
+
+        public:
+
+            MapFile(const std::string& directory, const SnapshotManifest::delta_files& files) :
+                m_map(directory, files) {
+            }
+
+            IdSpan find(osmium::unsigned_object_id_type id) const {
+                if (!m_map.has_delta()) {
+                    const auto range = m_map.find_in_base(id);
+                    return IdSpan{range.first, range.second};
+                }
+
+                std::shared_ptr<std::vector<IdSpan::element_type>> elements{new std::vector<IdSpan::element_type>{}};
+                m_map.for_each_parent(id, [&](osmium::unsigned_object_id_type parent) {
+                    elements->emplace_back(id, parent);
+                });
+                std::sort(elements->begin(), elements->end());
+                return IdSpan{std::move(elements)};
+            }
+
+        }; // class MapFile
+
+        std::vector<osmium::unsigned_object_id_type> sorted_unique(std::vector<osmium::unsigned_object_id_type>& ids) {
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+            return std::move(ids);
+        }
+
+    } // anonymous namespace
+
+    struct Database::impl {
+
+        std::string directory;
+        SnapshotManifest manifest;
+        bool has_manifest;
+        MappedFile data_file;
+        std::size_t data_size;
+        std::unique_ptr<IndexReader<std::size_t>> indexes[3];
+        std::unique_ptr<MapFile> maps[4];
+        std::unique_ptr<WayGeometryStore> way_geometries;
+
+        explicit impl(const std::string& dir) :
+            directory(dir),
+            manifest(),
+            has_manifest(manifest.read(dir)),
+            data_file(dir + DEFAULT_DATA_FILE),
+            data_size(data_file.size()) {
+
+            // data appended by an update that is still running is not
+            // part of this generation (also in generation 0, its manifest
+            // is written by eodb_create)
+            if (has_manifest) {
+                data_size = std::min(std::size_t(manifest.data_size), data_size);
+            }
+
+            for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+                indexes[nwr].reset(new IndexReader<std::size_t>{directory, index_names[nwr], manifest});
+            }
+
+            for (unsigned int n = 0; n < 4; ++n) {
+                const auto files = snapshot_map_files(directory, manifest, map_names[n]);
+                if (!files.base.empty() || !files.delta.empty()) {
+                    maps[n].reset(new MapFile{directory, files});
+                }
+            }
+
+            const auto geometry_files = snapshot_way_geometry_files(directory, manifest);
+            if (!geometry_files.base.empty()) {
+                way_geometries.reset(new WayGeometryStore{directory, geometry_files});
+            }
+        }
+
+        const MapFile& map(unsigned int n) const {
+            if (!maps[n]) {
+                throw std::runtime_error{std::string{"No "} + map_names[n] + " map in database"};
+            }
+            return *maps[n];
+        }
+
+        const MapFile& member_map(osmium::item_type type) const {
+            switch (type) {
+                case osmium::item_type::node:
+                    return map(1);
+                case osmium::item_type::way:
+                    return map(2);
+                case osmium::item_type::relation:
+                    return map(3);
+                default:
+                    break;
+            }
+            throw std::invalid_argument{"Members can only be nodes, ways, or relations"};
+        }
+
+        const osmium::OSMObject* find(osmium::item_type type, osmium::unsigned_object_id_type id) const {
+            std::size_t offset;
+            if (!indexes[osmium::item_type_to_nwr_index(type)]->get(id, offset) || offset >= data_size) {
+                return nullptr;
+            }
+            return reinterpret_cast<const osmium::OSMObject*>(data_file.data() + offset);
+        }
+
+    }; // struct Database::impl
+
+    Database::Database(const std::string& directory) :
+        m_impl(new impl{directory}) {
+    }
+
+    Database::~Database() = default;
+
+    Database::Database(Database&&) noexcept = default;
+
+    Database& Database::operator=(Database&&) noexcept = default;
+
+    const std::string& Database::directory() const noexcept {
+        return m_impl->directory;
+    }
+
+    uint64_t Database::generation() const noexcept {
+        return m_impl->manifest.generation;
+    }
+
+    osmium::memory::Buffer Database::data() const {
+        return osmium::memory::Buffer{m_impl->data_file.data(), m_impl->data_size};
+    }
+
+    const osmium::OSMObject& Database::object_at(std::size_t offset) const {
+        if (offset >= m_impl->data_size || offset % osmium::memory::align_bytes != 0) {
+            throw std::out_of_range{"Offset not in data file"};
+        }
+        return *reinterpret_cast<const osmium::OSMObject*>(m_impl->data_file.data() + offset);
+    }
+
+    const osmium::OSMObject* Database::find_object(osmium::item_type type, osmium::unsigned_object_id_type id) const {
+        return m_impl->find(type, id);
+    }
+
+    std::vector<const osmium::OSMObject*> Database::find_objects(osmium::item_type type, const std::vector<osmium::unsigned_object_id_type>& ids) const {
+        std::vector<std::size_t> order(ids.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&ids](std::size_t a, std::size_t b) {
+            return ids[a] < ids[b];
+        });
+
+        std::vector<const osmium::OSMObject*> objects(ids.size());
+        for (const auto i : order) {
+            objects[i] = m_impl->find(type, ids[i]);
+        }
+        return objects;
+    }
+
+    const osmium::Node& Database::get_node(osmium::unsigned_object_id_type id) const {
+        const auto* object = m_impl->find(osmium::item_type::node, id);
+        if (!object) {
+            throw osmium::not_found{id};
+        }
+        return static_cast<const osmium::Node&>(*object);
+    }
+
+    const osmium::Way& Database::get_way(osmium::unsigned_object_id_type id) const {
+        const auto* object = m_impl->find(osmium::item_type::way, id);
+        if (!object) {
+            throw osmium::not_found{id};
+        }
+        return static_cast<const osmium::Way&>(*object);
+    }
+
+    const osmium::Relation& Database::get_relation(osmium::unsigned_object_id_type id) const {
+        const auto* object = m_impl->find(osmium::item_type::relation, id);
+        if (!object) {
+            throw osmium::not_found{id};
+        }
+        return static_cast<const osmium::Relation&>(*object);
+    }
+
+    IdSpan Database::ways_of_node(osmium::unsigned_object_id_type id) const {
+        return m_impl->map(0).find(id);
+    }
+
+    IdSpan Database::relations_of_member(osmium::item_type type, osmium::unsigned_object_id_type id) const {
+        return m_impl->member_map(type).find(id);
+    }
+
+    std::vector<osmium::unsigned_object_id_type> Database::ways_of_nodes(std::vector<osmium::unsigned_object_id_type> ids) const {
+        const auto& map = m_impl->map(0);
+        std::vector<osmium::unsigned_object_id_type> result;
+        for (const auto id : sorted_unique(ids)) {
+            const auto span = map.find(id);
+            result.insert(result.end(), span.begin(), span.end());
+        }
+        return sorted_unique(result);
+    }
+
+    std::vector<osmium::unsigned_object_id_type> Database::relations_of_members(osmium::item_type type, std::vector<osmium::unsigned_object_id_type> ids) const {
+        const auto& map = m_impl->member_map(type);
+        std::vector<osmium::unsigned_object_id_type> result;
+        for (const auto id : sorted_unique(ids)) {
+            const auto span = map.find(id);
+            result.insert(result.end(), span.begin(), span.end());
+        }
+        return sorted_unique(result);
+    }
+
+    bool Database::way_locations(osmium::unsigned_object_id_type id, std::vector<osmium::Location>& locations) const {
+        WayGeometry geometry;
+        if (!m_impl->way_geometries || !m_impl->way_geometries->find(id, geometry)) {
+            return false;
+        }
+        locations = geometry.locations();
+        return true;
+    }
+
+    osmium::Box Database::way_bbox(osmium::unsigned_object_id_type id) const {
+        WayGeometry geometry;
+        if (!m_impl->way_geometries || !m_impl->way_geometries->find(id, geometry)) {
+            return osmium::Box{};
+        }
+        return geometry.bbox();
+    }
+
+} // namespace eodb
+
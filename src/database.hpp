@@ -0,0 +1,244 @@
+#ifndef DATABASE_HPP
+#define DATABASE_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+/*
+ * Embeddable read-only access to an EODB database (library "libeodb").
+ *
+ * All objects returned are references into the memory mapped data file,
+ * ID lists are views into the memory mapped map files (or hold a copy if
+ * the map has been changed by an update). They are valid
+ * as long as the Database object exists. A Database sees the generation
+ * of the database that was current when it was opened, updates running
+ * at the same time are not visible.
+ */
+
+namespace eodb {
+
+    /**
+     * View of the IDs stored for one ID in a map (for instance the IDs of
+     * all ways that contain a node). If the map has a delta written by an
+     * update, the span owns the merged entries.
+     */
+    class IdSpan {
+
+    public:
+
+        typedef std::pair<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> element_type;
+
+        class const_iterator {
+
+            const element_type* m_element;
+
+        public:
+
+            typedef std::forward_iterator_tag iterator_category;
+            typedef osmium::unsigned_object_id_type value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const osmium::unsigned_object_id_type* pointer;
+            typedef const osmium::unsigned_object_id_type& reference;
+
+            explicit const_iterator(const element_type* element) noexcept :
+                m_element(element) {
+            }
+
+            reference operator*() const noexcept {
+                return m_element->second;
+            }
+
+            const_iterator& operator++() noexcept {
+                ++m_element;
+                return *this;
+            }
+
+            const_iterator operator++(int) noexcept {
+                const_iterator tmp{*this};
+                ++m_element;
+                return tmp;
+            }
+
+            bool operator==(const const_iterator& other) const noexcept {
+                return m_element == other.m_element;
+            }
+
+            bool operator!=(const const_iterator& other) const noexcept {
+                return m_element != other.m_element;
+            }
+
+        }; // class const_iterator
+
+    private:
+
+        std::shared_ptr<const std::vector<element_type>> m_elements;
+        const element_type* m_begin = nullptr;
+        const element_type* m_end = nullptr;
+
+    public:
+
+        IdSpan() = default;
+
+        IdSpan(const element_type* begin, const element_type* end) noexcept :
+            m_begin(begin),
+            m_end(end) {
+        }
+
+        explicit IdSpan(std::shared_ptr<const std::vector<element_type>> elements) noexcept :
+            m_elements(std::move(elements)),
+            m_begin(m_elements->data()),
+            m_end(m_elements->data() + m_elements->size()) {
+        }
+
+        const_iterator begin() const noexcept {
+            return const_iterator{m_begin};
+        }
+
+        const_iterator end() const noexcept {
+            return const_iterator{m_end};
+        }
+
+        std::size_t size() const noexcept {
+            return std::size_t(m_end - m_begin);
+        }
+
+        bool empty() const noexcept {
+            return m_begin == m_end;
+        }
+
+        osmium::unsigned_object_id_type operator[](std::size_t n) const noexcept {
+            return m_begin[n].second;
+        }
+
+    }; // class IdSpan
+
+    class Database {
+
+        struct impl;
+        std::unique_ptr<impl> m_impl;
+
+    public:
+
+        /**
+         * Open database in directory read-only. Throws if the data file
+         * or one of the node, way, or relation indexes can't be opened.
+         * Maps are optional.
+         */
+        explicit Database(const std::string& directory);
+
+        ~Database();
+
+        Database(Database&&) noexcept;
+        Database& operator=(Database&&) noexcept;
+
+        Database(const Database&) = delete;
+        Database& operator=(const Database&) = delete;
+
+        const std::string& directory() const noexcept;
+
+        /// Generation of the database this object sees.
+        uint64_t generation() const noexcept;
+
+        /// Non-owning buffer with all objects in the data file.
+        osmium::memory::Buffer data() const;
+
+        /// Object at the offset in the data file.
+        const osmium::OSMObject& object_at(std::size_t offset) const;
+
+        /**
+         * Find object of given type (node, way, or relation) by ID.
+         * Returns nullptr if it is not in the database.
+         */
+        const osmium::OSMObject* find_object(osmium::item_type type, osmium::unsigned_object_id_type id) const;
+
+        /**
+         * Find several objects. The result has an entry (nullptr if not
+         * found) for each ID in the same order as the ids. The lookups
+         * are done in ID order which is much faster for many IDs.
+         */
+        std::vector<const osmium::OSMObject*> find_objects(osmium::item_type type, const std::vector<osmium::unsigned_object_id_type>& ids) const;
+
+        /// Get node by ID. Throws osmium::not_found if it is not there.
+        const osmium::Node& get_node(osmium::unsigned_object_id_type id) const;
+
+        /// Get way by ID. Throws osmium::not_found if it is not there.
+        const osmium::Way& get_way(osmium::unsigned_object_id_type id) const;
+
+        /// Get relation by ID. Throws osmium::not_found if it is not there.
+        const osmium::Relation& get_relation(osmium::unsigned_object_id_type id) const;
+
+        /// IDs of all ways containing the node (needs node2way map).
+        IdSpan ways_of_node(osmium::unsigned_object_id_type id) const;
+
+        /**
+         * IDs of all relations with the given member (needs node2relation,
+         * way2relation, or relation2relation map).
+         */
+        IdSpan relations_of_member(osmium::item_type type, osmium::unsigned_object_id_type id) const;
+
+        /**
+         * Sorted IDs of all ways containing any of the nodes.
+         */
+        std::vector<osmium::unsigned_object_id_type> ways_of_nodes(std::vector<osmium::unsigned_object_id_type> ids) const;
+
+        /**
+         * Sorted IDs of all relations with any of the objects of the given
+         * type as member.
+         */
+        std::vector<osmium::unsigned_object_id_type> relations_of_members(osmium::item_type type, std::vector<osmium::unsigned_object_id_type> ids) const;
+
+        /**
+         * Get the locations of the nodes of the way from the way geometry
+         * store. Returns false if there is no store or the way is not in it.
+         */
+        bool way_locations(osmium::unsigned_object_id_type id, std::vector<osmium::Location>& locations) const;
+
+        /**
+         * Bounding box of the way from the way geometry store. The box is
+         * invalid if the way is not there.
+         */
+        osmium::Box way_bbox(osmium::unsigned_object_id_type id) const;
+
+    }; // class Database
+
+} // namespace eodb
+
+#endif // DATABASE_HPP
@@ -31,8 +31,13 @@ enum return_code : int {
 
 #define DEFAULT_EODB_NAME "test.eodb"
 #define DEFAULT_DATA_FILE "/data.osr"
+#define DEFAULT_COMPACT_DATA_FILE "/data.cosr"
+#define DEFAULT_COMPACT_DICT_FILE "/strings.dict"
 
+#include <initializer_list>
 #include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 inline std::string index_name(const std::string& database, const std::string& index, bool dense) {
     std::string name{database + "/" + index + "."};
@@ -41,9 +46,62 @@ inline std::string index_name(const std::string& database, const std::string& in
     return name;
 }
 
+inline bool file_exists(const std::string& name) {
+    struct stat s;
+    return ::stat(name.c_str(), &s) == 0;
+}
+
+enum class index_format {
+    none,
+    sparse,
+    dense,
+    eytzinger,
+    paged,
+    packed32,
+    packed40
+};
+
+inline const char* index_format_name(index_format format) noexcept {
+    switch (format) {
+        case index_format::dense:
+            return "dense";
+        case index_format::eytzinger:
+            return "eytzinger";
+        case index_format::paged:
+            return "paged";
+        case index_format::packed32:
+            return "packed32";
+        case index_format::packed40:
+            return "packed40";
+        default:
+            break;
+    }
+    return "sparse";
+}
+
+inline std::string index_name(const std::string& database, const std::string& index, index_format format) {
+    return database + "/" + index + "." + index_format_name(format) + ".idx";
+}
+
+/**
+ * Find out in which format an index is stored in the database.
+ */
+inline index_format detect_index_format(const std::string& database, const std::string& index) {
+    for (const auto format : {index_format::sparse, index_format::eytzinger, index_format::dense, index_format::paged, index_format::packed32, index_format::packed40}) {
+        if (file_exists(index_name(database, index, format))) {
+            return format;
+        }
+    }
+    return index_format::none;
+}
+
 inline std::string map_name(const std::string& database, const std::string& map) {
     return database + "/" + map + ".map";
 }
 
+inline std::string column_name(const std::string& database, const std::string& column) {
+    return database + "/nodes." + column + ".col";
+}
+
 
 #endif // EODB_HPP
@@ -0,0 +1,460 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// boost
+#include <boost/program_options.hpp>
+
+// osmium
+#include <osmium/area/assembler.hpp>
+#include <osmium/builder/osm_object_builder.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "database.hpp"
+#include "mapped_file.hpp"
+#include "options.hpp"
+#include "output_file.hpp"
+#include "eodb.hpp"
+
+typedef std::pair<osmium::unsigned_object_id_type, std::size_t> area_index_element;
+
+// relations assembled in one batch (split between the threads)
+const std::size_t relations_per_batch = 10000;
+
+// offset in index entries of relations without area
+const std::size_t no_area = std::numeric_limits<std::size_t>::max();
+
+class Options : public OptionsBase {
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description desc{"Allowed options"};
+            desc.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("threads,j", po::value<unsigned int>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Number of threads")
+                ("update,u", "Only reassemble areas affected by changes since the last run")
+            ;
+
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_areas");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_areas [OPTIONS]\n";
+                std::cout << "Assemble areas from multipolygon and boundary relations.\n\n";
+                std::cout << desc << "\n";
+                std::exit(return_code::okay);
+            }
+
+            if (threads() == 0) {
+                std::cerr << "Number of threads must be at least 1\n";
+                std::exit(return_code::fatal);
+            }
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+    unsigned int threads() const {
+        return vm["threads"].as<unsigned int>();
+    }
+
+    bool update() const {
+        return vm.count("update") != 0;
+    }
+
+}; // class Options
+
+inline std::string areas_name(const std::string& database) {
+    return database + "/areas.osr";
+}
+
+inline std::string areas_index_name(const std::string& database) {
+    return database + "/areas.idx";
+}
+
+inline std::string areas_state_name(const std::string& database) {
+    return database + "/areas.state";
+}
+
+bool is_area_relation(const osmium::Relation& relation) {
+    const char* type = relation.tags().get_value_by_key("type");
+    return type && (!std::strcmp(type, "multipolygon") || !std::strcmp(type, "boundary"));
+}
+
+/**
+ * Assembles areas from relations. Member ways and node locations are
+ * read through the database. Each thread has its own AreaAssembler.
+ */
+class AreaAssembler {
+
+    const eodb::Database& m_db;
+    osmium::area::Assembler m_assembler;
+    osmium::memory::Buffer m_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    std::vector<std::size_t> m_offsets;
+    std::vector<const osmium::Way*> m_ways;
+    std::vector<osmium::Location> m_locations;
+
+    /**
+     * Copy the way into the buffer and set the node locations, from the
+     * way geometry store if it is complete, otherwise from the nodes.
+     */
+    void add_way(const osmium::Way& way) {
+        m_offsets.push_back(m_buffer.committed());
+        auto& copy = m_buffer.add_item(way);
+        m_buffer.commit();
+
+        if (m_db.way_locations(way.positive_id(), m_locations) && m_locations.size() == copy.nodes().size()) {
+            auto it = m_locations.cbegin();
+            for (auto& node_ref : copy.nodes()) {
+                node_ref.set_location(*it++);
+            }
+            return;
+        }
+
+        for (auto& node_ref : copy.nodes()) {
+            const auto* node = m_db.find_object(osmium::item_type::node, node_ref.positive_ref());
+            if (node && node->visible()) {
+                node_ref.set_location(static_cast<const osmium::Node*>(node)->location());
+            }
+        }
+    }
+
+    /**
+     * Copy the relation with only the way members into the buffer. Returns
+     * false if a member way is missing.
+     */
+    bool add_relation(const osmium::Relation& relation) {
+        std::vector<const osmium::Way*> ways;
+        for (const auto& member : relation.members()) {
+            if (member.type() == osmium::item_type::way) {
+                const auto* way = m_db.find_object(osmium::item_type::way, member.positive_ref());
+                if (!way || !way->visible()) {
+                    return false;
+                }
+                ways.push_back(static_cast<const osmium::Way*>(way));
+            }
+        }
+
+        {
+            osmium::builder::RelationBuilder builder{m_buffer};
+            auto& object = builder.object();
+            object.set_id(relation.id());
+            object.set_version(relation.version());
+            object.set_changeset(relation.changeset());
+            object.set_timestamp(relation.timestamp());
+            object.set_uid(relation.uid());
+            builder.set_user(relation.user());
+            {
+                osmium::builder::TagListBuilder tl_builder{builder};
+                for (const auto& tag : relation.tags()) {
+                    tl_builder.add_tag(tag.key(), tag.value());
+                }
+            }
+            osmium::builder::RelationMemberListBuilder rml_builder{builder};
+            for (const auto& member : relation.members()) {
+                if (member.type() == osmium::item_type::way) {
+                    rml_builder.add_member(member.type(), member.ref(), member.role());
+                }
+            }
+        }
+        m_buffer.commit();
+
+        for (const auto* way : ways) {
+            add_way(*way);
+        }
+        return true;
+    }
+
+public:
+
+    explicit AreaAssembler(const eodb::Database& db) :
+        m_db(db),
+        m_assembler(osmium::area::AssemblerConfig{}) {
+    }
+
+    /**
+     * Assemble the area for the relation into the buffer. Returns false
+     * if there is no (valid) area.
+     */
+    bool operator()(const osmium::Relation& relation, osmium::memory::Buffer& out) {
+        m_buffer.clear();
+        m_offsets.clear();
+        if (!add_relation(relation)) {
+            return false;
+        }
+
+        // the buffer can be reallocated while ways are added, get the
+        // pointers afterwards
+        m_ways.clear();
+        for (const auto offset : m_offsets) {
+            m_ways.push_back(&m_buffer.get<osmium::Way>(offset));
+        }
+
+        return m_assembler(m_buffer.get<osmium::Relation>(0), m_ways, out);
+    }
+
+}; // class AreaAssembler
+
+/**
+ * Assemble the areas of the relations with these (sorted) IDs in batches
+ * with several threads and append them to the areas file. Returns index
+ * entries for all relations, with offset no_area for relations without
+ * area.
+ */
+std::vector<area_index_element> assemble_areas(const eodb::Database& db, const std::vector<osmium::unsigned_object_id_type>& ids, OutputFile& file, std::size_t base_offset, unsigned int num_threads) {
+    std::vector<std::unique_ptr<AreaAssembler>> assemblers;
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        assemblers.emplace_back(new AreaAssembler{db});
+    }
+
+    std::vector<area_index_element> index;
+    index.reserve(ids.size());
+
+    for (std::size_t batch = 0; batch < ids.size(); batch += relations_per_batch) {
+        const std::size_t batch_end = std::min(ids.size(), batch + relations_per_batch);
+        const std::size_t slice_size = (batch_end - batch + num_threads - 1) / num_threads;
+
+        std::vector<std::future<osmium::memory::Buffer>> results;
+        for (unsigned int t = 0; t < num_threads; ++t) {
+            const std::size_t first = std::min(batch_end, batch + t * slice_size);
+            const std::size_t last = std::min(batch_end, first + slice_size);
+            results.push_back(std::async(std::launch::async, [&db, &ids, &assemblers, t, first, last]() {
+                osmium::memory::Buffer out{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+                for (std::size_t i = first; i < last; ++i) {
+                    const auto* relation = db.find_object(osmium::item_type::relation, ids[i]);
+                    if (relation && relation->visible()) {
+                        (*assemblers[t])(static_cast<const osmium::Relation&>(*relation), out);
+                    }
+                }
+                return out;
+            }));
+        }
+
+        std::size_t next = batch;
+        for (auto& result : results) {
+            const osmium::memory::Buffer out{result.get()};
+            for (auto it = out.cbegin<osmium::Area>(); it != out.cend<osmium::Area>(); ++it) {
+                const auto id = osmium::unsigned_object_id_type(it->orig_id());
+                for (; next < batch_end && ids[next] < id; ++next) {
+                    index.emplace_back(ids[next], no_area);
+                }
+                if (next < batch_end && ids[next] == id) {
+                    ++next;
+                }
+                index.emplace_back(id, base_offset + file.size());
+                file.write(it->data(), it->padded_size());
+            }
+        }
+        for (; next < batch_end; ++next) {
+            index.emplace_back(ids[next], no_area);
+        }
+    }
+
+    return index;
+}
+
+/**
+ * IDs of all current multipolygon and boundary relations.
+ */
+std::vector<osmium::unsigned_object_id_type> all_area_relations(const eodb::Database& db) {
+    std::vector<osmium::unsigned_object_id_type> ids;
+    const osmium::memory::Buffer data{db.data()};
+    for (auto it = data.cbegin<osmium::Relation>(); it != data.cend<osmium::Relation>(); ++it) {
+        if (it->visible() && is_area_relation(*it) &&
+            db.find_object(osmium::item_type::relation, it->positive_id()) == &*it) {
+            ids.push_back(it->positive_id());
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+/**
+ * IDs of all relations that might have a different area because they or
+ * one of their member ways or nodes changed after data_size. The members
+ * are found through the maps of the generation the database was opened
+ * with, including the deltas of all updates, like find_affected_objects()
+ * in eodb_update does.
+ */
+std::vector<osmium::unsigned_object_id_type> changed_area_relations(const eodb::Database& db, std::size_t data_size) {
+    std::vector<osmium::unsigned_object_id_type> nodes;
+    std::vector<osmium::unsigned_object_id_type> ways;
+    std::vector<osmium::unsigned_object_id_type> relations;
+
+    osmium::memory::Buffer data{db.data()};
+    if (data_size > data.committed()) {
+        throw std::runtime_error{"Data file is smaller than at the last run"};
+    }
+    for (auto it = data.get_iterator<osmium::OSMObject>(data_size); it != data.end<osmium::OSMObject>(); ++it) {
+        switch (it->type()) {
+            case osmium::item_type::node:
+                nodes.push_back(it->positive_id());
+                break;
+            case osmium::item_type::way:
+                ways.push_back(it->positive_id());
+                break;
+            case osmium::item_type::relation:
+                relations.push_back(it->positive_id());
+                break;
+            default:
+                break;
+        }
+    }
+
+    const auto node_ways = db.ways_of_nodes(std::move(nodes));
+    ways.insert(ways.end(), node_ways.cbegin(), node_ways.cend());
+    const auto way_relations = db.relations_of_members(osmium::item_type::way, std::move(ways));
+    relations.insert(relations.end(), way_relations.cbegin(), way_relations.cend());
+
+    std::sort(relations.begin(), relations.end());
+    relations.erase(std::unique(relations.begin(), relations.end()), relations.end());
+
+    // relations that are not (or no longer) areas are assembled, too, so
+    // that their areas are removed
+    return relations;
+}
+
+std::size_t read_state(const std::string& database) {
+    std::ifstream file{areas_state_name(database)};
+    std::string keyword;
+    std::size_t data_size = 0;
+    if (!(file >> keyword >> data_size) || keyword != "data_size") {
+        throw std::runtime_error{"Can't read areas state, run eodb_areas without --update first"};
+    }
+    return data_size;
+}
+
+void write_file(const std::string& filename, const void* data, std::size_t size) {
+    const std::string tmp_filename{filename + ".tmp"};
+    OutputFile file{tmp_filename};
+    file.write(data, size);
+    file.sync();
+    file.close();
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        throw std::system_error{errno, std::system_category(), "Renaming '" + tmp_filename + "' failed"};
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    try {
+        const eodb::Database db{options.database()};
+        const std::size_t data_size = db.data().committed();
+
+        std::vector<osmium::unsigned_object_id_type> ids;
+        std::unique_ptr<OutputFile> file;
+        std::size_t base_offset = 0;
+
+        if (options.update()) {
+            ids = changed_area_relations(db, read_state(options.database()));
+            const int fd = ::open(areas_name(options.database()).c_str(), O_WRONLY | O_APPEND);
+            if (fd < 0) {
+                throw std::system_error{errno, std::system_category(), "Opening areas file failed"};
+            }
+            struct stat s;
+            if (::fstat(fd, &s) != 0) {
+                ::close(fd);
+                throw std::system_error{errno, std::system_category(), "stat on areas file failed"};
+            }
+            base_offset = s.st_size;
+            file.reset(new OutputFile{fd, areas_name(options.database())});
+        } else {
+            ids = all_area_relations(db);
+            file.reset(new OutputFile{areas_name(options.database())});
+        }
+
+        std::cerr << "Assembling areas for " << ids.size() << " relations with " << options.threads() << " threads\n";
+        auto index = assemble_areas(db, ids, *file, base_offset, options.threads());
+        file->sync();
+        file->close();
+
+        if (options.update()) {
+            // merge new entries into the old index, they replace old ones
+            MappedFile old{areas_index_name(options.database())};
+            const auto* first = reinterpret_cast<const area_index_element*>(old.data());
+            const auto* const last = first + old.size() / sizeof(area_index_element);
+            std::vector<area_index_element> merged;
+            merged.reserve(std::size_t(last - first) + index.size());
+            auto it = index.cbegin();
+            for (; first != last; ++first) {
+                for (; it != index.cend() && it->first < first->first; ++it) {
+                    merged.push_back(*it);
+                }
+                if (it == index.cend() || it->first != first->first) {
+                    merged.push_back(*first);
+                }
+            }
+            merged.insert(merged.end(), it, index.cend());
+            index = std::move(merged);
+        }
+
+        index.erase(std::remove_if(index.begin(), index.end(), [](const area_index_element& element) {
+            return element.second == no_area;
+        }), index.end());
+
+        write_file(areas_index_name(options.database()), index.data(), index.size() * sizeof(area_index_element));
+
+        const std::string state{"data_size " + std::to_string(data_size) + "\n"};
+        write_file(areas_state_name(options.database()), state.data(), state.size());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    return return_code::okay;
+}
@@ -0,0 +1,133 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// boost
+#include <boost/program_options.hpp>
+
+// osmium
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "compact_encoding.hpp"
+#include "eodb.hpp"
+#include "index_files.hpp"
+#include "mapped_file.hpp"
+#include "options.hpp"
+#include "output_file.hpp"
+
+class Options : public OptionsBase {
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description desc{"Allowed options"};
+            desc.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("min-count,c", po::value<uint64_t>()->default_value(100), "Only strings used this often go into the dictionary")
+                ("max-strings,s", po::value<std::size_t>()->default_value(1024 * 1024), "Maximum number of strings in the dictionary")
+            ;
+
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_compact");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_compact [OPTIONS]\n";
+                std::cout << "Write compact copy of the data in the database.\n\n";
+                std::cout << desc << "\n";
+                std::exit(return_code::okay);
+            }
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+    uint64_t min_count() const {
+        return vm["min-count"].as<uint64_t>();
+    }
+
+    std::size_t max_strings() const {
+        return vm["max-strings"].as<std::size_t>();
+    }
+
+}; // class Options
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    try {
+        MappedFile mf{options.data_file_name()};
+        osmium::memory::Buffer buffer{mf.data(), mf.size()};
+
+        StringCounter counter;
+        for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+            counter.add(*it);
+        }
+
+        const StringDictionary dictionary{counter.most_common(options.min_count(), options.max_strings())};
+        dictionary.write(options.database() + DEFAULT_COMPACT_DICT_FILE);
+        std::cerr << "String dictionary has " << dictionary.size() << " entries\n";
+
+        typedef std::vector<std::pair<osmium::unsigned_object_id_type, size_t>> offsets_type;
+        offsets_type offsets[3];
+
+        OutputFile data{options.database() + DEFAULT_COMPACT_DATA_FILE};
+        CompactEncoder encoder{dictionary};
+        for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+            offsets[osmium::item_type_to_nwr_index(it->type())].emplace_back(it->positive_id(), data.size());
+            const std::string& record = encoder(*it);
+            data.write(record.data(), record.size());
+        }
+        data.close();
+
+        std::cerr << "Compact data has " << data.size() << " bytes (was " << mf.size() << ")\n";
+
+        write_sparse_list(index_name(options.database(), "nodes.compact", false), offsets[0]);
+        write_sparse_list(index_name(options.database(), "ways.compact", false), offsets[1]);
+        write_sparse_list(index_name(options.database(), "relations.compact", false), offsets[2]);
+
+        mf.close();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return return_code::fatal;
+    }
+
+    return return_code::okay;
+}
+
@@ -26,8 +26,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <set>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
 #ifdef _MSC_VER
@@ -40,7 +44,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // osmium
 #include <osmium/io/any_input.hpp>
 #include <osmium/handler/disk_store.hpp>
-#include <osmium/handler/object_relations.hpp>
 
 // osmium indexes
 #include <osmium/index/map/dense_file_array.hpp>
@@ -57,19 +60,30 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <osmium/handler/node_locations_for_ways.hpp>
 
 // eodb
-#include "any_index.hpp"
 #include "eodb.hpp"
+#include "eytzinger_index.hpp"
+#include "history_index.hpp"
+#include "learned_index.hpp"
+#include "membership_filter.hpp"
+#include "metadata.hpp"
+#include "node_columns.hpp"
 #include "offset_index.hpp"
 #include "options.hpp"
+#include "paged_index.hpp"
+#include "relation_maps.hpp"
+#include "snapshot.hpp"
+#include "spilling_index.hpp"
+#include "tag_index.hpp"
+#include "way_geometry.hpp"
 
 typedef osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location> location_index_type;
 
-typedef AnyMultimap<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> map_type;
 
 class Options : public OptionsBase {
 
     std::string m_index_type{"sparse_mem_array"};
     bool m_use_dense_index{false};
+    index_format m_index_format{index_format::sparse};
 
 public:
 
@@ -78,6 +92,10 @@ public:
             "dense_file_array",
             "dense_mem_array",
             "dense_mmap_array",
+            "packed32_dense_file_array",
+            "packed32_dense_mem_array",
+            "packed40_dense_file_array",
+            "packed40_dense_mem_array",
             "sparse_file_array",
             "sparse_mem_array",
             "sparse_mem_map",
@@ -96,6 +114,14 @@ public:
                 ("index,i", po::value<std::string>(), "Use this node/way/relation index type")
                 ("location,l", po::value<std::string>(), "Use this location index type (default: no location index)")
                 ("maps,m", "Create maps")
+                ("threads,j", po::value<unsigned int>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Number of threads for creating maps")
+                ("columns,c", "Create columnar node store (input must be sorted)")
+                ("tag-index,t", "Create tag index")
+                ("tag-index-memory", po::value<std::size_t>()->default_value(1024), "Memory limit (in MB) for the posting lists of the tag index, spill to disk if exceeded")
+                ("history,H", "Create history index (for full-history input files)")
+                ("way-geometries,g", "Create way geometry store (uses location index, sparse_mem_array if none is given)")
+                ("layout,L", po::value<std::string>()->default_value("list"), "Layout of index files: list, eytzinger (sparse), paged (dense)")
+                ("memory-limit,M", po::value<std::size_t>(), "Memory limit (in MB) for the node/way/relation indexes, spill to disk if exceeded")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -134,8 +160,40 @@ public:
 
                 if (m_index_type.substr(0, 5) == "dense") {
                     m_use_dense_index = true;
+                    m_index_format = index_format::dense;
+                } else if (m_index_type.substr(0, 8) == "packed32") {
+                    m_use_dense_index = true;
+                    m_index_format = index_format::packed32;
+                } else if (m_index_type.substr(0, 8) == "packed40") {
+                    m_use_dense_index = true;
+                    m_index_format = index_format::packed40;
                 }
             }
+
+            if (layout() != "list" && layout() != "eytzinger" && layout() != "paged") {
+                std::cerr << "Layout given with --layout,-L must be one of: list, eytzinger, paged\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (layout() == "eytzinger" && m_use_dense_index) {
+                std::cerr << "The eytzinger layout can only be used with sparse indexes\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (layout() == "paged" && m_index_format != index_format::dense) {
+                std::cerr << "The paged layout can only be used with (unpacked) dense indexes\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (memory_limit() > 0 && m_index_type != "sparse_mem_array" && !file_based_index()) {
+                std::cerr << "The --memory-limit,-M option can only be used with the sparse_mem_array or file based indexes\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (vm["tag-index-memory"].as<std::size_t>() == 0) {
+                std::cerr << "The --tag-index-memory option must be at least 1 (MB)\n";
+                std::exit(return_code::fatal);
+            }
         } catch (const boost::program_options::error& e) {
             std::cerr << "Error parsing command line: " << e.what() << '\n';
             std::exit(return_code::fatal);
@@ -147,7 +205,7 @@ public:
     }
 
     bool file_based_index() const {
-        return m_index_type == "dense_file_array" || m_index_type == "sparse_file_array";
+        return m_index_type.find("_file_array") != std::string::npos;
     }
 
     std::string location_index_type() const {
@@ -161,22 +219,67 @@ public:
         return m_use_dense_index;
     }
 
+    index_format file_format() const {
+        return m_index_format;
+    }
+
+    std::string layout() const {
+        return vm["layout"].as<std::string>();
+    }
+
     bool create_maps() const {
         return vm.count("maps") > 0;
     }
 
+    unsigned int threads() const {
+        return vm["threads"].as<unsigned int>();
+    }
+
+    bool create_columns() const {
+        return vm.count("columns") > 0;
+    }
+
+    bool create_tag_index() const {
+        return vm.count("tag-index") > 0;
+    }
+
+    /// Memory limit for the tag index in bytes.
+    std::size_t tag_index_memory_limit() const {
+        return vm["tag-index-memory"].as<std::size_t>() * 1024 * 1024;
+    }
+
+    bool create_history_index() const {
+        return vm.count("history") > 0;
+    }
+
+    bool create_way_geometries() const {
+        return vm.count("way-geometries") > 0;
+    }
+
+    /// Memory limit in bytes, 0 if there is none.
+    std::size_t memory_limit() const {
+        if (vm.count("memory-limit") == 0) {
+            return 0;
+        }
+        return vm["memory-limit"].as<std::size_t>() * 1024 * 1024;
+    }
+
+    bool use_spilling_index() const {
+        return memory_limit() > 0 && !file_based_index();
+    }
+
 }; // class Options
 
 template <class TIndex>
-void write_index_file(const std::string& database, const std::string& name, TIndex& index, bool dense) {
-    const std::string index_file{index_name(database, name, dense)};
+void write_index_file(const std::string& database, const std::string& name, TIndex& index, index_format format) {
+    const std::string index_file{index_name(database, name, format)};
     const int fd = ::open(index_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd < 0) {
         std::cerr << "Can't open index file '" << index_file << "': " << std::strerror(errno) << '\n';
         std::exit(return_code::fatal);
     }
 
-    if (dense) {
+    if (format != index_format::sparse) {
         index.dump_as_array(fd);
     } else {
         index.dump_as_list(fd);
@@ -185,16 +288,108 @@ void write_index_file(const std::string& database, const std::string& name, TInd
     close(fd);
 }
 
-void write_map_file(const std::string& database, const std::string& name, map_type& map) {
-    map().sort();
-    const std::string index_file{map_name(database, name)};
-    const int fd = ::open(index_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) {
-        std::cerr << "Can't open map file '" << index_file << "': " << std::strerror(errno) << '\n';
-        std::exit(return_code::fatal);
+void finish_index(const Options& options, const std::string& name, offset_index_type& index) {
+    index.sort();
+
+    const std::string index_file{index_name(options.database(), name, options.file_format())};
+    if (options.file_based_index()) {
+        // the file based index grows in chunks, remove unused space at the end
+        std::size_t element_size = 0;
+        switch (options.file_format()) {
+            case index_format::sparse:
+                element_size = sizeof(std::pair<osmium::unsigned_object_id_type, size_t>);
+                break;
+            case index_format::packed32:
+                element_size = 4;
+                break;
+            case index_format::packed40:
+                element_size = 5;
+                break;
+            default:
+                break;
+        }
+        if (element_size != 0 && ::truncate(index_file.c_str(), index.size() * element_size) != 0) {
+            std::cerr << "Can't truncate index file '" << index_file << "': " << std::strerror(errno) << '\n';
+            std::exit(return_code::fatal);
+        }
+    } else {
+        write_index_file(options.database(), name, index, options.file_format());
     }
-    map().dump_as_list(fd);
-    close(fd);
+
+    if (options.use_dense_index()) {
+        if (options.layout() == "paged") {
+            const std::string paged_file{index_name(options.database(), name, index_format::paged)};
+            try {
+                write_paged_index<size_t>(index_file, paged_file);
+            } catch (const std::exception& e) {
+                std::cerr << "Can't write index file '" << paged_file << "': " << e.what() << '\n';
+                std::exit(return_code::fatal);
+            }
+            ::unlink(index_file.c_str());
+        }
+        return;
+    }
+
+    if (options.layout() == "eytzinger") {
+        const std::string eytzinger_file{index_name(options.database(), name, index_format::eytzinger)};
+        try {
+            write_eytzinger_index<size_t>(index_file, eytzinger_file);
+        } catch (const std::exception& e) {
+            std::cerr << "Can't write index file '" << eytzinger_file << "': " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+        ::unlink(index_file.c_str());
+        write_membership_filter(eytzinger_file);
+        return;
+    }
+
+    write_membership_filter(index_file);
+    write_learned_index(index_file);
+}
+
+void write_metadata(const Options& options, const ObjectStatistics& statistics) {
+    DatabaseMetadata metadata;
+
+    ObjectStatistics::counts objects;
+    objects.min_id = 0;
+    for (const auto& counts : statistics.types) {
+        objects.count += counts.count;
+    }
+    metadata.set("data", options.data_file_name(), index_format::none, objects);
+
+    const char* names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const index_format format = detect_index_format(options.database(), names[nwr]);
+        metadata.set(names[nwr], index_name(options.database(), names[nwr], format), format, statistics.types[nwr]);
+    }
+
+    if (options.create_maps()) {
+        for (const char* name : {"node2way", "node2relation", "way2relation", "relation2relation"}) {
+            metadata.set_map(name, map_name(options.database(), name));
+        }
+    }
+
+    metadata.write(options.database());
+}
+
+/**
+ * Publish generation 0. The manifest pins the size of the data file, so
+ * readers and the next eodb_update ignore anything appended after it by
+ * an update that is still running or was interrupted.
+ */
+void write_manifest(const Options& options, int data_fd) {
+    if (::fsync(data_fd) != 0) {
+        throw std::system_error{errno, std::system_category(), "syncing data file failed"};
+    }
+
+    struct stat s;
+    if (::fstat(data_fd, &s) != 0) {
+        throw std::system_error{errno, std::system_category(), "stat on data file failed"};
+    }
+
+    SnapshotManifest manifest;
+    manifest.data_size = s.st_size;
+    manifest.write(options.database());
 }
 
 int main(int argc, char* argv[]) {
@@ -225,14 +420,26 @@ int main(int argc, char* argv[]) {
     std::string index_type_relations = options.index_type();
 
     if (options.file_based_index()) {
-        index_type_nodes += "," + index_name(options.database(), "nodes", options.use_dense_index());
-        index_type_ways += "," + index_name(options.database(), "ways", options.use_dense_index());
-        index_type_relations += "," + index_name(options.database(), "relations", options.use_dense_index());
+        index_type_nodes += "," + index_name(options.database(), "nodes", options.file_format());
+        index_type_ways += "," + index_name(options.database(), "ways", options.file_format());
+        index_type_relations += "," + index_name(options.database(), "relations", options.file_format());
     }
 
-    std::unique_ptr<offset_index_type> node_index     = map_factory.create_map(index_type_nodes);
-    std::unique_ptr<offset_index_type> way_index      = map_factory.create_map(index_type_ways);
-    std::unique_ptr<offset_index_type> relation_index = map_factory.create_map(index_type_relations);
+    std::unique_ptr<MemoryBudget> memory_budget;
+    std::unique_ptr<offset_index_type> node_index;
+    std::unique_ptr<offset_index_type> way_index;
+    std::unique_ptr<offset_index_type> relation_index;
+
+    if (options.use_spilling_index()) {
+        memory_budget.reset(new MemoryBudget{options.memory_limit()});
+        node_index.reset(new SpillingOffsetIndex{*memory_budget, options.database() + "/nodes.run."});
+        way_index.reset(new SpillingOffsetIndex{*memory_budget, options.database() + "/ways.run."});
+        relation_index.reset(new SpillingOffsetIndex{*memory_budget, options.database() + "/relations.run."});
+    } else {
+        node_index     = map_factory.create_map(index_type_nodes);
+        way_index      = map_factory.create_map(index_type_ways);
+        relation_index = map_factory.create_map(index_type_relations);
+    }
 
     const auto& location_index_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
     std::unique_ptr<location_index_type> location_index;
@@ -240,55 +447,142 @@ int main(int argc, char* argv[]) {
     typedef osmium::handler::NodeLocationsForWays<location_index_type> location_handler_type;
     std::unique_ptr<location_handler_type> location_handler;
 
-    if (options.location_index_type() != "") {
-        location_index = location_index_factory.create_map(options.location_index_type());
+    std::string location_index_type{options.location_index_type()};
+    if (location_index_type.empty() && options.create_way_geometries()) {
+        location_index_type = "sparse_mem_array";
+    }
+
+    // with a memory limit the location index is kept in a temporary file
+    // in the database directory, the OS decides which parts stay in memory
+    const std::string location_index_file{options.database() + "/locations.tmp"};
+    if (options.memory_limit() > 0 && !location_index_type.empty() && location_index_type.find("_file_array") == std::string::npos) {
+        location_index_type = location_index_type.substr(0, 5) == "dense" ? "dense_file_array" : "sparse_file_array";
+        location_index_type += "," + location_index_file;
+    }
+
+    if (!location_index_type.empty()) {
+        location_index = location_index_factory.create_map(location_index_type);
         location_handler.reset(new location_handler_type(*location_index));
     }
 
+    std::unique_ptr<WayGeometryWriter> way_geometry_writer;
+    if (options.create_way_geometries()) {
+        // nodes without location are left out of the geometries
+        location_handler->ignore_errors();
+        way_geometry_writer.reset(new WayGeometryWriter{options.database()});
+    }
+
     osmium::handler::DiskStore disk_store_handler{data_fd, *node_index, *way_index, *relation_index};
 
+    std::unique_ptr<RelationMapsBuilder> relation_maps_builder;
     if (options.create_maps()) {
-        map_type map_node2way("sparse");
-        map_type map_node2relation("sparse");
-        map_type map_way2relation("sparse");
-        map_type map_relation2relation("sparse");
+        relation_maps_builder.reset(new RelationMapsBuilder{options.threads()});
+    }
+
+    std::unique_ptr<NodeColumnsWriter> node_columns_writer;
+    if (options.create_columns()) {
+        node_columns_writer.reset(new NodeColumnsWriter{options.database()});
+    }
 
-        osmium::handler::ObjectRelations object_relations_handler{map_node2way(), map_node2relation(), map_way2relation(), map_relation2relation()};
+    std::unique_ptr<TagIndexBuilder> tag_index_builder;
+    if (options.create_tag_index()) {
+        tag_index_builder.reset(new TagIndexBuilder{options.database() + "/tags.run.", options.tag_index_memory_limit()});
+    }
 
+    std::unique_ptr<HistoryIndexBuilder> history_index_builder;
+    if (options.create_history_index()) {
+        history_index_builder.reset(new HistoryIndexBuilder);
+    }
+
+    ObjectStatistics statistics;
+
+    try {
         for (const auto& fn : options.input_filenames()) {
             osmium::io::Reader reader{fn};
 
             while (osmium::memory::Buffer buffer = reader.read()) {
-                disk_store_handler(buffer);
+                // the map entries are added in other threads while the
+                // handlers below run, they must not change the buffer
+                // (except for the node locations in ways)
+                if (relation_maps_builder) {
+                    relation_maps_builder->start(buffer);
+                }
 
-                osmium::apply(buffer, object_relations_handler);
+                disk_store_handler(buffer);
+                osmium::apply(buffer, statistics);
+                if (node_columns_writer) {
+                    osmium::apply(buffer, *node_columns_writer);
+                }
+                if (tag_index_builder) {
+                    osmium::apply(buffer, *tag_index_builder);
+                }
+                if (history_index_builder) {
+                    osmium::apply(buffer, *history_index_builder);
+                }
                 if (location_index) {
                     osmium::apply(buffer, *location_handler);
                 }
+                if (way_geometry_writer) {
+                    osmium::apply(buffer, *way_geometry_writer);
+                }
+
+                if (relation_maps_builder) {
+                    relation_maps_builder->wait();
+                }
             }
 
             reader.close();
         }
 
-        write_map_file(options.database(), "node2way",          map_node2way);
-        write_map_file(options.database(), "node2relation",     map_node2relation);
-        write_map_file(options.database(), "way2relation",      map_way2relation);
-        write_map_file(options.database(), "relation2relation", map_relation2relation);
-    } else {
-        for (const auto& fn : options.input_filenames()) {
-            osmium::io::Reader reader{fn};
+        if (node_columns_writer) {
+            node_columns_writer->close();
+        }
+        if (tag_index_builder) {
+            tag_index_builder->write(options.database());
+        }
+        if (history_index_builder) {
+            history_index_builder->write(options.database());
+        }
+        if (way_geometry_writer) {
+            way_geometry_writer->close();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
 
-            while (osmium::memory::Buffer buffer = reader.read()) {
-                disk_store_handler(buffer);
-                if (location_index) {
-                    osmium::apply(buffer, *location_handler);
-                }
-            }
+    location_handler.reset();
+    location_index.reset();
+    ::unlink(location_index_file.c_str());
 
-            reader.close();
+    finish_index(options, "nodes",     *node_index);
+    finish_index(options, "ways",      *way_index);
+    finish_index(options, "relations", *relation_index);
+
+    if (relation_maps_builder) {
+        try {
+            relation_maps_builder->write(options.database());
+        } catch (const std::exception& e) {
+            std::cerr << "Can't write map files: " << e.what() << '\n';
+            std::exit(return_code::fatal);
         }
     }
 
+    try {
+        write_metadata(options, statistics);
+    } catch (const std::exception& e) {
+        std::cerr << "Can't write metadata: " << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    try {
+        write_manifest(options, data_fd);
+    } catch (const std::exception& e) {
+        std::cerr << "Can't write manifest: " << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+    ::close(data_fd);
+
     return return_code::okay;
 }
 
@@ -34,9 +34,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 # include <direct.h>
 #endif
 
-#include <leveldb/db.h>
-#include "leveldb/write_batch.h"
-
 // boost
 #include <boost/program_options.hpp>
 
@@ -61,6 +58,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 // eodb
 #include "eodb.hpp"
+#include "leveldb_map.hpp"
 #include "offset_index.hpp"
 #include "options.hpp"
 
@@ -96,6 +94,7 @@ public:
                 ("index,i", po::value<std::string>(), "Use this node/way/relation index type")
                 ("location,l", po::value<std::string>(), "Use this location index type (default: no location index)")
                 ("maps,m", "Create maps")
+                ("leveldb-index,L", "Store node/way/relation indexes in LevelDB (needed for eodb_update_leveldb)")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -165,6 +164,10 @@ public:
         return vm.count("maps") > 0;
     }
 
+    bool leveldb_index() const {
+        return vm.count("leveldb-index") > 0;
+    }
+
 }; // class Options
 
 template <class TIndex>
@@ -207,20 +210,35 @@ int main(int argc, char* argv[]) {
         std::exit(return_code::fatal);
     }
 
-    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, size_t>::instance();
-    std::string index_type_nodes = options.index_type();
-    std::string index_type_ways = options.index_type();
-    std::string index_type_relations = options.index_type();
+    std::unique_ptr<offset_index_type> node_index;
+    std::unique_ptr<offset_index_type> way_index;
+    std::unique_ptr<offset_index_type> relation_index;
 
-    if (options.file_based_index()) {
-        index_type_nodes += "," + index_name(options.database(), "nodes", options.use_dense_index());
-        index_type_ways += "," + index_name(options.database(), "ways", options.use_dense_index());
-        index_type_relations += "," + index_name(options.database(), "relations", options.use_dense_index());
-    }
+    if (options.leveldb_index()) {
+        try {
+            node_index.reset(new LevelDBOffsetIndexWriter{leveldb_map_name(options.database(), "nodes")});
+            way_index.reset(new LevelDBOffsetIndexWriter{leveldb_map_name(options.database(), "ways")});
+            relation_index.reset(new LevelDBOffsetIndexWriter{leveldb_map_name(options.database(), "relations")});
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    } else {
+        const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, size_t>::instance();
+        std::string index_type_nodes = options.index_type();
+        std::string index_type_ways = options.index_type();
+        std::string index_type_relations = options.index_type();
+
+        if (options.file_based_index()) {
+            index_type_nodes += "," + index_name(options.database(), "nodes", options.use_dense_index());
+            index_type_ways += "," + index_name(options.database(), "ways", options.use_dense_index());
+            index_type_relations += "," + index_name(options.database(), "relations", options.use_dense_index());
+        }
 
-    std::unique_ptr<offset_index_type> node_index     = map_factory.create_map(index_type_nodes);
-    std::unique_ptr<offset_index_type> way_index      = map_factory.create_map(index_type_ways);
-    std::unique_ptr<offset_index_type> relation_index = map_factory.create_map(index_type_relations);
+        node_index     = map_factory.create_map(index_type_nodes);
+        way_index      = map_factory.create_map(index_type_ways);
+        relation_index = map_factory.create_map(index_type_relations);
+    }
 
     const auto& location_index_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
     std::unique_ptr<location_index_type> location_index;
@@ -235,77 +253,35 @@ int main(int argc, char* argv[]) {
 
     osmium::handler::DiskStore disk_store_handler{data_fd, *node_index, *way_index, *relation_index};
 
-    leveldb::DB* db_n2w;
-    leveldb::DB* db_n2r;
-    leveldb::DB* db_w2r;
-    leveldb::DB* db_r2r;
-
-    leveldb::Options leveldb_options;
-    leveldb_options.create_if_missing = true;
-    leveldb_options.write_buffer_size = 256 * 1024;
-    leveldb_options.block_size = 256 * 1024;
-
-    leveldb::Status status = leveldb::DB::Open(leveldb_options, options.database() + "/" + "n2w.leveldb", &db_n2w);
-    assert(status.ok());
-
-    status = leveldb::DB::Open(leveldb_options, options.database() + "/" + "n2r.leveldb", &db_n2r);
-    assert(status.ok());
-
-    status = leveldb::DB::Open(leveldb_options, options.database() + "/" + "w2r.leveldb", &db_w2r);
-    assert(status.ok());
+    try {
+        LevelDBMapWriter node2way{leveldb_map_name(options.database(), "node2way")};
+        LevelDBMapWriter node2relation{leveldb_map_name(options.database(), "node2relation")};
+        LevelDBMapWriter way2relation{leveldb_map_name(options.database(), "way2relation")};
+        LevelDBMapWriter relation2relation{leveldb_map_name(options.database(), "relation2relation")};
 
-    status = leveldb::DB::Open(leveldb_options, options.database() + "/" + "r2r.leveldb", &db_r2r);
-    assert(status.ok());
+        for (const auto& fn : options.input_filenames()) {
+            osmium::io::Reader reader{fn};
 
-    for (const auto& fn : options.input_filenames()) {
-        osmium::io::Reader reader{fn};
-
-        while (osmium::memory::Buffer buffer = reader.read()) {
-            disk_store_handler(buffer);
-
-            if (buffer.cbegin<osmium::Way>() != buffer.cend<osmium::Way>()) {
-                leveldb::WriteBatch batch;
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                disk_store_handler(buffer);
 
                 for (auto it = buffer.cbegin<osmium::Way>(); it != buffer.cend<osmium::Way>(); ++it) {
                     for (const auto& node_ref : it->nodes()) {
-                        osmium::unsigned_object_id_type k = node_ref.positive_ref();
-                        osmium::unsigned_object_id_type v = it->positive_id();
-                        char key_buffer[sizeof(k) + sizeof(v)] = {};
-                        memcpy(key_buffer, &k, sizeof(k));
-                        memcpy(key_buffer + sizeof(k), &v, sizeof(v));
-                        leveldb::Slice key { key_buffer, sizeof(key_buffer) };
-                        leveldb::Slice val { reinterpret_cast<const char*>(&v), sizeof(osmium::unsigned_object_id_type) };
-                        batch.Put(key, val);
+                        node2way.add(node_ref.positive_ref(), it->positive_id());
                     }
                 }
 
-                status = db_n2w->Write(leveldb::WriteOptions(), &batch);
-                assert(status.ok());
-            }
-
-            if (buffer.cbegin<osmium::Relation>() != buffer.cend<osmium::Relation>()) {
-                leveldb::WriteBatch batch_n;
-                leveldb::WriteBatch batch_w;
-                leveldb::WriteBatch batch_r;
-
                 for (auto it = buffer.cbegin<osmium::Relation>(); it != buffer.cend<osmium::Relation>(); ++it) {
                     for (const auto& member : it->members()) {
-                        osmium::unsigned_object_id_type k = member.positive_ref();
-                        osmium::unsigned_object_id_type v = it->positive_id();
-                        char key_buffer[sizeof(k) + sizeof(v)] = {};
-                        memcpy(key_buffer, &k, sizeof(k));
-                        memcpy(key_buffer + sizeof(k), &v, sizeof(v));
-                        leveldb::Slice key { key_buffer, sizeof(key_buffer) };
-                        leveldb::Slice val { reinterpret_cast<const char*>(&v), sizeof(osmium::unsigned_object_id_type) };
                         switch (member.type()) {
                             case osmium::item_type::node:
-                                batch_n.Put(key, val);
+                                node2relation.add(member.positive_ref(), it->positive_id());
                                 break;
                             case osmium::item_type::way:
-                                batch_w.Put(key, val);
+                                way2relation.add(member.positive_ref(), it->positive_id());
                                 break;
                             case osmium::item_type::relation:
-                                batch_r.Put(key, val);
+                                relation2relation.add(member.positive_ref(), it->positive_id());
                                 break;
                             default:
                                 break;
@@ -313,28 +289,28 @@ int main(int argc, char* argv[]) {
                     }
                 }
 
-                status = db_n2r->Write(leveldb::WriteOptions(), &batch_n);
-                assert(status.ok());
-
-                status = db_w2r->Write(leveldb::WriteOptions(), &batch_w);
-                assert(status.ok());
-
-                status = db_r2r->Write(leveldb::WriteOptions(), &batch_r);
-                assert(status.ok());
+                if (location_index) {
+                    osmium::apply(buffer, *location_handler);
+                }
             }
 
-            if (location_index) {
-                osmium::apply(buffer, *location_handler);
-            }
+            reader.close();
         }
 
-        reader.close();
-    }
+        node2way.close();
+        node2relation.close();
+        way2relation.close();
+        relation2relation.close();
 
-    delete db_r2r;
-    delete db_w2r;
-    delete db_n2r;
-    delete db_n2w;
+        if (options.leveldb_index()) {
+            static_cast<LevelDBOffsetIndexWriter&>(*node_index).close();
+            static_cast<LevelDBOffsetIndexWriter&>(*way_index).close();
+            static_cast<LevelDBOffsetIndexWriter&>(*relation_index).close();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
 
     return return_code::okay;
 }
@@ -37,7 +37,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <osmium/osm/location.hpp>
 
 // eodb
+#include "eytzinger_index.hpp"
+#include "map_delta.hpp"
+#include "metadata.hpp"
 #include "options.hpp"
+#include "packed_index.hpp"
+#include "paged_index.hpp"
+#include "snapshot.hpp"
 #include "eodb.hpp"
 
 class Options : public OptionsBase {
@@ -136,9 +142,23 @@ void dump_dense_index(int fd) {
     typedef typename osmium::index::map::DenseFileArray<osmium::unsigned_object_id_type, T> dense_index_type;
     dense_index_type index(fd);
 
-    for (size_t i = 0; i < index.size(); ++i) {
-        if (index.get(i) != T{}) {
-            std::cout << i << " " << index.get(i) << "\n";
+    // get() throws for empty slots, so look at the array directly
+    size_t id = 0;
+    for (auto it = index.cbegin(); it != index.cend(); ++it, ++id) {
+        if (*it != T{}) {
+            std::cout << id << " " << *it << "\n";
+        }
+    }
+}
+
+template <typename TIndex>
+void dump_packed_index(int fd) {
+    TIndex index(fd);
+
+    for (size_t id = 0; id < index.size(); ++id) {
+        size_t value;
+        if (index.find(id, value)) {
+            std::cout << id << " " << value << "\n";
         }
     }
 }
@@ -155,44 +175,98 @@ void dump_sparse_index(int fd) {
     }
 }
 
-int dump_index(const std::string& database, const std::string& index_name) {
-    bool dense = false;
-    std::string filename{database + "/" + index_name + ".sparse.idx"};
-    int fd = ::open(filename.c_str(), O_RDWR);
+template <typename T>
+void dump_eytzinger_index(const std::string& filename) {
+    const EytzingerIndex<T> index{filename};
 
-    if (fd == -1) {
-        dense = true;
-        filename = database + "/" + index_name + ".dense.idx";
-        fd = ::open(filename.c_str(), O_RDWR);
+    index.for_each([](const typename EytzingerIndex<T>::element_type& element) {
+        std::cout << element.first << " " << element.second << "\n";
+    });
+}
+
+template <typename T>
+void dump_paged_index(const std::string& filename) {
+    const PagedIndex<T> index{filename};
+
+    index.for_each([](osmium::unsigned_object_id_type id, const T& value) {
+        std::cout << id << " " << value << "\n";
+    });
+}
+
+template <typename T>
+int dump_index_typed(const std::string& database, const std::string& name) {
+    const index_format format = lookup_index_format(database, name);
+    if (format == index_format::none) {
+        std::cerr << "Can't open " << name << " index file\n";
+        return return_code::fatal;
     }
 
+    const std::string filename{index_name(database, name, format)};
+    if (format == index_format::eytzinger) {
+        dump_eytzinger_index<T>(filename);
+        return return_code::okay;
+    }
+    if (format == index_format::paged) {
+        dump_paged_index<T>(filename);
+        return return_code::okay;
+    }
+
+    const int fd = ::open(filename.c_str(), O_RDWR);
     if (fd == -1) {
-        std::cerr << "Can't open " << index_name << " index file\n";
+        std::cerr << "Can't open " << name << " index file\n";
+        return return_code::fatal;
     }
 
-    if (index_name == "locations") {
-        if (dense) {
-            dump_dense_index<osmium::Location>(fd);
-        } else {
-            dump_sparse_index<osmium::Location>(fd);
-        }
+    if (format == index_format::dense) {
+        dump_dense_index<T>(fd);
+    } else if (format == index_format::packed32) {
+        dump_packed_index<Packed32DenseFileArray<osmium::unsigned_object_id_type, size_t>>(fd);
+    } else if (format == index_format::packed40) {
+        dump_packed_index<Packed40DenseFileArray<osmium::unsigned_object_id_type, size_t>>(fd);
     } else {
-        if (dense) {
-            dump_dense_index<size_t>(fd);
-        } else {
-            dump_sparse_index<size_t>(fd);
-        }
+        dump_sparse_index<T>(fd);
     }
 
     return return_code::okay;
 }
 
+int dump_index(const std::string& database, const std::string& index_name) {
+    // indexes changed by eodb_update are read through the snapshot
+    SnapshotManifest manifest;
+    if (manifest.read(database)) {
+        const auto snapshot = open_snapshot_index(database, manifest, index_name);
+        if (snapshot) {
+            snapshot->for_each([](osmium::unsigned_object_id_type id, size_t value) {
+                std::cout << id << " " << value << "\n";
+            });
+            return return_code::okay;
+        }
+    }
+
+    if (index_name == "locations") {
+        return dump_index_typed<osmium::Location>(database, index_name);
+    }
+    return dump_index_typed<size_t>(database, index_name);
+}
+
 int dump_map(const std::string& database, const std::string& map_name) {
-    const std::string filename{database + "/" + map_name + ".map"};
+    // maps changed by eodb_update are read through the snapshot
+    SnapshotManifest manifest;
+    manifest.read(database);
+    const auto files = snapshot_map_files(database, manifest, map_name);
+    if (!files.delta.empty()) {
+        MapSnapshot{database, files}.for_each([](const map_element& element) {
+            std::cout << element.first << " " << element.second << "\n";
+        });
+        return return_code::okay;
+    }
+
+    const std::string filename{database + "/" + (files.base.empty() ? map_name + ".map" : files.base)};
     const int fd = ::open(filename.c_str(), O_RDWR);
 
     if (fd == -1) {
         std::cerr << "Can't open " << map_name << " map file\n";
+        std::exit(return_code::fatal);
     }
 
     typedef typename osmium::index::multimap::SparseFileArray<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> map_type;
@@ -20,15 +20,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 // c++
-#include <cassert>
 #include <fcntl.h>
 #include <iomanip>
 #include <iostream>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <leveldb/db.h>
-
 // boost
 #include <boost/program_options.hpp>
 
@@ -36,6 +33,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <osmium/osm/types.hpp>
 
 // eodb
+#include "leveldb_map.hpp"
 #include "options.hpp"
 #include "eodb.hpp"
 
@@ -102,22 +100,15 @@ public:
 
 
 int dump_map(const std::string& database, const std::string& map) {
-    leveldb::DB* db;
-    leveldb::Options leveldb_options;
-    leveldb::Status status = leveldb::DB::Open(leveldb_options, database + "/" + map + ".leveldb", &db);
-    assert(status.ok());
-
-    leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
-    for (it->SeekToFirst(); it->Valid(); it->Next()) {
-        const leveldb::Slice& k = it->key();
-        const leveldb::Slice& v = it->value();
-        auto ki = reinterpret_cast<const osmium::unsigned_object_id_type*>(k.data());
-        auto vi = reinterpret_cast<const osmium::unsigned_object_id_type*>(v.data());
-
-        std::cout << *ki << " " << *vi << "\n";
+    try {
+        LevelDBMap reader{leveldb_map_name(database, map)};
+        reader.for_each([](osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type value) {
+            std::cout << key << " " << value << "\n";
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        return return_code::fatal;
     }
-    assert(it->status().ok());  // Check for any errors found during the scan
-    delete it;
 
     return return_code::okay;
 }
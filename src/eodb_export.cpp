@@ -32,14 +32,22 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 // osmium
 #include <osmium/io/any_output.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/timestamp.hpp>
 
 // eodb
+#include "compact_encoding.hpp"
+#include "database.hpp"
+#include "history_index.hpp"
 #include "mapped_file.hpp"
 #include "options.hpp"
+#include "tag_index.hpp"
 #include "eodb.hpp"
 
 class Options : public OptionsBase {
 
+    osmium::Timestamp m_as_of;
+
 public:
 
     void parse(int argc, char* argv[]) {
@@ -56,6 +64,9 @@ public:
                 ("output-format,f", po::value<std::string>()->default_value(""), "Format of output file (empty: autodetect)")
                 ("offset,O", po::value<size_t>()->default_value(0), "Start from offset")
                 ("count,c", po::value<size_t>()->default_value(0), "Write count objects (all if count=0)")
+                ("compact,C", "Read from compact data file (see eodb_compact)")
+                ("tags,t", po::value<std::vector<std::string>>(), "Only objects with all these tags (KEY or KEY=VALUE), uses tag index")
+                ("as-of,a", po::value<std::string>(), "Export versions current at this time (needs history index)")
             ;
 
             po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -74,6 +85,19 @@ public:
                 std::cerr << "You have to set the output file name with --output,-o or the output format with --output-format,-f\n";
                 std::exit(return_code::fatal);
             }
+
+            if (vm.count("as-of")) {
+                if (compact()) {
+                    std::cerr << "Option --as-of,-a can not be used with --compact,-C\n";
+                    std::exit(return_code::fatal);
+                }
+                try {
+                    m_as_of = osmium::Timestamp{vm["as-of"].as<std::string>()};
+                } catch (const std::invalid_argument&) {
+                    std::cerr << "Invalid timestamp given with --as-of,-a (use yyyy-mm-ddThh:mm:ssZ)\n";
+                    std::exit(return_code::fatal);
+                }
+            }
         } catch (const boost::program_options::error& e) {
             std::cerr << "Error parsing command line: " << e.what() << '\n';
             std::exit(return_code::fatal);
@@ -100,8 +124,183 @@ public:
         return vm["generator"].as<std::string>();
     }
 
+    bool compact() const {
+        return vm.count("compact") != 0;
+    }
+
+    bool as_of() const {
+        return vm.count("as-of") != 0;
+    }
+
+    osmium::Timestamp as_of_timestamp() const {
+        return m_as_of;
+    }
+
+    std::vector<std::string> tags() const {
+        if (vm.count("tags") == 0) {
+            return {};
+        }
+        return vm["tags"].as<std::vector<std::string>>();
+    }
+
 }; // class Options
 
+void export_compact(const Options& options, osmium::io::Writer& writer) {
+    const size_t max_buffer_size = 10 * 1024 * 1024;
+
+    StringDictionary dictionary;
+    dictionary.read(options.database() + DEFAULT_COMPACT_DICT_FILE);
+    const CompactDecoder decoder{dictionary};
+
+    MappedFile mf{options.database() + DEFAULT_COMPACT_DATA_FILE};
+    const char* data = reinterpret_cast<const char*>(mf.data());
+    const char* const end = data + mf.size();
+
+    if (options.offset() > mf.size()) {
+        throw std::runtime_error{"offset is beyond end of compact data file"};
+    }
+    data += options.offset();
+
+    osmium::memory::Buffer buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+    for (size_t count = 0; data != end && (options.count() == 0 || count < options.count()); ++count) {
+        data = decoder(data, end, buffer);
+        if (buffer.committed() > max_buffer_size - 1024 * 1024) {
+            writer(std::move(buffer));
+            buffer = osmium::memory::Buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+        }
+    }
+    if (buffer.committed() > 0) {
+        writer(std::move(buffer));
+    }
+
+    mf.close();
+}
+
+/**
+ * Does the object have all the tags (KEY or KEY=VALUE)?
+ */
+bool has_tags(const osmium::OSMObject& object, const std::vector<std::string>& tags) {
+    for (const auto& tag : tags) {
+        const auto pos = tag.find('=');
+        const char* value = object.tags().get_value_by_key(tag.substr(0, pos).c_str());
+        if (!value || (pos != std::string::npos && tag.substr(pos + 1) != value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void export_tags(const Options& options, const eodb::Database& db, osmium::io::Writer& writer) {
+    const size_t max_buffer_size = 10 * 1024 * 1024;
+
+    const TagIndex tag_index{options.database()};
+
+    osmium::memory::Buffer buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+
+    const char* index_names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const auto type = osmium::nwr_index_to_item_type(nwr);
+        const auto ids = tag_index.query(options.tags(), type);
+        if (ids.empty()) {
+            continue;
+        }
+
+        std::unique_ptr<HistoryIndex> history;
+        if (options.as_of()) {
+            history.reset(new HistoryIndex{history_name(options.database(), index_names[nwr])});
+        }
+
+        for (const auto id : ids) {
+            const osmium::OSMObject* object;
+            if (history) {
+                const auto* entry = history->find(id, options.as_of_timestamp().seconds_since_epoch());
+                if (!entry) {
+                    continue;
+                }
+                object = &db.object_at(entry->offset);
+            } else {
+                object = db.find_object(type, id);
+                if (!object) {
+                    throw std::runtime_error{std::string{"Object in tag index not found in "} + index_names[nwr] + " index"};
+                }
+            }
+
+            // the tag index contains the tags of all versions imported
+            // with eodb_create, but not changes made by eodb_update
+            if (!object->visible() || !has_tags(*object, options.tags())) {
+                continue;
+            }
+            buffer.push_back(*object);
+            if (buffer.committed() > max_buffer_size - 1024 * 1024) {
+                writer(std::move(buffer));
+                buffer = osmium::memory::Buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+            }
+        }
+    }
+
+    if (buffer.committed() > 0) {
+        writer(std::move(buffer));
+    }
+}
+
+void export_compact_tags(const Options& options, osmium::io::Writer& writer) {
+    const size_t max_buffer_size = 10 * 1024 * 1024;
+
+    const TagIndex tag_index{options.database()};
+    const CompactData data{options.database()};
+
+    osmium::memory::Buffer buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+    osmium::memory::Buffer object_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+
+    const char* index_names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const auto type = osmium::nwr_index_to_item_type(nwr);
+        for (const auto id : tag_index.query(options.tags(), type)) {
+            object_buffer.clear();
+            if (!data.get(type, id, object_buffer)) {
+                throw std::runtime_error{std::string{"Object in tag index not found in compact "} + index_names[nwr] + " index"};
+            }
+
+            // like export_tags(), the tag index might be out of date
+            const auto& object = object_buffer.get<osmium::OSMObject>(0);
+            if (!object.visible() || !has_tags(object, options.tags())) {
+                continue;
+            }
+            buffer.push_back(object);
+            if (buffer.committed() > max_buffer_size - 1024 * 1024) {
+                writer(std::move(buffer));
+                buffer = osmium::memory::Buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+            }
+        }
+    }
+
+    if (buffer.committed() > 0) {
+        writer(std::move(buffer));
+    }
+}
+
+void export_as_of(const Options& options, const eodb::Database& db, osmium::io::Writer& writer) {
+    const size_t max_buffer_size = 10 * 1024 * 1024;
+
+    osmium::memory::Buffer buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+
+    const char* index_names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const HistoryIndex history{history_name(options.database(), index_names[nwr])};
+        history.for_each_as_of(options.as_of_timestamp().seconds_since_epoch(), [&](const HistoryEntry& entry) {
+            buffer.push_back(db.object_at(entry.offset));
+            if (buffer.committed() > max_buffer_size - 1024 * 1024) {
+                writer(std::move(buffer));
+                buffer = osmium::memory::Buffer{max_buffer_size, osmium::memory::Buffer::auto_grow::yes};
+            }
+        });
+    }
+
+    if (buffer.committed() > 0) {
+        writer(std::move(buffer));
+    }
+}
+
 int main(int argc, char* argv[]) {
     std::ios_base::sync_with_stdio(false);
 
@@ -111,14 +310,38 @@ int main(int argc, char* argv[]) {
     options.parse(argc, argv);
 
     try {
-        MappedFile mf{options.data_file_name()};
-        osmium::memory::Buffer buffer{mf.data(), mf.size()};
-
         osmium::io::File file{options.output_file_name(), options.output_format()};
         osmium::io::Header header;
         header.set("generator", options.generator());
         osmium::io::Writer writer{file, header};
 
+        if (options.compact()) {
+            if (options.tags().empty()) {
+                export_compact(options, writer);
+            } else {
+                export_compact_tags(options, writer);
+            }
+            writer.close();
+            return return_code::okay;
+        }
+
+        // pins the current generation of the database
+        const eodb::Database db{options.database()};
+
+        if (!options.tags().empty()) {
+            export_tags(options, db, writer);
+            writer.close();
+            return return_code::okay;
+        }
+
+        if (options.as_of()) {
+            export_as_of(options, db, writer);
+            writer.close();
+            return return_code::okay;
+        }
+
+        osmium::memory::Buffer buffer{db.data()};
+
         if (options.count() == 0) {
             writer(std::move(buffer));
         } else {
@@ -128,8 +351,7 @@ int main(int argc, char* argv[]) {
         }
 
         writer.close();
-        mf.close();
-    } catch (const std::system_error& e) {
+    } catch (const std::exception& e) {
         std::cerr << e.what() << '\n';
         return return_code::fatal;
     }
@@ -0,0 +1,147 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+// c++
+#include <iostream>
+#include <string>
+
+// boost
+#include <boost/program_options.hpp>
+
+// eodb
+#include "map_delta.hpp"
+#include "metadata.hpp"
+#include "options.hpp"
+#include "snapshot.hpp"
+#include "eodb.hpp"
+
+class Options : public OptionsBase {
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description desc{"Allowed options"};
+            desc.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("verify,v", "Verify file sizes and checksums")
+            ;
+
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_info");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_info [OPTIONS]\n";
+                std::cout << "Show database metadata.\n\n";
+                std::cout << desc << "\n";
+                std::exit(return_code::okay);
+            }
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+    bool verify() const {
+        return vm.count("verify") != 0;
+    }
+
+}; // class Options
+
+std::string file_for_entry(const std::string& database, const std::string& name, const DatabaseMetadata::entry& e, const SnapshotManifest& manifest) {
+    if (name == "data") {
+        return database + DEFAULT_DATA_FILE;
+    }
+    const auto it = manifest.indexes.find(name);
+    if (it != manifest.indexes.end()) {
+        return database + "/" + it->second.base;
+    }
+    if (name == "node2way" || name == "node2relation" || name == "way2relation" || name == "relation2relation") {
+        const auto files = snapshot_map_files(database, manifest, name);
+        return files.base.empty() ? map_name(database, name) : database + "/" + files.base;
+    }
+    return index_name(database, name, e.format);
+}
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    bool okay = true;
+
+    try {
+        DatabaseMetadata metadata;
+        if (!metadata.read(options.database())) {
+            std::cerr << "Database '" << options.database() << "' has no metadata\n";
+            std::exit(return_code::fatal);
+        }
+
+        SnapshotManifest manifest;
+        if (manifest.read(options.database())) {
+            std::cout << "generation: " << manifest.generation << "\n";
+            if (manifest.sequence >= 0) {
+                std::cout << "replication sequence: " << manifest.sequence << "\n";
+            }
+        }
+
+        for (const auto& entry : metadata.entries) {
+            const auto& e = entry.second;
+            std::cout << entry.first << ":";
+            if (e.format != index_format::none) {
+                std::cout << " format=" << index_format_name(e.format) << " v" << e.format_version;
+            }
+            std::cout << " count=" << e.count;
+            if (entry.first != "data") {
+                std::cout << " ids=" << e.min_id << "-" << e.max_id;
+            }
+            std::cout << " size=" << e.file_size << " checksum=" << std::hex << e.checksum << std::dec;
+
+            if (options.verify()) {
+                const std::string filename{file_for_entry(options.database(), entry.first, e, manifest)};
+                if (!file_exists(filename)) {
+                    std::cout << " MISSING";
+                    okay = false;
+                } else if (DatabaseMetadata::file_size(filename) != e.file_size || quick_file_checksum(filename) != e.checksum) {
+                    std::cout << " CHANGED";
+                    okay = false;
+                } else {
+                    std::cout << " ok";
+                }
+            }
+            std::cout << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    return okay ? return_code::okay : return_code::error;
+}
+
@@ -39,6 +39,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // eodb
 #include "any_index.hpp"
 #include "mapped_file.hpp"
+#include "metadata.hpp"
+#include "node_columns.hpp"
 #include "options.hpp"
 #include "eodb.hpp"
 
@@ -138,29 +140,36 @@ Options options;
 std::string index_type_desc() {
     std::string s;
     s.append(options.index_type);
-    s.append(",");
+    s.append("_file_array,");
     s.append(options.locations_cache_file_name());
     return s;
 }
 
-int try_name(const std::string& name) {
-    struct stat s;
-    return ::stat(name.c_str(), &s);
-}
-
-int detect_index_type() {
-    int fd = try_name(options.locations_cache_file_name("sparse"));
-
-    if (fd == -1) {
-        fd = try_name(options.locations_cache_file_name("dense"));
+std::string detect_index_type() {
+    for (const char* type : {"sparse", "dense"}) {
+        if (file_exists(options.locations_cache_file_name(type))) {
+            return type;
+        }
     }
 
-    if (fd == -1) {
-        std::cerr << "Can't find locations cache file\n";
+    std::cerr << "Can't find locations cache file\n";
+    std::exit(return_code::fatal);
+}
+
+/**
+ * Choose index type for a new locations cache from the node count and the
+ * largest node ID in the database metadata. A sparse index needs 16 bytes
+ * per node, a dense index 8 bytes per possible ID.
+ */
+std::string choose_index_type() {
+    DatabaseMetadata metadata;
+    if (!metadata.read(options.database()) || !metadata.find("nodes")) {
+        std::cerr << "No database metadata, please set --index-type,-i\n";
         std::exit(return_code::fatal);
     }
 
-    return fd;
+    const auto* nodes = metadata.find("nodes");
+    return nodes->count * 2 > nodes->max_id ? "dense" : "sparse";
 }
 
 int main(int argc, char* argv[]) {
@@ -169,24 +178,33 @@ int main(int argc, char* argv[]) {
     options.parse(argc, argv);
 
     if (options.index_type.empty()) {
-        options.index_type = detect_index_type();
+        options.index_type = options.operation == operation_type::create ? choose_index_type() : detect_index_type();
     }
 
     if (options.operation == operation_type::create) {
         try {
-            MappedFile mf{options.data_file_name()};
-
-            osmium::memory::Buffer buffer{mf.data(), mf.size()};
-
             const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
             std::unique_ptr<location_index_type> index = map_factory.create_map(index_type_desc());
-            auto b = buffer.begin<osmium::Node>();
-            auto e = buffer.end<osmium::Node>();
-            for (auto it = b; it != e; ++it) {
-                index->set(it->id(), it->location());
-            }
 
-            mf.close();
+            if (NodeColumns::exist(options.database())) {
+                // only reads the ids and locations columns
+                NodeColumns columns{options.database()};
+                columns.for_each_location([&index](osmium::unsigned_object_id_type id, const osmium::Location& location) {
+                    index->set(id, location);
+                });
+            } else {
+                MappedFile mf{options.data_file_name()};
+
+                osmium::memory::Buffer buffer{mf.data(), mf.size()};
+
+                auto b = buffer.begin<osmium::Node>();
+                auto e = buffer.end<osmium::Node>();
+                for (auto it = b; it != e; ++it) {
+                    index->set(it->id(), it->location());
+                }
+
+                mf.close();
+            }
         } catch (const std::system_error& e) {
             std::cerr << e.what() << '\n';
             return return_code::fatal;
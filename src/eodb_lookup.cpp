@@ -34,14 +34,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <osmium/index/map/sparse_file_array.hpp>
 #include <osmium/index/multimap/sparse_file_array.hpp>
 #include <osmium/osm/location.hpp>
+#include <osmium/osm/timestamp.hpp>
 #include <osmium/osm/types.hpp>
 
 // eodb
+#include "eytzinger_index.hpp"
+#include "history_index.hpp"
+#include "learned_index.hpp"
+#include "map_delta.hpp"
+#include "membership_filter.hpp"
+#include "metadata.hpp"
 #include "options.hpp"
+#include "packed_index.hpp"
+#include "paged_index.hpp"
+#include "snapshot.hpp"
 #include "eodb.hpp"
 
 class Options : public OptionsBase {
 
+    osmium::Timestamp m_as_of;
+
 public:
 
     void parse(int argc, char* argv[]) {
@@ -55,6 +67,8 @@ public:
                 ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
                 ("index,i", po::value<std::string>(), "Name of index")
                 ("map,m", po::value<std::string>(), "Name of map")
+                ("search,s", po::value<std::string>()->default_value("auto"), "Search in sparse index/map: auto, binary, learned")
+                ("as-of,a", po::value<std::string>(), "Look up version current at this time (needs history index)")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -101,6 +115,24 @@ public:
                 }
             }
 
+            if (search() != "auto" && search() != "binary" && search() != "learned") {
+                std::cerr << "Search given with --search,-s must be one of: auto, binary, learned\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (vm.count("as-of")) {
+                if (!vm.count("index") || index() == "locations") {
+                    std::cerr << "Option --as-of,-a only works with --index,-i nodes, ways, or relations\n";
+                    std::exit(return_code::fatal);
+                }
+                try {
+                    m_as_of = osmium::Timestamp{vm["as-of"].as<std::string>()};
+                } catch (const std::invalid_argument&) {
+                    std::cerr << "Invalid timestamp given with --as-of,-a (use yyyy-mm-ddThh:mm:ssZ)\n";
+                    std::exit(return_code::fatal);
+                }
+            }
+
             if (vm.count("ids") == 0) {
                 std::cerr << "Need at least one Id to search for on command line\n";
                 std::exit(return_code::fatal);
@@ -144,6 +176,18 @@ public:
         return map;
     }
 
+    bool as_of() const {
+        return vm.count("as-of") != 0;
+    }
+
+    osmium::Timestamp as_of_timestamp() const {
+        return m_as_of;
+    }
+
+    std::string search() const {
+        return vm["search"].as<std::string>();
+    }
+
     std::vector<osmium::unsigned_object_id_type> search_ids() const {
         return vm["ids"].as<std::vector<osmium::unsigned_object_id_type>>();
     }
@@ -164,34 +208,66 @@ bool lookup_id_in_index_dense(const TIndex& index, const osmium::unsigned_object
 }
 
 template <class TIndex>
-bool lookup_id_in_index_sparse(const TIndex& index, const osmium::unsigned_object_id_type id) {
+bool lookup_id_in_index_sparse(const TIndex& index, const MembershipFilter* filter, const LearnedIndex* model, const osmium::unsigned_object_id_type id) {
     typedef typename TIndex::element_type element_type;
 
+    if (filter && !filter->may_contain(id)) {
+        std::cout << id << " not found\n";
+        return false;
+    }
+
+    auto first = index.begin();
+    auto last = index.end();
+    if (model) {
+        const auto range = model->search_range(id);
+        last = first + range.second;
+        first += range.first;
+    }
+
     element_type elem {id, typename TIndex::value_type()};
-    auto positions = std::equal_range(index.begin(), index.end(), elem, [](const element_type& lhs, const element_type& rhs) {
+    auto it = std::lower_bound(first, last, elem, [](const element_type& lhs, const element_type& rhs) {
         return lhs.first < rhs.first;
     });
 
-    if (positions.first == positions.second) {
+    if (it == last || it->first != id) {
         std::cout << id << " not found\n";
         return false;
     }
 
-    for (auto& it = positions.first; it != positions.second; ++it) {
+    // maps can have several elements with the same id
+    for (; it != index.end() && it->first == id; ++it) {
         std::cout << it->first << " " << it->second << "\n";
     }
 
     return true;
 }
 
-template <class T>
+std::unique_ptr<LearnedIndex> open_model(const std::string& filename, const std::string& search, std::size_t size) {
+    std::unique_ptr<LearnedIndex> model;
+    if (search == "binary") {
+        return model;
+    }
+
+    model = open_learned_index(filename);
+    if (model && model->num_elements() != size) {
+        model.reset(); // outdated, ignore
+    }
+
+    if (!model && search == "learned") {
+        std::cerr << "No up-to-date model file for '" << filename << "'\n";
+        std::exit(return_code::fatal);
+    }
+
+    return model;
+}
+
+template <class TIndex>
 bool lookup_index_dense(int fd, const std::vector<osmium::unsigned_object_id_type>& ids) {
-    typedef typename osmium::index::map::DenseFileArray<osmium::unsigned_object_id_type, T> dense_index_type;
-    dense_index_type index{fd};
+    TIndex index{fd};
 
     bool found_all = true;
     for (const auto id : ids) {
-        if (!lookup_id_in_index_dense<dense_index_type>(index, id)) {
+        if (!lookup_id_in_index_dense<TIndex>(index, id)) {
             found_all = false;
         }
     }
@@ -200,66 +276,205 @@ bool lookup_index_dense(int fd, const std::vector<osmium::unsigned_object_id_typ
 }
 
 template <class T>
-bool lookup_index_sparse(int fd, const std::vector<osmium::unsigned_object_id_type>& ids) {
+bool lookup_index_packed(index_format format, int fd, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    if (format == index_format::packed32) {
+        return lookup_index_dense<Packed32DenseFileArray<osmium::unsigned_object_id_type, T>>(fd, ids);
+    }
+    return lookup_index_dense<Packed40DenseFileArray<osmium::unsigned_object_id_type, T>>(fd, ids);
+}
+
+template <>
+bool lookup_index_packed<osmium::Location>(index_format /*format*/, int /*fd*/, const std::vector<osmium::unsigned_object_id_type>& /*ids*/) {
+    std::cerr << "Packed indexes can only contain offsets\n";
+    std::exit(return_code::fatal);
+}
+
+template <class T>
+bool lookup_index_sparse(int fd, const std::string& filename, const std::string& search, const std::vector<osmium::unsigned_object_id_type>& ids) {
     typedef typename osmium::index::map::SparseFileArray<osmium::unsigned_object_id_type, T> sparse_index_type;
     sparse_index_type index{fd};
+    const auto filter = open_membership_filter(filename);
+    const auto model = open_model(filename, search, index.size());
 
     bool found_all = true;
     for (const auto id : ids) {
-        if (!lookup_id_in_index_sparse<sparse_index_type>(index, id)) {
+        if (!lookup_id_in_index_sparse<sparse_index_type>(index, filter.get(), model.get(), id)) {
             found_all = false;
         }
     }
 
     return found_all;
 }
-bool lookup_index(const std::string& database, const std::string& index_name, const std::vector<osmium::unsigned_object_id_type>& ids) {
-    bool dense = false;
-    std::string filename{database + "/" + index_name + ".sparse.idx"};
-    int fd = ::open(filename.c_str(), O_RDWR);
+template <class T>
+bool lookup_index_eytzinger(const std::string& filename, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    const EytzingerIndex<T> index{filename};
+    const auto filter = open_membership_filter(filename);
 
-    if (fd == -1) {
-        dense = true;
-        filename = database + "/" + index_name + ".dense.idx";
-        fd = ::open(filename.c_str(), O_RDWR);
+    bool found_all = true;
+    for (const auto id : ids) {
+        const auto* element = (filter && !filter->may_contain(id)) ? nullptr : index.find(id);
+        if (element) {
+            std::cout << element->first << " " << element->second << "\n";
+        } else {
+            std::cout << id << " not found\n";
+            found_all = false;
+        }
     }
 
+    return found_all;
+}
+
+template <class T>
+bool lookup_index_paged(const std::string& filename, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    const PagedIndex<T> index{filename};
+
+    bool found_all = true;
+    for (const auto id : ids) {
+        T value;
+        if (index.get(id, value)) {
+            std::cout << id << " " << value << "\n";
+        } else {
+            std::cout << id << " not found\n";
+            found_all = false;
+        }
+    }
+
+    return found_all;
+}
+
+template <class T>
+bool lookup_index_typed(const std::string& database, const std::string& name, const std::string& search, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    const index_format format = lookup_index_format(database, name);
+    if (format == index_format::none) {
+        std::cerr << "Can't open " << name << " index file\n";
+        std::exit(return_code::fatal);
+    }
+
+    const std::string filename{index_name(database, name, format)};
+    if (format == index_format::eytzinger) {
+        return lookup_index_eytzinger<T>(filename, ids);
+    }
+    if (format == index_format::paged) {
+        return lookup_index_paged<T>(filename, ids);
+    }
+
+    const int fd = ::open(filename.c_str(), O_RDWR);
     if (fd == -1) {
-        std::cerr << "Can't open " << index_name << " index file\n";
+        std::cerr << "Can't open " << name << " index file\n";
+        std::exit(return_code::fatal);
     }
 
-    if (index_name == "locations") {
-        if (dense) {
-            return lookup_index_dense<osmium::Location>(fd, ids);
+    if (format == index_format::dense) {
+        return lookup_index_dense<osmium::index::map::DenseFileArray<osmium::unsigned_object_id_type, T>>(fd, ids);
+    }
+    if (format == index_format::packed32 || format == index_format::packed40) {
+        return lookup_index_packed<T>(format, fd, ids);
+    }
+    return lookup_index_sparse<T>(fd, filename, search, ids);
+}
+
+bool lookup_index_snapshot(const SnapshotIndex& index, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    bool found_all = true;
+    for (const auto id : ids) {
+        size_t value;
+        if (index.get(id, value)) {
+            std::cout << id << " " << value << "\n";
         } else {
-            return lookup_index_sparse<osmium::Location>(fd, ids);
+            std::cout << id << " not found\n";
+            found_all = false;
         }
-    } else {
-        if (dense) {
-            return lookup_index_dense<size_t>(fd, ids);
+    }
+
+    return found_all;
+}
+
+bool lookup_index(const std::string& database, const std::string& index_name, const std::string& search, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    // indexes changed by eodb_update are read through the snapshot
+    SnapshotManifest manifest;
+    if (manifest.read(database)) {
+        const auto snapshot = open_snapshot_index(database, manifest, index_name);
+        if (snapshot) {
+            return lookup_index_snapshot(*snapshot, ids);
+        }
+    }
+
+    if (index_name == "locations") {
+        return lookup_index_typed<osmium::Location>(database, index_name, search, ids);
+    }
+    return lookup_index_typed<size_t>(database, index_name, search, ids);
+}
+
+bool lookup_history(const std::string& database, const std::string& index_name, osmium::Timestamp timestamp, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    const std::string filename{history_name(database, index_name)};
+    if (!file_exists(filename)) {
+        std::cerr << "Can't open " << index_name << " history index file (create database with --history)\n";
+        std::exit(return_code::fatal);
+    }
+    const HistoryIndex index{filename};
+
+    bool found_all = true;
+    for (const auto id : ids) {
+        const auto* entry = index.find(id, timestamp.seconds_since_epoch());
+        if (entry && entry->visible()) {
+            std::cout << id << " " << entry->offset << " v" << entry->version() << "\n";
         } else {
-            return lookup_index_sparse<size_t>(fd, ids);
+            std::cout << id << " not found\n";
+            found_all = false;
+        }
+    }
+
+    return found_all;
+}
+
+bool lookup_map_delta(const MapSnapshot& map, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    bool found_all = true;
+
+    std::vector<osmium::unsigned_object_id_type> parents;
+    for (const auto id : ids) {
+        parents.clear();
+        map.for_each_parent(id, [&parents](osmium::unsigned_object_id_type parent) {
+            parents.push_back(parent);
+        });
+        if (parents.empty()) {
+            std::cout << id << " not found\n";
+            found_all = false;
+            continue;
+        }
+        std::sort(parents.begin(), parents.end());
+        for (const auto parent : parents) {
+            std::cout << id << " " << parent << "\n";
         }
     }
 
-    return return_code::okay;
+    return found_all;
 }
 
-bool lookup_map(const std::string& database, const std::string& map_name, const std::vector<osmium::unsigned_object_id_type>& ids) {
-    std::string filename{database + "/" + map_name + ".map"};
+bool lookup_map(const std::string& database, const std::string& map_name, const std::string& search, const std::vector<osmium::unsigned_object_id_type>& ids) {
+    // maps changed by eodb_update are read through the snapshot
+    SnapshotManifest manifest;
+    manifest.read(database);
+    const auto files = snapshot_map_files(database, manifest, map_name);
+    if (!files.delta.empty()) {
+        return lookup_map_delta(MapSnapshot{database, files}, ids);
+    }
+
+    const std::string filename{database + "/" + (files.base.empty() ? map_name + ".map" : files.base)};
     const int fd = ::open(filename.c_str(), O_RDWR);
 
     if (fd == -1) {
         std::cerr << "Can't open " << map_name << " map file\n";
+        std::exit(return_code::fatal);
     }
 
     bool found_all = true;
 
     typedef typename osmium::index::multimap::SparseFileArray<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> sparse_map_type;
     sparse_map_type map(fd);
+    const auto filter = open_membership_filter(filename);
+    const auto model = open_model(filename, search, map.size());
 
     for (const auto id : ids) {
-        if (!lookup_id_in_index_sparse<sparse_map_type>(map, id)) {
+        if (!lookup_id_in_index_sparse<sparse_map_type>(map, filter.get(), model.get(), id)) {
             found_all = false;
         }
     }
@@ -274,10 +489,12 @@ int main(int argc, char* argv[]) {
     options.parse(argc, argv);
 
     bool found_all = false;
-    if (options.do_index()) {
-        found_all = lookup_index(options.database(), options.index(), options.search_ids());
+    if (options.as_of()) {
+        found_all = lookup_history(options.database(), options.index(), options.as_of_timestamp(), options.search_ids());
+    } else if (options.do_index()) {
+        found_all = lookup_index(options.database(), options.index(), options.search(), options.search_ids());
     } else {
-        found_all = lookup_map(options.database(), options.map(), options.search_ids());
+        found_all = lookup_map(options.database(), options.map(), options.search(), options.search_ids());
     }
 
     return found_all ? return_code::okay : return_code::not_found;
@@ -0,0 +1,147 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+// c++
+#include <iostream>
+#include <string>
+#include <vector>
+
+// boost
+#include <boost/program_options.hpp>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "leveldb_map.hpp"
+#include "options.hpp"
+#include "eodb.hpp"
+
+class Options : public OptionsBase {
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description cmdline{"Allowed options"};
+            cmdline.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("map,m", po::value<std::string>(), "Name of map")
+            ;
+
+            po::options_description hidden{"Hidden options"};
+            hidden.add_options()
+                ("ids", po::value<std::vector<osmium::unsigned_object_id_type>>(), "IDs to lookup")
+            ;
+
+            po::options_description desc;
+            desc.add(cmdline).add(hidden);
+
+            po::positional_options_description positional;
+            positional.add("ids", -1);
+
+            po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_lookup_leveldb");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_lookup_leveldb [OPTIONS] ID...\n";
+                std::cout << "Look up data in the LevelDB maps.\n\n";
+                std::cout << cmdline << "\n";
+                std::cout << "Maps: n(ode)2w(ay), n(ode)2r(elation), w(ay)2r(elation), r(elation)2r(elation)\n";
+                std::exit(return_code::okay);
+            }
+
+            if (vm.count("map")) {
+                if (map() != "node2way" && map() != "node2relation" && map() != "way2relation" && map() != "relation2relation") {
+                    std::cerr << "Map given with --map,-m must be one of: node2way, node2relation, way2relation, relation2relation\n";
+                    std::exit(return_code::fatal);
+                }
+            } else {
+                std::cerr << "Need --map, -m option\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (vm.count("ids") == 0) {
+                std::cerr << "Need at least one Id to search for on command line\n";
+                std::exit(return_code::fatal);
+            }
+
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+    std::string map() const {
+        std::string map = vm["map"].as<std::string>();
+        if (map == "n2w") {
+            map = "node2way";
+        } else if (map == "n2r") {
+            map = "node2relation";
+        } else if (map == "w2r") {
+            map = "way2relation";
+        } else if (map == "r2r") {
+            map = "relation2relation";
+        }
+        return map;
+    }
+
+    std::vector<osmium::unsigned_object_id_type> search_ids() const {
+        return vm["ids"].as<std::vector<osmium::unsigned_object_id_type>>();
+    }
+
+}; // class Options
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    bool found_all = true;
+
+    try {
+        LevelDBMap reader{leveldb_map_name(options.database(), options.map())};
+
+        for (const auto id : options.search_ids()) {
+            const auto count = reader.for_each_value(id, [id](osmium::unsigned_object_id_type value) {
+                std::cout << id << " " << value << "\n";
+            });
+            if (count == 0) {
+                std::cout << id << " not found\n";
+                found_all = false;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    return found_all ? return_code::okay : return_code::not_found;
+}
+
@@ -0,0 +1,627 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <sys/file.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// boost
+#include <boost/program_options.hpp>
+
+// osmium
+#include <osmium/index/map.hpp>
+#include <osmium/index/node_locations_map.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "eytzinger_index.hpp"
+#include "index_files.hpp"
+#include "index_reader.hpp"
+#include "journal.hpp"
+#include "learned_index.hpp"
+#include "map_delta.hpp"
+#include "mapped_file.hpp"
+#include "membership_filter.hpp"
+#include "metadata.hpp"
+#include "offset_index.hpp"
+#include "options.hpp"
+#include "paged_index.hpp"
+#include "relation_maps.hpp"
+#include "snapshot.hpp"
+#include "spilling_index.hpp"
+#include "way_geometry.hpp"
+
+typedef std::pair<osmium::unsigned_object_id_type, std::size_t> offset_element;
+typedef std::pair<osmium::unsigned_object_id_type, osmium::Location> location_element;
+typedef osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location> location_index_type;
+
+class Options : public OptionsBase {
+
+    index_format m_index_format{index_format::sparse};
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description desc{"Allowed options"};
+            desc.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("format,f", po::value<std::string>()->default_value("sparse"), "Format of the node/way/relation indexes: sparse, dense, packed32, packed40")
+                ("layout,L", po::value<std::string>()->default_value("list"), "Layout of index files: list, eytzinger (sparse), paged (dense)")
+                ("maps,m", "Create maps")
+                ("locations,l", po::value<std::string>(), "Create locations cache of this type ('sparse' or 'dense')")
+                ("memory-limit,M", po::value<std::size_t>()->default_value(1024), "Memory limit (in MB) for the node/way/relation offsets, spill to disk if exceeded")
+                ("threads,j", po::value<unsigned int>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Number of threads")
+            ;
+
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_reindex");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_reindex [OPTIONS]\n";
+                std::cout << "Rebuild indexes and maps from the data in the database.\n\n";
+                std::cout << desc << "\n";
+                std::exit(return_code::okay);
+            }
+
+            const std::string format{vm["format"].as<std::string>()};
+            if (format == "dense") {
+                m_index_format = index_format::dense;
+            } else if (format == "packed32") {
+                m_index_format = index_format::packed32;
+            } else if (format == "packed40") {
+                m_index_format = index_format::packed40;
+            } else if (format != "sparse") {
+                std::cerr << "Format given with --format,-f must be one of: sparse, dense, packed32, packed40\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (layout() != "list" && layout() != "eytzinger" && layout() != "paged") {
+                std::cerr << "Layout given with --layout,-L must be one of: list, eytzinger, paged\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (layout() == "eytzinger" && m_index_format != index_format::sparse) {
+                std::cerr << "The eytzinger layout can only be used with sparse indexes\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (layout() == "paged" && m_index_format != index_format::dense) {
+                std::cerr << "The paged layout can only be used with (unpacked) dense indexes\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (create_locations() && locations_type() != "sparse" && locations_type() != "dense") {
+                std::cerr << "Error: locations cache type has to be 'sparse' or 'dense'\n";
+                std::exit(return_code::fatal);
+            }
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+    index_format file_format() const {
+        return m_index_format;
+    }
+
+    std::string layout() const {
+        return vm["layout"].as<std::string>();
+    }
+
+    bool create_maps() const {
+        return vm.count("maps") > 0;
+    }
+
+    bool create_locations() const {
+        return vm.count("locations") > 0;
+    }
+
+    std::string locations_type() const {
+        return vm["locations"].as<std::string>();
+    }
+
+    unsigned int threads() const {
+        return std::max(1u, vm["threads"].as<unsigned int>());
+    }
+
+    std::size_t memory_limit() const {
+        return vm["memory-limit"].as<std::size_t>() * 1024 * 1024;
+    }
+
+}; // class Options
+
+/// The entries found in one chunk of the data file.
+struct chunk_result {
+    std::vector<offset_element> offsets[3];
+    std::vector<location_element> locations;
+    ObjectStatistics statistics;
+};
+
+/**
+ * Split the buffer into chunks of about chunk_size bytes. Only the item
+ * headers are read to find the item boundaries.
+ */
+std::vector<std::pair<std::size_t, std::size_t>> split_into_chunks(const osmium::memory::Buffer& buffer, std::size_t chunk_size) {
+    std::vector<std::pair<std::size_t, std::size_t>> chunks;
+
+    std::size_t first = 0;
+    for (const auto& item : buffer) {
+        const std::size_t offset = reinterpret_cast<const unsigned char*>(&item) - buffer.data();
+        if (offset - first >= chunk_size) {
+            chunks.emplace_back(first, offset);
+            first = offset;
+        }
+    }
+    if (first < buffer.committed()) {
+        chunks.emplace_back(first, buffer.committed());
+    }
+
+    return chunks;
+}
+
+void scan_chunk(unsigned char* data, const std::pair<std::size_t, std::size_t>& chunk, bool with_locations, chunk_result& result) {
+    osmium::memory::Buffer buffer{data + chunk.first, chunk.second - chunk.first};
+    for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+        const auto nwr = osmium::item_type_to_nwr_index(it->type());
+        const std::size_t offset = reinterpret_cast<const unsigned char*>(&*it) - data;
+        result.offsets[nwr].emplace_back(it->positive_id(), offset);
+        result.statistics.add(nwr, it->positive_id());
+        if (with_locations && it->type() == osmium::item_type::node) {
+            result.locations.emplace_back(it->positive_id(), static_cast<const osmium::Node&>(*it).location());
+        }
+    }
+}
+
+/// Remove the files of an index in all formats.
+void remove_index_files(const std::string& database, const std::string& name) {
+    for (const auto format : {index_format::sparse, index_format::eytzinger, index_format::dense, index_format::paged, index_format::packed32, index_format::packed40}) {
+        const std::string filename{index_name(database, name, format)};
+        ::unlink(filename.c_str());
+        ::unlink(filter_name(filename).c_str());
+        ::unlink(model_name(filename).c_str());
+    }
+}
+
+/**
+ * Call func with the last of all entries with the same ID in the sorted
+ * range.
+ */
+template <typename TFunc>
+void for_each_current(const offset_element* first, const offset_element* last, TFunc&& func) {
+    for (const auto* it = first; it != last; ++it) {
+        if (it + 1 == last || it[1].first != it->first) {
+            func(*it);
+        }
+    }
+}
+
+/**
+ * Write the offset index in the format and layout given in the options.
+ * The entries of the spilling index are merged in ID and offset order
+ * into a temporary file first. If there are several entries with the same
+ * ID (objects changed by updates), the last one in the data file wins.
+ * Returns the counts of the IDs in the index.
+ */
+ObjectStatistics::counts write_offset_index(const Options& options, const std::string& name, SpillingOffsetIndex& index) {
+    remove_index_files(options.database(), name);
+
+    const std::string sorted_file{options.database() + "/" + name + ".sorted"};
+    const int fd = ::open(sorted_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(), "Can't open '" + sorted_file + "'"};
+    }
+    index.sort();
+    index.dump_as_list(fd);
+    index.clear();
+    if (::close(fd) != 0) {
+        throw std::system_error{errno, std::system_category(), "Can't close '" + sorted_file + "'"};
+    }
+
+    ObjectStatistics::counts counts;
+    MappedFile sorted{sorted_file};
+    const auto* const first = reinterpret_cast<const offset_element*>(sorted.data());
+    const auto* const last = first + sorted.size() / sizeof(offset_element);
+    for_each_current(first, last, [&counts](const offset_element& element) {
+        ++counts.count;
+        counts.min_id = std::min(counts.min_id, uint64_t(element.first));
+        counts.max_id = std::max(counts.max_id, uint64_t(element.first));
+    });
+
+    const std::string index_file{index_name(options.database(), name, options.file_format())};
+
+    if (options.file_format() == index_format::sparse) {
+        {
+            OutputFile file{index_file};
+            for_each_current(first, last, [&file](const offset_element& element) {
+                file.write_value(element);
+            });
+            file.close();
+        }
+        sorted.close();
+        ::unlink(sorted_file.c_str());
+
+        if (options.layout() == "eytzinger") {
+            const std::string eytzinger_file{index_name(options.database(), name, index_format::eytzinger)};
+            write_eytzinger_index<size_t>(index_file, eytzinger_file);
+            ::unlink(index_file.c_str());
+            write_membership_filter(eytzinger_file);
+            return counts;
+        }
+
+        write_membership_filter(index_file);
+        write_learned_index(index_file);
+        return counts;
+    }
+
+    std::size_t element_size = 0;
+    if (options.file_format() == index_format::packed32) {
+        element_size = 4;
+    } else if (options.file_format() == index_format::packed40) {
+        element_size = 5;
+    }
+
+    {
+        const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, size_t>::instance();
+        const std::string type{options.file_format() == index_format::dense ? "dense" : index_format_name(options.file_format()) + std::string{"_dense"}};
+        std::unique_ptr<offset_index_type> dense_index = map_factory.create_map(type + "_file_array," + index_file);
+        for_each_current(first, last, [&dense_index](const offset_element& element) {
+            dense_index->set(element.first, element.second);
+        });
+        sorted.close();
+        ::unlink(sorted_file.c_str());
+
+        // the packed file based index grows in chunks, remove unused space at the end
+        if (element_size != 0 && ::truncate(index_file.c_str(), dense_index->size() * element_size) != 0) {
+            throw std::system_error{errno, std::system_category(), "Can't truncate index file '" + index_file + "'"};
+        }
+    }
+
+    if (options.layout() == "paged") {
+        write_paged_index<size_t>(index_file, index_name(options.database(), name, index_format::paged));
+        ::unlink(index_file.c_str());
+    }
+
+    return counts;
+}
+
+void write_locations_cache(const Options& options, std::vector<location_element>& elements) {
+    const std::string prefix{options.database() + "/locations.cache."};
+    ::unlink((prefix + "sparse").c_str());
+    ::unlink((prefix + "dense").c_str());
+
+    const std::string filename{prefix + options.locations_type()};
+    if (options.locations_type() == "sparse") {
+        write_sparse_list(filename, elements);
+        return;
+    }
+
+    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, osmium::Location>::instance();
+    std::unique_ptr<location_index_type> index = map_factory.create_map("dense_file_array," + filename);
+    for (const auto& element : elements) {
+        index->set(element.first, element.second);
+    }
+}
+
+void write_metadata(const Options& options, const ObjectStatistics& statistics, const ObjectStatistics& indexes) {
+    DatabaseMetadata metadata;
+    metadata.read(options.database());
+
+    ObjectStatistics::counts objects;
+    objects.min_id = 0;
+    for (const auto& counts : statistics.types) {
+        objects.count += counts.count;
+    }
+    metadata.set("data", options.data_file_name(), index_format::none, objects);
+
+    const char* names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const index_format format = detect_index_format(options.database(), names[nwr]);
+        metadata.set(names[nwr], index_name(options.database(), names[nwr], format), format, indexes.types[nwr]);
+    }
+
+    for (const char* name : {"node2way", "node2relation", "way2relation", "relation2relation"}) {
+        if (options.create_maps() || (metadata.entries.count(name) != 0 && file_exists(map_name(options.database(), name)))) {
+            metadata.set_map(name, map_name(options.database(), name));
+        }
+    }
+
+    metadata.write(options.database());
+}
+
+void rename_file(const std::string& from, const std::string& to) {
+    if (std::rename(from.c_str(), to.c_str()) != 0) {
+        throw std::system_error{errno, std::system_category(), "Renaming '" + from + "' failed"};
+    }
+}
+
+/**
+ * Write the maps changed by updates with their deltas merged in into the
+ * map files of generation 0.
+ */
+void write_updated_maps(const std::string& database, const SnapshotManifest& manifest) {
+    for (const char* name : {"node2way", "node2relation", "way2relation", "relation2relation"}) {
+        const auto files = snapshot_map_files(database, manifest, name);
+        if (files.delta.empty() && (files.base.empty() || files.base == std::string{name} + ".map")) {
+            continue;
+        }
+
+        const std::string filename{map_name(database, name)};
+        {
+            const MapSnapshot map{database, files};
+            OutputFile file{filename + ".tmp"};
+            map.for_each([&file](const map_element& element) {
+                file.write_value(element);
+            });
+            file.sync();
+            file.close();
+        }
+        rename_file(filename + ".tmp", filename);
+        write_membership_filter(filename);
+        write_learned_index(filename);
+    }
+}
+
+/**
+ * Write the way geometry index changed by updates with its delta merged
+ * in into the index file of generation 0.
+ */
+void write_updated_way_geometry_index(const std::string& database, const SnapshotManifest& manifest) {
+    const auto files = snapshot_way_geometry_files(database, manifest);
+    if (files.delta.empty() && (files.base.empty() || files.base == "ways.geom.idx")) {
+        return;
+    }
+
+    const std::string filename{way_geometry_index_name(database)};
+    {
+        const MappedFile index{database + "/" + files.base};
+        std::unique_ptr<MappedFile> delta;
+        if (!files.delta.empty()) {
+            delta.reset(new MappedFile{database + "/" + files.delta});
+        }
+        const auto* const index_first = reinterpret_cast<const id_pair*>(index.data());
+        const auto* const delta_first = delta ? reinterpret_cast<const id_pair*>(delta->data()) : nullptr;
+
+        OutputFile file{filename + ".tmp"};
+        merge_way_geometry_entries(index_first, index_first + index.size() / sizeof(id_pair),
+                                   delta_first, delta_first + (delta ? delta->size() / sizeof(id_pair) : 0),
+                                   [&file](const id_pair& entry) {
+            if (entry.second != removed_geometry) {
+                file.write_value(entry);
+            }
+        });
+        file.sync();
+        file.close();
+    }
+    rename_file(filename + ".tmp", filename);
+}
+
+/**
+ * Remove all files only used by updated generations. The manifest of
+ * generation 0 must have been written before.
+ */
+void remove_snapshot_files(const std::string& database, const SnapshotManifest& manifest) {
+    const auto remove = [&database](const std::string& name) {
+        if (!name.empty()) {
+            ::unlink((database + "/" + name).c_str());
+        }
+    };
+
+    for (const auto& index : manifest.indexes) {
+        if (index.second.base != index.first + "." + index_format_name(index.second.format) + ".idx") {
+            remove(index.second.base);
+        }
+        remove(index.second.delta);
+    }
+    for (const auto& map : manifest.maps) {
+        if (map.second.base != map.first + ".map") {
+            remove(map.second.base);
+            remove(filter_name(map.second.base));
+            remove(model_name(map.second.base));
+        }
+        remove(map.second.delta);
+    }
+    if (manifest.way_geometries.base != "ways.geom.idx") {
+        remove(manifest.way_geometries.base);
+    }
+    remove(manifest.way_geometries.delta);
+    for (const auto& name : manifest.retired) {
+        remove(name);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    // no update may run while the database is reindexed
+    const int data_fd = ::open(options.data_file_name().c_str(), O_RDWR);
+    if (data_fd < 0) {
+        std::cerr << "Can't open data file '" << options.data_file_name() << "': " << std::strerror(errno) << "\n";
+        std::exit(return_code::fatal);
+    }
+    if (::flock(data_fd, LOCK_EX | LOCK_NB) != 0) {
+        std::cerr << "Database '" << options.database() << "' is locked by an update\n";
+        std::exit(return_code::fatal);
+    }
+
+    if (file_exists(journal_name(options.database()))) {
+        std::cerr << "Database '" << options.database() << "' has an interrupted update, run eodb_update first\n";
+        std::exit(return_code::fatal);
+    }
+
+    try {
+        // only the data of the current generation is indexed, anything
+        // after it was appended by an update that was never published
+        SnapshotManifest manifest;
+        const bool has_manifest = manifest.read(options.database());
+        const bool updated = has_manifest && manifest.generation != 0;
+        if (has_manifest && ::ftruncate(data_fd, manifest.data_size) != 0) {
+            throw std::system_error{errno, std::system_category(), "truncating data file failed"};
+        }
+
+        MappedFile mf{options.data_file_name()};
+        osmium::memory::Buffer buffer{mf.data(), mf.size()};
+
+        // several chunks per thread to even out differences between chunks,
+        // but not too large, because the results of the chunks being
+        // scanned are kept in memory
+        const std::size_t chunk_size = std::max(std::size_t(1024 * 1024), std::min(std::size_t(64 * 1024 * 1024), mf.size() / (options.threads() * 16)));
+        const auto chunks = split_into_chunks(buffer, chunk_size);
+
+        const char* names[3] = {"nodes", "ways", "relations"};
+        MemoryBudget memory_budget{options.memory_limit()};
+        std::unique_ptr<SpillingOffsetIndex> offset_indexes[3];
+        for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+            offset_indexes[nwr].reset(new SpillingOffsetIndex{memory_budget, options.database() + "/" + names[nwr] + ".run."});
+        }
+
+        // scan a group of chunks in parallel, then add their entries to
+        // the offset indexes in data file order
+        ObjectStatistics statistics;
+        std::vector<location_element> locations;
+        const std::size_t group_size = options.threads() * 2;
+        for (std::size_t group = 0; group < chunks.size(); group += group_size) {
+            std::vector<chunk_result> results(std::min(group_size, chunks.size() - group));
+            std::atomic<std::size_t> next_chunk{0};
+            std::vector<std::future<void>> tasks;
+            for (unsigned int i = 0; i < options.threads(); ++i) {
+                tasks.push_back(std::async(std::launch::async, [&]() {
+                    for (std::size_t n = next_chunk++; n < results.size(); n = next_chunk++) {
+                        scan_chunk(mf.data(), chunks[group + n], options.create_locations(), results[n]);
+                    }
+                }));
+            }
+            for (auto& task : tasks) {
+                task.get();
+            }
+
+            for (const auto& result : results) {
+                for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+                    for (const auto& element : result.offsets[nwr]) {
+                        offset_indexes[nwr]->set(element.first, element.second);
+                    }
+                    const auto& c = result.statistics.types[nwr];
+                    auto& s = statistics.types[nwr];
+                    s.count += c.count;
+                    s.min_id = std::min(s.min_id, c.min_id);
+                    s.max_id = std::max(s.max_id, c.max_id);
+                }
+                locations.insert(locations.end(), result.locations.begin(), result.locations.end());
+            }
+        }
+
+        ObjectStatistics indexes;
+        std::vector<std::future<void>> tasks;
+        for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+            tasks.push_back(std::async(std::launch::async, [&options, &offset_indexes, &indexes, &names, nwr]() {
+                indexes.types[nwr] = write_offset_index(options, names[nwr], *offset_indexes[nwr]);
+            }));
+        }
+        if (options.create_locations()) {
+            tasks.push_back(std::async(std::launch::async, [&options, &locations]() {
+                write_locations_cache(options, locations);
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+
+        if (options.create_maps()) {
+            // in updated databases only the last version of each object
+            // is used
+            const SnapshotManifest generation0;
+            const IndexReader<std::size_t> way_index{options.database(), "ways", generation0};
+            const IndexReader<std::size_t> relation_index{options.database(), "relations", generation0};
+            const auto is_current = [&](const osmium::OSMObject& object) {
+                if (!updated) {
+                    return true;
+                }
+                const auto& index = object.type() == osmium::item_type::way ? way_index : relation_index;
+                std::size_t offset;
+                return object.visible() && index.get(object.positive_id(), offset) &&
+                       offset == std::size_t(reinterpret_cast<const unsigned char*>(&object) - mf.data());
+            };
+
+            RelationMapsBuilder relation_maps_builder{options.threads()};
+            for (const auto& chunk : chunks) {
+                osmium::memory::Buffer chunk_buffer{mf.data() + chunk.first, chunk.second - chunk.first};
+                relation_maps_builder.start(chunk_buffer, is_current);
+                relation_maps_builder.wait();
+            }
+            relation_maps_builder.write(options.database());
+        } else if (updated) {
+            write_updated_maps(options.database(), manifest);
+        }
+
+        if (updated) {
+            write_updated_way_geometry_index(options.database(), manifest);
+        }
+
+        write_metadata(options, statistics, indexes);
+
+        // the database is in generation 0 again
+        SnapshotManifest generation0;
+        generation0.data_size = mf.size();
+        generation0.write(options.database());
+        if (updated) {
+            remove_snapshot_files(options.database(), manifest);
+        }
+
+        mf.close();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    ::close(data_fd);
+
+    return return_code::okay;
+}
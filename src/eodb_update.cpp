@@ -20,12 +20,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 // c++
+#include <algorithm>
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
+#include <functional>
+#include <future>
 #include <getopt.h>
 #include <iostream>
 #include <set>
 #include <string>
+#include <thread>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <vector>
@@ -38,14 +44,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <boost/program_options.hpp>
 
 // osmium
+#include <osmium/handler.hpp>
 #include <osmium/io/any_input.hpp>
+#include <osmium/visitor.hpp>
 
 // eodb
+#include "affected.hpp"
 #include "any_index.hpp"
 #include "eodb.hpp"
 #include "offset_index.hpp"
+#include "journal.hpp"
+#include "map_delta.hpp"
+#include "metadata.hpp"
 #include "options.hpp"
+#include "replication.hpp"
+#include "snapshot.hpp"
 #include "updatable_disk_store.hpp"
+#include "way_geometry.hpp"
 
 class Options : public OptionsBase {
 
@@ -54,11 +69,8 @@ public:
     void parse(int argc, char* argv[]) {
         std::set<std::string> index_types = {
             "dense_file_array",
-            "sparse_file_array",
-            "sparse_mem_array",
-            "sparse_mem_map",
-            "sparse_mem_table",
-            "sparse_mmap_array"
+            "packed32_dense_file_array",
+            "packed40_dense_file_array"
         };
 
         try {
@@ -69,6 +81,12 @@ public:
                 ("help,h", "Print this help message")
                 ("version", "Show version")
                 ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+                ("replication,r", po::value<std::string>(), "Apply change files from replication directory")
+                ("sequence,s", po::value<int64_t>(), "First sequence number to apply (if the database has none)")
+                ("batch-size,b", po::value<std::size_t>()->default_value(32), "Merge change files up to this size (in MB) into one batch")
+                ("affected,A", po::value<std::string>(), "Write IDs of changed and affected objects to this file")
+                ("expire-tiles,e", po::value<std::string>(), "Write list of expired tiles to this file")
+                ("expire-zoom,z", po::value<unsigned int>()->default_value(14), "Zoom level for expired tiles")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -89,54 +107,674 @@ public:
 
             if (vm.count("help")) {
                 std::cout << "Usage: eodb_update [OPTIONS] OSM-CHANGE-FILE...\n";
+                std::cout << "       eodb_update [OPTIONS] --replication=DIR\n";
                 std::cout << "Update database from OSM change files.\n\n";
                 std::cout << cmdline << "\n";
-                std::cout << "Index types:\n";
+                std::cout << "Updatable index types:\n";
                 for (const auto& index_type : index_types) {
                     std::cout << "  " << index_type << "\n";
                 }
                 std::exit(return_code::okay);
             }
 
+            if (vm.count("replication") && vm.count("input-filenames")) {
+                std::cerr << "Can't use --replication together with change files\n";
+                std::exit(return_code::fatal);
+            }
+
+            if (expire_zoom() > 30) {
+                std::cerr << "Zoom level given with --expire-zoom,z must be between 0 and 30\n";
+                std::exit(return_code::fatal);
+            }
+
         } catch (const boost::program_options::error& e) {
             std::cerr << "Error parsing command line: " << e.what() << '\n';
             std::exit(return_code::fatal);
         }
     }
 
+    bool replication() const {
+        return vm.count("replication") != 0;
+    }
+
+    std::string replication_directory() const {
+        return vm["replication"].as<std::string>();
+    }
+
+    bool has_sequence() const {
+        return vm.count("sequence") != 0;
+    }
+
+    int64_t sequence() const {
+        return vm["sequence"].as<int64_t>();
+    }
+
+    std::size_t batch_size() const {
+        return vm["batch-size"].as<std::size_t>() * 1024 * 1024;
+    }
+
+    bool affected() const {
+        return vm.count("affected") != 0;
+    }
+
+    std::string affected_file_name() const {
+        return vm["affected"].as<std::string>();
+    }
+
+    bool expire_tiles() const {
+        return vm.count("expire-tiles") != 0;
+    }
+
+    std::string expire_tiles_file_name() const {
+        return vm["expire-tiles"].as<std::string>();
+    }
+
+    unsigned int expire_zoom() const {
+        return vm["expire-zoom"].as<unsigned int>();
+    }
+
 }; // class Options
 
+SnapshotManifest read_manifest(const std::string& database, int data_fd) {
+    SnapshotManifest manifest;
+    const bool found = manifest.read(database);
+    if (found && manifest.generation != 0) {
+        return manifest;
+    }
+
+    // generation 0: the indexes as written by eodb_create, the data size
+    // from its manifest (databases from older versions have none)
+    if (!found) {
+        struct stat s;
+        if (::fstat(data_fd, &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "stat on data file failed"};
+        }
+        manifest.data_size = s.st_size;
+    }
+
+    for (const char* name : {"nodes", "ways", "relations"}) {
+        const index_format format = lookup_index_format(database, name);
+        if (offset_element_size(format) == 0) {
+            throw std::runtime_error{std::string{"Can only update dense or packed "} + name + " index"};
+        }
+        manifest.indexes[name] = SnapshotManifest::index_files{format, std::string{name} + "." + index_format_name(format) + ".idx", ""};
+    }
+
+    return manifest;
+}
+
+/**
+ * Add the objects written in this update to the count of the data file
+ * and the objects added to the counts of the indexes in the metadata (if
+ * there is any). Update the file sizes and checksums of the data file,
+ * the indexes, and the maps.
+ */
+void update_metadata(const std::string& database, const SnapshotManifest& manifest, const ObjectStatistics& written, const ObjectStatistics& added) {
+    DatabaseMetadata metadata;
+    if (!metadata.read(database)) {
+        return;
+    }
+
+    auto& data = metadata.entries["data"];
+    const char* names[3] = {"nodes", "ways", "relations"};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        data.count += written.types[nwr].count;
+
+        const auto& counts = added.types[nwr];
+        auto& e = metadata.entries[names[nwr]];
+        if (counts.count > 0) {
+            e.min_id = e.count > 0 ? std::min(e.min_id, counts.min_id) : counts.min_id;
+            e.max_id = std::max(e.max_id, counts.max_id);
+            e.count += counts.count;
+        }
+        const std::string base{database + "/" + manifest.indexes.at(names[nwr]).base};
+        e.format = manifest.indexes.at(names[nwr]).format;
+        e.file_size = DatabaseMetadata::file_size(base);
+        e.checksum = quick_file_checksum(base);
+    }
+    data.file_size = manifest.data_size;
+    data.checksum = quick_file_checksum(database + DEFAULT_DATA_FILE);
+
+    // map files written when a map delta was compacted
+    for (const auto& map : manifest.maps) {
+        if (!map.second.base.empty() && metadata.entries.count(map.first) != 0) {
+            metadata.set_map(map.first, database + "/" + map.second.base);
+        }
+    }
+
+    metadata.write(database);
+}
+
+/**
+ * IDs of the objects changed in this update. Only collected if there are
+ * maps, a way geometry store, or metadata, or if affected objects or
+ * expired tiles are needed.
+ */
+struct ChangedObjects : public osmium::handler::Handler {
+
+    std::vector<osmium::unsigned_object_id_type> nodes;
+    std::vector<osmium::unsigned_object_id_type> ways;
+    std::vector<osmium::unsigned_object_id_type> relations;
+
+    void node(const osmium::Node& node) {
+        nodes.push_back(node.positive_id());
+    }
+
+    void way(const osmium::Way& way) {
+        ways.push_back(way.positive_id());
+    }
+
+    void relation(const osmium::Relation& relation) {
+        relations.push_back(relation.positive_id());
+    }
+
+    void add(unsigned int nwr, osmium::unsigned_object_id_type id) {
+        switch (nwr) {
+            case 0:
+                nodes.push_back(id);
+                break;
+            case 1:
+                ways.push_back(id);
+                break;
+            default:
+                relations.push_back(id);
+                break;
+        }
+    }
+
+    void sort() {
+        sort_unique(nodes);
+        sort_unique(ways);
+        sort_unique(relations);
+    }
+
+}; // struct ChangedObjects
+
+const char* const map_names[4] = {"node2way", "node2relation", "way2relation", "relation2relation"};
+
+bool has_map(const std::string& database, const SnapshotManifest& manifest, const char* name) {
+    const auto files = snapshot_map_files(database, manifest, name);
+    return !files.base.empty() || !files.delta.empty();
+}
+
+/**
+ * Write the maps of the next generation: Each changed way or relation is
+ * replaced by its current members (or none if it was deleted), so entries
+ * of deleted objects and of removed members are dropped and new members
+ * are found. Only maps that exist are updated and node2way if there is a
+ * way geometry store (which needs it to find the ways of changed nodes).
+ */
+void update_maps(const std::string& database, const SnapshotManifest& manifest, SnapshotManifest& next, const offset_index_type& way_index, const offset_index_type& relation_index, const ChangedObjects& changes, bool has_way_geometries) {
+    MappedFile mf{database + DEFAULT_DATA_FILE};
+    if (mf.size() < next.data_size) {
+        throw std::runtime_error{"Data file is smaller than expected"};
+    }
+    const osmium::memory::Buffer data{mf.data(), next.data_size};
+
+    bool update[4];
+    for (unsigned int n = 0; n < 4; ++n) {
+        update[n] = has_map(database, manifest, map_names[n]);
+    }
+    update[0] = update[0] || has_way_geometries;
+
+    const auto find_offset = [](const offset_index_type& index, osmium::unsigned_object_id_type id, std::size_t& offset) {
+        try {
+            offset = index.get(id);
+            return true;
+        } catch (const osmium::not_found&) {
+            return false;
+        }
+    };
+
+    MapDeltaWriter writers[4];
+    std::size_t offset;
+    if (update[0]) {
+        for (const auto id : changes.ways) {
+            if (!find_offset(way_index, id, offset)) {
+                continue;
+            }
+            writers[0].replace(id);
+            const auto& way = data.get<osmium::Way>(offset);
+            if (way.visible()) {
+                for (const auto& node_ref : way.nodes()) {
+                    writers[0].add(node_ref.positive_ref(), id);
+                }
+            }
+        }
+    }
+
+    if (update[1] || update[2] || update[3]) {
+        for (const auto id : changes.relations) {
+            if (!find_offset(relation_index, id, offset)) {
+                continue;
+            }
+            for (unsigned int n = 1; n < 4; ++n) {
+                writers[n].replace(id);
+            }
+            const auto& relation = data.get<osmium::Relation>(offset);
+            if (!relation.visible()) {
+                continue;
+            }
+            for (const auto& member : relation.members()) {
+                switch (member.type()) {
+                    case osmium::item_type::node:
+                        writers[1].add(member.positive_ref(), id);
+                        break;
+                    case osmium::item_type::way:
+                        writers[2].add(member.positive_ref(), id);
+                        break;
+                    case osmium::item_type::relation:
+                        writers[3].add(member.positive_ref(), id);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    }
+    mf.close();
+
+    for (unsigned int n = 0; n < 4; ++n) {
+        if (update[n]) {
+            const auto files = snapshot_map_files(database, manifest, map_names[n]);
+            next.maps[map_names[n]] = writers[n].write_next(database, map_names[n], files, next.generation);
+            retire_map_files(files, next.maps[map_names[n]], next.retired);
+        }
+    }
+}
+
+/**
+ * Write new geometries of all changed ways and all ways with changed
+ * nodes (found through the node2way map of the next generation) into the
+ * way geometry store. The node locations are read from the data file
+ * through the node index.
+ */
+void update_way_geometries(const std::string& database, const SnapshotManifest& manifest, SnapshotManifest& next, const offset_index_type& node_index, const offset_index_type& way_index, const ChangedObjects& changes) {
+    std::vector<osmium::unsigned_object_id_type> ways{changes.ways};
+    const auto node2way_files = snapshot_map_files(database, next, "node2way");
+    if (!node2way_files.base.empty() || !node2way_files.delta.empty()) {
+        MapSnapshot{database, node2way_files}.find_parents(changes.nodes.cbegin(), changes.nodes.cend(), ways);
+    }
+    sort_unique(ways);
+
+    MappedFile mf{database + DEFAULT_DATA_FILE};
+    if (mf.size() < next.data_size) {
+        throw std::runtime_error{"Data file is smaller than expected"};
+    }
+    const osmium::memory::Buffer data{mf.data(), next.data_size};
+
+    const auto files = snapshot_way_geometry_files(database, manifest);
+    WayGeometryWriter writer{database, files};
+    std::vector<osmium::Location> locations;
+    for (const auto id : ways) {
+        std::size_t offset;
+        try {
+            offset = way_index.get(id);
+        } catch (const osmium::not_found&) {
+            continue;
+        }
+        const auto& way = data.get<osmium::Way>(offset);
+        if (!way.visible()) {
+            writer.remove(id);
+            continue;
+        }
+
+        locations.clear();
+        for (const auto& node_ref : way.nodes()) {
+            try {
+                const auto& node = data.get<osmium::Node>(node_index.get(node_ref.positive_ref()));
+                if (node.visible() && node.location().valid()) {
+                    locations.push_back(node.location());
+                }
+            } catch (const osmium::not_found&) {
+                // leave out missing nodes
+            }
+        }
+        writer.add(id, locations);
+    }
+    mf.close();
+
+    next.way_geometries = writer.write_next(next.generation);
+    if (files.base != next.way_geometries.base) {
+        next.retired.push_back(files.base);
+    }
+    if (!files.delta.empty() && files.delta != next.way_geometries.delta) {
+        next.retired.push_back(files.delta);
+    }
+}
+
+/**
+ * Count the changed objects that are new to the indexes: They were not in
+ * the index of the generation before this update and their current version
+ * is visible. Modified objects were counted when they were added, deleted
+ * ones are not added.
+ */
+ObjectStatistics added_objects(const std::string& database, const SnapshotManifest& manifest, std::size_t data_size, const offset_index_type& node_index, const offset_index_type& way_index, const offset_index_type& relation_index, const ChangedObjects& changes) {
+    MappedFile mf{database + DEFAULT_DATA_FILE};
+    if (mf.size() < data_size) {
+        throw std::runtime_error{"Data file is smaller than expected"};
+    }
+    const osmium::memory::Buffer data{mf.data(), data_size};
+
+    ObjectStatistics statistics;
+    const char* names[3] = {"nodes", "ways", "relations"};
+    const offset_index_type* indexes[3] = {&node_index, &way_index, &relation_index};
+    const std::vector<osmium::unsigned_object_id_type>* ids[3] = {&changes.nodes, &changes.ways, &changes.relations};
+    for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+        const SnapshotIndex old_index{database, manifest.indexes.at(names[nwr])};
+        for (const auto id : *ids[nwr]) {
+            std::size_t offset;
+            if (old_index.get(id, offset)) {
+                continue;
+            }
+            offset = indexes[nwr]->get_noexcept(id);
+            if (offset != osmium::index::empty_value<std::size_t>() && data.get<osmium::OSMObject>(offset).visible()) {
+                statistics.add(nwr, id);
+            }
+        }
+    }
+
+    mf.close();
+    return statistics;
+}
+
+/**
+ * Add the tiles of the old and new locations of all changed nodes, of the
+ * nodes of all affected ways (new versions) and changed ways (old
+ * versions), and of the direct node and way members of changed relations
+ * (old and new versions).
+ */
+void add_expired_tiles(const std::string& database, const SnapshotManifest& manifest, std::size_t data_size, const offset_index_type& node_index, const offset_index_type& way_index, const offset_index_type& relation_index, const ChangedObjects& changes, const AffectedObjects& affected, ExpiredTiles& tiles) {
+    MappedFile mf{database + DEFAULT_DATA_FILE};
+    if (mf.size() < data_size) {
+        throw std::runtime_error{"Data file is smaller than expected"};
+    }
+    const osmium::memory::Buffer data{mf.data(), data_size};
+
+    // the indexes of the generation before this update
+    const SnapshotIndex old_nodes{database, manifest.indexes.at("nodes")};
+    const SnapshotIndex old_ways{database, manifest.indexes.at("ways")};
+    const SnapshotIndex old_relations{database, manifest.indexes.at("relations")};
+
+    const auto add_node = [&](osmium::unsigned_object_id_type id) {
+        try {
+            tiles.add(data.get<osmium::Node>(node_index.get(id)).location());
+        } catch (const osmium::not_found&) {
+            // not in the database
+        }
+    };
+
+    const auto add_way = [&](const osmium::Way& way) {
+        for (const auto& node_ref : way.nodes()) {
+            add_node(node_ref.positive_ref());
+        }
+    };
+
+    const auto add_relation = [&](const osmium::Relation& relation) {
+        for (const auto& member : relation.members()) {
+            if (member.type() == osmium::item_type::node) {
+                add_node(member.positive_ref());
+            } else if (member.type() == osmium::item_type::way) {
+                try {
+                    add_way(data.get<osmium::Way>(way_index.get(member.positive_ref())));
+                } catch (const osmium::not_found&) {
+                    // not in the database
+                }
+            }
+        }
+    };
+
+    std::size_t offset;
+    for (const auto id : changes.nodes) {
+        add_node(id);
+        if (old_nodes.get(id, offset)) {
+            tiles.add(data.get<osmium::Node>(offset).location());
+        }
+    }
+
+    for (const auto id : affected.ways) {
+        try {
+            add_way(data.get<osmium::Way>(way_index.get(id)));
+        } catch (const osmium::not_found&) {
+            // not in the database
+        }
+    }
+    for (const auto id : changes.ways) {
+        if (old_ways.get(id, offset)) {
+            add_way(data.get<osmium::Way>(offset));
+        }
+    }
+
+    for (const auto id : changes.relations) {
+        try {
+            add_relation(data.get<osmium::Relation>(relation_index.get(id)));
+        } catch (const osmium::not_found&) {
+            // not in the database
+        }
+        if (old_relations.get(id, offset)) {
+            add_relation(data.get<osmium::Relation>(offset));
+        }
+    }
+
+    mf.close();
+}
+
 int main(int argc, char* argv[]) {
     std::ios_base::sync_with_stdio(false);
 
     Options options;
     options.parse(argc, argv);
 
-    const int data_fd = ::open(options.data_file_name().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    const int data_fd = ::open(options.data_file_name().c_str(), O_WRONLY | O_APPEND);
     if (data_fd < 0) {
         std::cerr << "Can't open data file '" << options.data_file_name() << "': " << std::strerror(errno) << "\n";
         std::exit(return_code::fatal);
     }
 
-    bool dense = true; // only works for dense currently
-    std::string index_type{(dense ? "dense_file_array" : "sparse_file_array")};
+    // only one updater at a time
+    if (::flock(data_fd, LOCK_EX | LOCK_NB) != 0) {
+        std::cerr << "Database '" << options.database() << "' is locked by another update\n";
+        std::exit(return_code::fatal);
+    }
+
+    try {
+        const SnapshotManifest manifest = read_manifest(options.database(), data_fd);
+
+        const JournalRecovery recovery = recover_journal(options.database(), manifest.generation);
+
+        // remove anything appended after the last commit of an interrupted
+        // update or by an update that never got published
+        if (::ftruncate(data_fd, recovery.found ? recovery.data_size : manifest.data_size) != 0) {
+            throw std::system_error{errno, std::system_category(), "truncating data file failed"};
+        }
+
+        // replication: plan batches of the change files not applied yet
+        int64_t sequence = manifest.sequence;
+        std::vector<ChangeBatch> batches;
+        if (options.replication()) {
+            if (sequence < 0) {
+                if (!options.has_sequence()) {
+                    throw std::runtime_error{"Database has no replication sequence number, use --sequence to set the first one to apply"};
+                }
+                sequence = options.sequence() - 1;
+            }
+            const int64_t newest = read_replication_state(options.replication_directory() + "/state.txt");
+            if (newest <= sequence && !recovery.found) {
+                std::cerr << "Database is up to date (sequence " << sequence << ")\n";
+                ::close(data_fd);
+                return return_code::okay;
+            }
+            batches = plan_change_batches(options.replication_directory(), sequence + 1, newest, options.batch_size(), [&](const std::string& fn) {
+                return !recovery.completed_files.empty() && recovery.completed_files.count(change_file_identity(fn)) != 0;
+            });
+            sequence = std::max(sequence, newest);
+        }
+
+        SnapshotIndexWriter node_index{options.database(), manifest.indexes.at("nodes")};
+        SnapshotIndexWriter way_index{options.database(), manifest.indexes.at("ways")};
+        SnapshotIndexWriter relation_index{options.database(), manifest.indexes.at("relations")};
+
+        Journal journal{options.database(), manifest.generation, manifest.data_size};
+        JournaledIndex journaled_node_index{node_index, journal, 0};
+        JournaledIndex journaled_way_index{way_index, journal, 1};
+        JournaledIndex journaled_relation_index{relation_index, journal, 2};
+        JournaledIndex* indexes[3] = {&journaled_node_index, &journaled_way_index, &journaled_relation_index};
 
-    const auto& map_factory = osmium::index::MapFactory<osmium::unsigned_object_id_type, size_t>::instance();
-    std::unique_ptr<offset_index_type> node_index     = map_factory.create_map(index_type + "," + index_name(options.database(), "nodes", dense));
-    std::unique_ptr<offset_index_type> way_index      = map_factory.create_map(index_type + "," + index_name(options.database(), "ways", dense));
-    std::unique_ptr<offset_index_type> relation_index = map_factory.create_map(index_type + "," + index_name(options.database(), "relations", dense));
-    UpdatableDiskStore disk_store_handler{data_fd, *node_index, *way_index, *relation_index};
+        ObjectStatistics statistics;
 
-    for (const auto& fn : options.input_filenames()) {
-        osmium::io::Reader reader{fn};
+        const bool has_way_geometries = !snapshot_way_geometry_files(options.database(), manifest).base.empty();
+        bool has_maps = has_way_geometries;
+        for (const char* name : map_names) {
+            has_maps = has_maps || has_map(options.database(), manifest, name);
+        }
+        const bool has_metadata = file_exists(metadata_name(options.database()));
+        const bool collect_changes = has_maps || has_metadata || options.affected() || options.expire_tiles();
+        ChangedObjects changes;
+
+        if (recovery.found) {
+            std::cerr << "Recovering interrupted update: replaying " << recovery.mutations.size() << " index changes\n";
+            for (const auto& mutation : recovery.mutations) {
+                indexes[mutation.nwr]->set(mutation.id, mutation.offset);
+                statistics.add(mutation.nwr, mutation.id);
+                if (collect_changes) {
+                    changes.add(mutation.nwr, mutation.id);
+                }
+            }
+            for (const auto& file : recovery.completed_files) {
+                journal.commit(recovery.data_size, file);
+            }
+            journal.commit(recovery.data_size);
+        }
+
+        UpdatableDiskStore disk_store_handler{data_fd, journaled_node_index, journaled_way_index, journaled_relation_index};
+
+        const auto sync_data = [&]() {
+            if (::fsync(data_fd) != 0) {
+                throw std::system_error{errno, std::system_category(), "syncing data file failed"};
+            }
+        };
+
+        const auto sync_and_commit = [&](const change_file_id& completed_file) {
+            sync_data();
+            journal.commit(disk_store_handler.offset(), completed_file);
+        };
 
-        while (osmium::memory::Buffer buffer = reader.read()) {
+        // read and sort the next batch in the background while the
+        // current one is applied
+        std::future<osmium::memory::Buffer> next_batch;
+        if (!batches.empty()) {
+            next_batch = std::async(std::launch::async, read_change_batch, std::cref(batches.front()));
+        }
+        for (std::size_t i = 0; i < batches.size(); ++i) {
+            const osmium::memory::Buffer buffer{next_batch.get()};
+            if (i + 1 < batches.size()) {
+                next_batch = std::async(std::launch::async, read_change_batch, std::cref(batches[i + 1]));
+            }
+
+            std::cerr << "Applying changes " << batches[i].first << " to " << batches[i].last << "\n";
             disk_store_handler(buffer);
+            osmium::apply(buffer, statistics);
+            if (collect_changes) {
+                osmium::apply(buffer, changes);
+            }
+
+            std::vector<change_file_id> completed_files;
+            for (const auto& fn : batches[i].filenames) {
+                completed_files.push_back(change_file_identity(fn));
+            }
+            sync_data();
+            journal.commit(disk_store_handler.offset(), completed_files);
         }
 
-        reader.close();
+        for (const auto& fn : options.replication() ? std::vector<std::string>{} : options.input_filenames()) {
+            const change_file_id file_id{fn == "-" ? change_file_id{} : change_file_identity(fn)};
+            if (file_id.valid() && recovery.completed_files.count(file_id)) {
+                std::cerr << "Skipping change file '" << fn << "' (already applied before interruption)\n";
+                continue;
+            }
+
+            osmium::io::Reader reader{fn};
+
+            // group commit: sync once for the whole file, a file that was
+            // only partly applied is applied again after an interruption
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                disk_store_handler(buffer);
+                osmium::apply(buffer, statistics);
+                if (collect_changes) {
+                    osmium::apply(buffer, changes);
+                }
+            }
+
+            reader.close();
+            sync_and_commit(file_id);
+        }
+
+        // write and publish the next generation
+        SnapshotManifest next;
+        next.generation = manifest.generation + 1;
+        struct stat s;
+        if (::fstat(data_fd, &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "stat on data file failed"};
+        }
+        next.data_size = s.st_size;
+        next.sequence = sequence;
+
+        changes.sort();
+
+        // the maps and the way geometry store of the next generation, the
+        // affected objects are found through the new maps
+        next.maps = manifest.maps;
+        if (has_maps) {
+            update_maps(options.database(), manifest, next, way_index, relation_index, changes, has_way_geometries);
+        }
+
+        if (options.affected() || options.expire_tiles()) {
+            const AffectedObjects affected = find_affected_objects(options.database(), next, changes.nodes, changes.ways, changes.relations, std::max(1u, std::thread::hardware_concurrency()));
+            if (options.affected()) {
+                affected.write(options.affected_file_name());
+            }
+            if (options.expire_tiles()) {
+                ExpiredTiles tiles{options.expire_zoom()};
+                add_expired_tiles(options.database(), manifest, next.data_size, node_index, way_index, relation_index, changes, affected, tiles);
+                tiles.write(options.expire_tiles_file_name());
+            }
+        }
+
+        if (has_way_geometries) {
+            update_way_geometries(options.database(), manifest, next, node_index, way_index, changes);
+        }
+
+        next.indexes["nodes"]     = node_index.write_next("nodes", next.generation);
+        next.indexes["ways"]      = way_index.write_next("ways", next.generation);
+        next.indexes["relations"] = relation_index.write_next("relations", next.generation);
+
+        for (const auto& index : manifest.indexes) {
+            const auto& files = next.indexes.at(index.first);
+            if (index.second.base != files.base) {
+                next.retired.push_back(index.second.base);
+            }
+            if (!index.second.delta.empty()) {
+                next.retired.push_back(index.second.delta);
+            }
+        }
+
+        next.write(options.database());
+        if (has_metadata) {
+            const ObjectStatistics added{added_objects(options.database(), manifest, next.data_size, node_index, way_index, relation_index, changes)};
+            update_metadata(options.database(), next, statistics, added);
+        }
+        journal.remove();
+
+        // readers can't see the files retired in the last generation any more
+        for (const auto& name : manifest.retired) {
+            ::unlink((options.database() + "/" + name).c_str());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
     }
 
+    ::close(data_fd);
+
     return return_code::okay;
 }
-
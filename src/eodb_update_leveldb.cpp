@@ -0,0 +1,359 @@
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+// c++
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include <leveldb/write_batch.h>
+
+// boost
+#include <boost/program_options.hpp>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/io/any_input.hpp>
+#include <osmium/io/detail/read_write.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/visitor.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "leveldb_map.hpp"
+#include "options.hpp"
+
+class Options : public OptionsBase {
+
+public:
+
+    void parse(int argc, char* argv[]) {
+        try {
+            namespace po = boost::program_options;
+
+            po::options_description cmdline{"Allowed options"};
+            cmdline.add_options()
+                ("help,h", "Print this help message")
+                ("version", "Show version")
+                ("database,d", po::value<std::string>()->default_value(DEFAULT_EODB_NAME), "Database directory")
+            ;
+
+            po::options_description hidden{"Hidden options"};
+            hidden.add_options()
+                ("input-filenames", po::value<std::vector<std::string>>(), "Input files")
+            ;
+
+            po::options_description desc;
+            desc.add(cmdline).add(hidden);
+
+            po::positional_options_description positional;
+            positional.add("input-filenames", -1);
+
+            po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+            po::notify(vm);
+
+            check_version_option("eodb_update_leveldb");
+
+            if (vm.count("help")) {
+                std::cout << "Usage: eodb_update_leveldb [OPTIONS] OSM-CHANGE-FILE...\n";
+                std::cout << "Update database created with 'eodb_create_leveldb -L' from OSM change files.\n\n";
+                std::cout << cmdline << "\n";
+                std::exit(return_code::okay);
+            }
+
+        } catch (const boost::program_options::error& e) {
+            std::cerr << "Error parsing command line: " << e.what() << '\n';
+            std::exit(return_code::fatal);
+        }
+    }
+
+}; // class Options
+
+/**
+ * Reads objects from the data file by offset.
+ */
+class DataFileReader {
+
+    int m_fd;
+    std::vector<uint64_t> m_buffer; // uint64_t for alignment
+
+    void read(std::size_t offset, std::size_t size) {
+        m_buffer.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+        auto data = reinterpret_cast<char*>(m_buffer.data());
+        while (size > 0) {
+            const auto length = ::pread(m_fd, data, size, offset);
+            if (length < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Read from data file failed"};
+            }
+            if (length == 0) {
+                throw std::runtime_error{"Offset " + std::to_string(offset) + " is beyond end of data file"};
+            }
+            data += length;
+            size -= length;
+            offset += length;
+        }
+    }
+
+public:
+
+    explicit DataFileReader(int fd) :
+        m_fd(fd) {
+    }
+
+    /// The object is valid until the next call.
+    const osmium::OSMObject& get(std::size_t offset) {
+        read(offset, sizeof(osmium::memory::Item));
+        read(offset, reinterpret_cast<const osmium::memory::Item*>(m_buffer.data())->byte_size());
+        return *reinterpret_cast<const osmium::OSMObject*>(m_buffer.data());
+    }
+
+}; // class DataFileReader
+
+/**
+ * A LevelDB map or offset index together with the changes for the
+ * current buffer.
+ */
+struct UpdatableLevelDBMap {
+
+    LevelDBMap map;
+    leveldb::WriteBatch batch;
+
+    // offsets set in the current batch (not yet visible in the map)
+    std::unordered_map<osmium::unsigned_object_id_type, std::size_t> pending;
+
+    explicit UpdatableLevelDBMap(const std::string& filename) :
+        map(filename) {
+    }
+
+    void write() {
+        map.write(batch);
+        batch.Clear();
+        pending.clear();
+    }
+
+}; // struct UpdatableLevelDBMap
+
+/**
+ * Appends changed objects to the data file and updates the LevelDB offset
+ * indexes and maps: The old memberships of changed ways and relations are
+ * deleted and the new ones inserted. All changes from one buffer are
+ * written into each LevelDB database as one batch.
+ */
+class LevelDBUpdater : public osmium::handler::Handler {
+
+    int m_data_fd;
+    std::size_t m_offset = 0;
+    DataFileReader m_data;
+
+    UpdatableLevelDBMap m_nodes;
+    UpdatableLevelDBMap m_ways;
+    UpdatableLevelDBMap m_relations;
+    UpdatableLevelDBMap m_node2way;
+    UpdatableLevelDBMap m_node2relation;
+    UpdatableLevelDBMap m_way2relation;
+    UpdatableLevelDBMap m_relation2relation;
+
+    /**
+     * Set the offset of object id to the current offset. Returns false
+     * if there was no old version, otherwise returns its offset in
+     * old_offset.
+     */
+    bool update_offset(UpdatableLevelDBMap& index, osmium::unsigned_object_id_type id, std::size_t& old_offset) {
+        bool found = false;
+
+        const auto it = index.pending.find(id);
+        if (it != index.pending.end()) {
+            old_offset = it->second;
+            LevelDBMap::remove(index.batch, id, old_offset);
+            found = true;
+        } else {
+            index.map.for_each_value(id, [&](osmium::unsigned_object_id_type offset) {
+                LevelDBMap::remove(index.batch, id, offset);
+                old_offset = offset;
+                found = true;
+            });
+        }
+
+        LevelDBMap::put(index.batch, id, m_offset);
+        index.pending[id] = m_offset;
+
+        return found;
+    }
+
+    UpdatableLevelDBMap* member_map(osmium::item_type type) noexcept {
+        switch (type) {
+            case osmium::item_type::node:
+                return &m_node2relation;
+            case osmium::item_type::way:
+                return &m_way2relation;
+            case osmium::item_type::relation:
+                return &m_relation2relation;
+            default:
+                break;
+        }
+        return nullptr;
+    }
+
+public:
+
+    LevelDBUpdater(const std::string& database, int data_fd) :
+        m_data_fd(data_fd),
+        m_data(data_fd),
+        m_nodes(leveldb_map_name(database, "nodes")),
+        m_ways(leveldb_map_name(database, "ways")),
+        m_relations(leveldb_map_name(database, "relations")),
+        m_node2way(leveldb_map_name(database, "node2way")),
+        m_node2relation(leveldb_map_name(database, "node2relation")),
+        m_way2relation(leveldb_map_name(database, "way2relation")),
+        m_relation2relation(leveldb_map_name(database, "relation2relation")) {
+        struct stat s;
+        if (::fstat(m_data_fd, &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "stat on data file failed"};
+        }
+        m_offset = s.st_size;
+    }
+
+    void node(const osmium::Node& node) {
+        std::size_t old_offset;
+        update_offset(m_nodes, node.positive_id(), old_offset);
+        m_offset += node.byte_size();
+    }
+
+    void way(const osmium::Way& way) {
+        const auto id = way.positive_id();
+        std::size_t old_offset;
+        if (update_offset(m_ways, id, old_offset)) {
+            const auto& old_way = static_cast<const osmium::Way&>(m_data.get(old_offset));
+            for (const auto& node_ref : old_way.nodes()) {
+                LevelDBMap::remove(m_node2way.batch, node_ref.positive_ref(), id);
+            }
+        }
+        if (way.visible()) {
+            for (const auto& node_ref : way.nodes()) {
+                LevelDBMap::put(m_node2way.batch, node_ref.positive_ref(), id);
+            }
+        }
+        m_offset += way.byte_size();
+    }
+
+    void relation(const osmium::Relation& relation) {
+        const auto id = relation.positive_id();
+        std::size_t old_offset;
+        if (update_offset(m_relations, id, old_offset)) {
+            const auto& old_relation = static_cast<const osmium::Relation&>(m_data.get(old_offset));
+            for (const auto& member : old_relation.members()) {
+                if (auto map = member_map(member.type())) {
+                    LevelDBMap::remove(map->batch, member.positive_ref(), id);
+                }
+            }
+        }
+        if (relation.visible()) {
+            for (const auto& member : relation.members()) {
+                if (auto map = member_map(member.type())) {
+                    LevelDBMap::put(map->batch, member.positive_ref(), id);
+                }
+            }
+        }
+        m_offset += relation.byte_size();
+    }
+
+    void operator()(const osmium::memory::Buffer& buffer) {
+        // the objects have to be in the data file before they are read
+        // back as old versions of objects later in the same buffer
+        osmium::io::detail::reliable_write(m_data_fd, buffer.data(), buffer.committed());
+
+        osmium::apply(buffer.begin(), buffer.end(), *this);
+
+        // maps first, so that the indexes never point to objects whose
+        // memberships are not in the maps
+        m_node2way.write();
+        m_node2relation.write();
+        m_way2relation.write();
+        m_relation2relation.write();
+        m_nodes.write();
+        m_ways.write();
+        m_relations.write();
+    }
+
+}; // class LevelDBUpdater
+
+int main(int argc, char* argv[]) {
+    std::ios_base::sync_with_stdio(false);
+
+    Options options;
+    options.parse(argc, argv);
+
+    if (!file_exists(leveldb_map_name(options.database(), "nodes"))) {
+        std::cerr << "Database '" << options.database() << "' has no LevelDB indexes (create it with 'eodb_create_leveldb -L')\n";
+        std::exit(return_code::fatal);
+    }
+
+    const int data_fd = ::open(options.data_file_name().c_str(), O_RDWR | O_APPEND);
+    if (data_fd < 0) {
+        std::cerr << "Can't open data file '" << options.data_file_name() << "': " << std::strerror(errno) << "\n";
+        std::exit(return_code::fatal);
+    }
+
+    // only one updater at a time
+    if (::flock(data_fd, LOCK_EX | LOCK_NB) != 0) {
+        std::cerr << "Database '" << options.database() << "' is locked by another update\n";
+        std::exit(return_code::fatal);
+    }
+
+    try {
+        LevelDBUpdater updater{options.database(), data_fd};
+
+        for (const auto& fn : options.input_filenames()) {
+            osmium::io::Reader reader{fn};
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                updater(buffer);
+            }
+            reader.close();
+        }
+
+        if (::fsync(data_fd) != 0) {
+            throw std::system_error{errno, std::system_category(), "syncing data file failed"};
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
+    }
+
+    ::close(data_fd);
+
+    return return_code::okay;
+}
+
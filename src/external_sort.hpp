@@ -0,0 +1,207 @@
+#ifndef EXTERNAL_SORT_HPP
+#define EXTERNAL_SORT_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/object_comparisons.hpp>
+
+// eodb
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/// Memory range with OSM objects one after the other.
+using object_range = std::pair<const unsigned char*, const unsigned char*>;
+
+/**
+ * K-way merge of ranges of OSM objects each sorted by type, ID, and
+ * version. Calls func(object) for all objects in order. Of identical
+ * versions, the one from the earlier range comes first. The objects are
+ * not copied.
+ */
+template <typename TFunc>
+void merge_sorted_objects(std::vector<object_range> ranges, TFunc&& func) {
+    const auto object = [&ranges](std::size_t i) -> const osmium::OSMObject& {
+        return *reinterpret_cast<const osmium::OSMObject*>(ranges[i].first);
+    };
+
+    // heap of range indexes, smallest object (and earliest range) on top
+    const auto greater = [&object](std::size_t a, std::size_t b) {
+        const osmium::object_order_type_id_version less;
+        if (less(object(b), object(a))) {
+            return true;
+        }
+        if (less(object(a), object(b))) {
+            return false;
+        }
+        return a > b;
+    };
+    std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(greater)> queue{greater};
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        if (ranges[i].first < ranges[i].second) {
+            queue.push(i);
+        }
+    }
+
+    while (!queue.empty()) {
+        const std::size_t i = queue.top();
+        queue.pop();
+
+        const auto& current = object(i);
+        ranges[i].first += current.byte_size();
+        func(current);
+
+        if (ranges[i].first < ranges[i].second) {
+            queue.push(i);
+        }
+    }
+}
+
+/**
+ * Sorts OSM objects by type, ID, and version using a bounded amount of
+ * memory.
+ *
+ * Buffers are collected until they use more than the memory limit. Then
+ * the objects in them are sorted and written into a temporary run file.
+ * At the end the run files are memory mapped and merged into the output.
+ * If all the data fits into memory, no run files are written.
+ */
+class ExternalSorter {
+
+    std::string m_tmp_prefix;
+    std::size_t m_memory_limit;
+
+    std::vector<osmium::memory::Buffer> m_buffers;
+    std::size_t m_memory = 0;
+
+    std::vector<std::string> m_runs;
+
+    std::vector<const osmium::OSMObject*> sorted_objects() {
+        std::vector<const osmium::OSMObject*> objects;
+        for (auto& buffer : m_buffers) {
+            for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+                objects.push_back(&*it);
+            }
+        }
+
+        // stable, so that the input order is kept for identical versions
+        std::stable_sort(objects.begin(), objects.end(), osmium::object_order_type_id_version{});
+
+        return objects;
+    }
+
+    void write_sorted(OutputFile& out) {
+        for (const auto* object : sorted_objects()) {
+            out.write(object->data(), object->byte_size());
+        }
+        m_buffers.clear();
+        m_memory = 0;
+    }
+
+    void spill() {
+        const std::string filename{m_tmp_prefix + std::to_string(m_runs.size())};
+        m_runs.push_back(filename);
+
+        OutputFile run{filename};
+        write_sorted(run);
+        run.close();
+    }
+
+    void merge(OutputFile& out) {
+        std::vector<std::unique_ptr<MappedFile>> files;
+        std::vector<object_range> ranges;
+        for (const auto& filename : m_runs) {
+            files.emplace_back(new MappedFile{filename});
+            ranges.emplace_back(files.back()->data(), files.back()->data() + files.back()->size());
+        }
+
+        merge_sorted_objects(ranges, [&out](const osmium::OSMObject& object) {
+            out.write(object.data(), object.byte_size());
+        });
+
+        for (auto& file : files) {
+            file->close();
+        }
+    }
+
+public:
+
+    /**
+     * Run files are called tmp_prefix followed by a number.
+     */
+    ExternalSorter(const std::string& tmp_prefix, std::size_t memory_limit) :
+        m_tmp_prefix(tmp_prefix),
+        m_memory_limit(memory_limit) {
+    }
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    ~ExternalSorter() noexcept {
+        for (const auto& filename : m_runs) {
+            std::remove(filename.c_str());
+        }
+    }
+
+    void add(osmium::memory::Buffer&& buffer) {
+        m_memory += buffer.capacity();
+        m_buffers.push_back(std::move(buffer));
+        if (m_memory >= m_memory_limit) {
+            spill();
+        }
+    }
+
+    /// Number of run files written so far.
+    std::size_t num_runs() const noexcept {
+        return m_runs.size();
+    }
+
+    /**
+     * Write all objects sorted into the output file.
+     */
+    void write(OutputFile& out) {
+        if (m_runs.empty()) {
+            write_sorted(out);
+            return;
+        }
+
+        if (!m_buffers.empty()) {
+            spill();
+        }
+        merge(out);
+    }
+
+}; // class ExternalSorter
+
+#endif // EXTERNAL_SORT_HPP
@@ -0,0 +1,207 @@
+#ifndef EYTZINGER_INDEX_HPP
+#define EYTZINGER_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <fcntl.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+// osmium
+#include <osmium/osm/types.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+// eodb
+#include "mapped_file.hpp"
+
+/*
+ * Sparse index in Eytzinger (BFS) order: The element at position k (1-based)
+ * has its children at 2k and 2k+1. The first levels of the implicit tree
+ * are at the beginning of the file, so they stay in the CPU cache and in
+ * the page cache, and the search can prefetch the next levels.
+ *
+ * Only indexes with unique IDs can be stored in this layout, not maps.
+ * Duplicate IDs in the sorted input are removed when it is written.
+ */
+
+/**
+ * Rewrite a sorted sparse index file (pairs of ID and value) into
+ * Eytzinger order. If an ID is in the file several times, the last value
+ * wins. The output file is written through a memory mapping, so the index
+ * is never copied into memory as a whole.
+ */
+template <typename TValue>
+void write_eytzinger_index(const std::string& sorted_filename, const std::string& filename) {
+    typedef std::pair<osmium::unsigned_object_id_type, TValue> element_type;
+
+    MappedFile mf{sorted_filename};
+    const element_type* sorted = reinterpret_cast<const element_type*>(mf.data());
+    const std::size_t num_sorted = mf.size() / sizeof(element_type);
+
+    std::size_t n = 0; // number of unique IDs
+    for (std::size_t i = 0; i < num_sorted; ++i) {
+        if (i + 1 < num_sorted && sorted[i + 1].first < sorted[i].first) {
+            throw std::runtime_error{"index must be sorted for eytzinger layout"};
+        }
+        if (i + 1 == num_sorted || sorted[i].first != sorted[i + 1].first) {
+            ++n;
+        }
+    }
+
+    const int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(), "Opening output file '" + filename + "' failed"};
+    }
+
+    if (n > 0) {
+        osmium::util::resize_file(fd, n * sizeof(element_type));
+        osmium::util::MemoryMapping mapping{n * sizeof(element_type), osmium::util::MemoryMapping::mapping_mode::write_shared, fd};
+        element_type* out = mapping.get_addr<element_type>();
+
+        // the last element of each run of equal IDs
+        std::size_t i = 0;
+        const auto next_element = [&]() {
+            while (i + 1 < num_sorted && sorted[i].first == sorted[i + 1].first) {
+                ++i;
+            }
+            return sorted[i++];
+        };
+
+        // iterative in-order traversal of the implicit tree
+        std::size_t k = 1;
+        while (2 * k <= n) {
+            k *= 2;
+        }
+        while (k != 0) {
+            out[k - 1] = next_element();
+            if (2 * k + 1 <= n) {
+                k = 2 * k + 1;
+                while (2 * k <= n) {
+                    k *= 2;
+                }
+            } else {
+                while (k & 1) {
+                    k >>= 1;
+                }
+                k >>= 1;
+            }
+        }
+
+        mapping.unmap();
+    }
+
+    if (::close(fd) != 0) {
+        throw std::system_error{errno, std::system_category(), "Closing output file '" + filename + "' failed"};
+    }
+
+    mf.close();
+}
+
+template <typename TValue>
+class EytzingerIndex {
+
+public:
+
+    typedef std::pair<osmium::unsigned_object_id_type, TValue> element_type;
+
+private:
+
+    std::unique_ptr<MappedFile> m_file;
+    const element_type* m_data;
+    std::size_t m_size;
+
+    std::size_t first_in_order() const noexcept {
+        std::size_t k = 1;
+        while (2 * k <= m_size) {
+            k *= 2;
+        }
+        return m_size == 0 ? 0 : k;
+    }
+
+    std::size_t next_in_order(std::size_t k) const noexcept {
+        if (2 * k + 1 <= m_size) {
+            k = 2 * k + 1;
+            while (2 * k <= m_size) {
+                k *= 2;
+            }
+            return k;
+        }
+        while (k & 1) {
+            k >>= 1;
+        }
+        return k >> 1;
+    }
+
+public:
+
+    explicit EytzingerIndex(const std::string& filename) :
+        m_file(new MappedFile{filename}),
+        m_data(reinterpret_cast<const element_type*>(m_file->data())),
+        m_size(m_file->size() / sizeof(element_type)) {
+    }
+
+    std::size_t size() const noexcept {
+        return m_size;
+    }
+
+    /**
+     * Find the element with the given ID. Returns nullptr if there is
+     * none.
+     */
+    const element_type* find(osmium::unsigned_object_id_type id) const noexcept {
+        std::size_t k = 1;
+        while (k <= m_size) {
+            // the 16 descendants four levels down are next to each other
+            __builtin_prefetch(m_data + std::min(16 * k, m_size) - 1);
+            k = 2 * k + (m_data[k - 1].first < id);
+        }
+        // remove the trailing "right" turns plus the last "left" turn
+        k >>= __builtin_ffsll(~k);
+
+        if (k == 0 || m_data[k - 1].first != id) {
+            return nullptr;
+        }
+        return m_data + k - 1;
+    }
+
+    /**
+     * Call func(element) for all elements in ID order.
+     */
+    template <typename TFunc>
+    void for_each(TFunc&& func) const {
+        for (std::size_t k = first_in_order(); k != 0; k = next_in_order(k)) {
+            func(m_data[k - 1]);
+        }
+    }
+
+}; // class EytzingerIndex
+
+#endif // EYTZINGER_INDEX_HPP
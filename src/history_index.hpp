@@ -0,0 +1,198 @@
+#ifndef HISTORY_INDEX_HPP
+#define HISTORY_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * History index: For databases created from full-history files all
+ * versions of all objects are in the data file. The normal indexes only
+ * point to the last version of each object. The history index files
+ * (nodes.history.idx etc.) contain one entry for each version of each
+ * object, sorted by ID and version, so all versions of an object form a
+ * run of entries that can be binary searched by timestamp.
+ */
+
+struct HistoryEntry {
+
+    static constexpr const uint32_t deleted_flag = 0x80000000;
+
+    uint64_t id;
+    uint64_t offset;
+    uint32_t version_and_flag;
+    uint32_t timestamp;
+
+    uint32_t version() const noexcept {
+        return version_and_flag & ~deleted_flag;
+    }
+
+    bool visible() const noexcept {
+        return (version_and_flag & deleted_flag) == 0;
+    }
+
+}; // struct HistoryEntry
+
+inline std::string history_name(const std::string& database, const std::string& index) {
+    return database + "/" + index + ".history.idx";
+}
+
+/**
+ * Handler collecting the history index entries. Must see the objects in
+ * the same order as the DiskStore so that the offsets match.
+ */
+class HistoryIndexBuilder : public osmium::handler::Handler {
+
+    std::vector<HistoryEntry> m_entries[3];
+    uint64_t m_offset = 0;
+
+    void add(const osmium::OSMObject& object) {
+        uint32_t version = object.version();
+        if (!object.visible()) {
+            version |= HistoryEntry::deleted_flag;
+        }
+        m_entries[osmium::item_type_to_nwr_index(object.type())].push_back(HistoryEntry{
+            object.positive_id(),
+            m_offset,
+            version,
+            uint32_t(object.timestamp().seconds_since_epoch())
+        });
+        m_offset += object.byte_size();
+    }
+
+public:
+
+    void node(const osmium::Node& node) {
+        add(node);
+    }
+
+    void way(const osmium::Way& way) {
+        add(way);
+    }
+
+    void relation(const osmium::Relation& relation) {
+        add(relation);
+    }
+
+    void write(const std::string& database) {
+        const char* index_names[3] = {"nodes", "ways", "relations"};
+        for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+            auto& entries = m_entries[nwr];
+            std::stable_sort(entries.begin(), entries.end(), [](const HistoryEntry& lhs, const HistoryEntry& rhs) {
+                if (lhs.id != rhs.id) {
+                    return lhs.id < rhs.id;
+                }
+                return lhs.version() < rhs.version();
+            });
+
+            OutputFile file{history_name(database, index_names[nwr])};
+            file.write(entries.data(), entries.size() * sizeof(HistoryEntry));
+            file.close();
+
+            std::vector<HistoryEntry>{}.swap(entries);
+        }
+    }
+
+}; // class HistoryIndexBuilder
+
+class HistoryIndex {
+
+    std::unique_ptr<MappedFile> m_file;
+    const HistoryEntry* m_begin;
+    const HistoryEntry* m_end;
+
+public:
+
+    explicit HistoryIndex(const std::string& filename) :
+        m_file(new MappedFile{filename}),
+        m_begin(reinterpret_cast<const HistoryEntry*>(m_file->data())),
+        m_end(m_begin + m_file->size() / sizeof(HistoryEntry)) {
+    }
+
+    std::size_t size() const noexcept {
+        return std::size_t(m_end - m_begin);
+    }
+
+    /**
+     * Find the version of the object with this ID that was current at
+     * the given time. Returns nullptr if the object didn't exist yet.
+     * The result might be a deleted version, check visible().
+     */
+    const HistoryEntry* find(osmium::unsigned_object_id_type id, uint32_t timestamp) const noexcept {
+        const auto first = std::lower_bound(m_begin, m_end, id, [](const HistoryEntry& entry, osmium::unsigned_object_id_type value) {
+            return entry.id < value;
+        });
+        const auto last = std::upper_bound(first, m_end, id, [](osmium::unsigned_object_id_type value, const HistoryEntry& entry) {
+            return value < entry.id;
+        });
+        const auto it = std::upper_bound(first, last, timestamp, [](uint32_t value, const HistoryEntry& entry) {
+            return value < entry.timestamp;
+        });
+        return it == first ? nullptr : it - 1;
+    }
+
+    /**
+     * Call func(entry) for the version of each object that was current
+     * at the given time, in ID order. Deleted versions are skipped.
+     */
+    template <typename TFunc>
+    void for_each_as_of(uint32_t timestamp, TFunc&& func) const {
+        const HistoryEntry* current = nullptr;
+        for (auto it = m_begin; it != m_end; ++it) {
+            if (current && current->id != it->id) {
+                if (current->visible()) {
+                    func(*current);
+                }
+                current = nullptr;
+            }
+            if (it->timestamp <= timestamp) {
+                current = it;
+            }
+        }
+        if (current && current->visible()) {
+            func(*current);
+        }
+    }
+
+}; // class HistoryIndex
+
+#endif // HISTORY_INDEX_HPP
@@ -0,0 +1,65 @@
+#ifndef INDEX_FILES_HPP
+#define INDEX_FILES_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "output_file.hpp"
+
+/**
+ * Sort elements by ID and write them to a file in the same format
+ * osmium::index::map::SparseFileArray uses, so the file can be read
+ * with the normal sparse index code.
+ *
+ * If there are several elements with the same ID, only the one added
+ * last is kept (that's what happens in the Osmium index maps when
+ * set() is called several times for the same ID).
+ */
+template <typename TValue>
+void write_sparse_list(const std::string& filename, std::vector<std::pair<osmium::unsigned_object_id_type, TValue>>& elements) {
+    typedef std::pair<osmium::unsigned_object_id_type, TValue> element_type;
+
+    std::stable_sort(elements.begin(), elements.end(), [](const element_type& lhs, const element_type& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    OutputFile file{filename};
+    for (auto it = elements.begin(); it != elements.end(); ++it) {
+        const auto next = std::next(it);
+        if (next == elements.end() || next->first != it->first) {
+            file.write_value(*it);
+        }
+    }
+    file.close();
+}
+
+#endif // INDEX_FILES_HPP
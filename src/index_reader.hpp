@@ -0,0 +1,200 @@
+#ifndef INDEX_READER_HPP
+#define INDEX_READER_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+
+// osmium
+#include <osmium/index/index.hpp>
+#include <osmium/index/map/dense_file_array.hpp>
+#include <osmium/index/map/sparse_file_array.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "eytzinger_index.hpp"
+#include "learned_index.hpp"
+#include "membership_filter.hpp"
+#include "packed_index.hpp"
+#include "paged_index.hpp"
+#include "snapshot.hpp"
+
+/**
+ * Read access to an index in the database. Finds out whether the index
+ * is sparse, dense, packed, or in eytzinger or paged layout. Updated
+ * indexes are read from the snapshot given by the manifest.
+ */
+template <typename TValue>
+class IndexReader {
+
+public:
+
+    typedef osmium::index::map::DenseFileArray<osmium::unsigned_object_id_type, TValue> dense_index_type;
+    typedef osmium::index::map::SparseFileArray<osmium::unsigned_object_id_type, TValue> sparse_index_type;
+    typedef typename sparse_index_type::element_type element_type;
+
+private:
+
+    int m_fd = -1;
+    std::unique_ptr<osmium::index::map::Map<osmium::unsigned_object_id_type, TValue>> m_dense;
+    std::unique_ptr<sparse_index_type> m_sparse;
+    std::unique_ptr<EytzingerIndex<TValue>> m_eytzinger;
+    std::unique_ptr<PagedIndex<TValue>> m_paged;
+    std::unique_ptr<SnapshotIndex> m_snapshot;
+    std::unique_ptr<MembershipFilter> m_filter;
+    std::unique_ptr<LearnedIndex> m_model;
+
+public:
+
+    IndexReader(const std::string& database, const std::string& name, const SnapshotManifest& manifest) {
+        m_snapshot = open_snapshot_index(database, manifest, name);
+        if (m_snapshot) {
+            return;
+        }
+
+        std::string filename{index_name(database, name, false)};
+        m_fd = ::open(filename.c_str(), O_RDWR);
+        if (m_fd != -1) {
+            m_sparse.reset(new sparse_index_type{m_fd});
+            m_filter = open_membership_filter(filename);
+            m_model = open_learned_index(filename);
+            if (m_model && m_model->num_elements() != m_sparse->size()) {
+                m_model.reset(); // outdated, ignore
+            }
+            return;
+        }
+
+        filename = index_name(database, name, index_format::eytzinger);
+        if (file_exists(filename)) {
+            m_eytzinger.reset(new EytzingerIndex<TValue>{filename});
+            m_filter = open_membership_filter(filename);
+            return;
+        }
+
+        filename = index_name(database, name, true);
+        m_fd = ::open(filename.c_str(), O_RDWR);
+        if (m_fd != -1) {
+            m_dense.reset(new dense_index_type{m_fd});
+            return;
+        }
+
+        filename = index_name(database, name, index_format::packed40);
+        m_fd = ::open(filename.c_str(), O_RDWR);
+        if (m_fd != -1) {
+            m_dense.reset(new Packed40DenseFileArray<osmium::unsigned_object_id_type, TValue>{m_fd});
+            return;
+        }
+
+        filename = index_name(database, name, index_format::packed32);
+        m_fd = ::open(filename.c_str(), O_RDWR);
+        if (m_fd != -1) {
+            m_dense.reset(new Packed32DenseFileArray<osmium::unsigned_object_id_type, TValue>{m_fd});
+            return;
+        }
+
+        filename = index_name(database, name, index_format::paged);
+        if (file_exists(filename)) {
+            m_paged.reset(new PagedIndex<TValue>{filename});
+            return;
+        }
+
+        throw std::system_error{errno, std::system_category(),
+            std::string{"Can't open "} + name + " index file"};
+    }
+
+    IndexReader(const IndexReader&) = delete;
+    IndexReader& operator=(const IndexReader&) = delete;
+
+    ~IndexReader() noexcept {
+        m_dense.reset();
+        m_sparse.reset();
+        ::close(m_fd);
+    }
+
+    bool dense() const noexcept {
+        return m_dense || m_paged || m_snapshot;
+    }
+
+    /**
+     * Look up the id. Returns false if it is not in the index.
+     */
+    bool get(osmium::unsigned_object_id_type id, TValue& value) const {
+        if (m_dense) {
+            try {
+                value = m_dense->get(id);
+            } catch (const osmium::not_found&) {
+                return false;
+            }
+            return true;
+        }
+
+        if (m_paged) {
+            return m_paged->get(id, value);
+        }
+
+        if (m_snapshot) {
+            return m_snapshot->get(id, value);
+        }
+
+        if (m_filter && !m_filter->may_contain(id)) {
+            return false;
+        }
+
+        if (m_eytzinger) {
+            const auto* element = m_eytzinger->find(id);
+            if (!element) {
+                return false;
+            }
+            value = element->second;
+            return true;
+        }
+
+        auto first = m_sparse->cbegin();
+        auto last = m_sparse->cend();
+        if (m_model) {
+            const auto range = m_model->search_range(id);
+            last = first + range.second;
+            first += range.first;
+        }
+
+        const element_type elem{id, TValue{}};
+        const auto it = std::lower_bound(first, last, elem, [](const element_type& lhs, const element_type& rhs) {
+            return lhs.first < rhs.first;
+        });
+        if (it == last || it->first != id) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+}; // class IndexReader
+
+#endif // INDEX_READER_HPP
@@ -0,0 +1,326 @@
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// boost
+#include <boost/crc.hpp>
+
+// osmium
+#include <osmium/index/map.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Write-ahead journal for eodb_update. The journal records the generation
+ * and data file size the update started from, all index changes, and
+ * commit records with the size of the data file after all changes before
+ * it. Commits are only written after data.osr has been synced and the
+ * journal is synced after each commit, so everything up to the last valid
+ * commit record is on disk.
+ *
+ * Data file and index changes are synced in groups (at the end of each
+ * change file or batch of replication change files), not for each buffer.
+ *
+ * After a crash the next eodb_update truncates the data file to the size
+ * in the last commit that completed a change file (rollback of everything
+ * after it) and replays the index changes up to this commit (which are not
+ * in any published generation). Change files that have been completely
+ * committed are skipped, all others are applied again from the start, so
+ * their objects are never added twice.
+ */
+
+namespace detail {
+
+    enum journal_record_type : uint32_t {
+        journal_begin    = 1, // a: generation, b: data size
+        journal_mutation = 2, // a: nwr index, b: id, c: offset
+        journal_commit   = 3  // a: data size, b: checksum of completed change file (or 0), c: its size
+    };
+
+    struct journal_record {
+        uint32_t type;
+        uint32_t checksum;
+        uint64_t a;
+        uint64_t b;
+        uint64_t c;
+    };
+
+    inline uint32_t journal_checksum(journal_record record) noexcept {
+        record.checksum = 0;
+        boost::crc_32_type crc;
+        crc.process_bytes(&record, sizeof(record));
+        return crc.checksum();
+    }
+
+} // namespace detail
+
+inline std::string journal_name(const std::string& database) {
+    return database + "/journal";
+}
+
+/**
+ * Identifies a change file in commit records by its contents, so a
+ * different file later put at the same path is not mistaken for a
+ * completed one, and the same file under another path is recognized.
+ */
+struct change_file_id {
+
+    uint64_t size = 0;
+    uint32_t checksum = 0; // CRC32 of the contents, 0 means no file
+
+    bool valid() const noexcept {
+        return checksum != 0;
+    }
+
+    bool operator<(const change_file_id& other) const noexcept {
+        return size < other.size || (size == other.size && checksum < other.checksum);
+    }
+
+}; // struct change_file_id
+
+inline change_file_id change_file_identity(const std::string& filename) {
+    std::ifstream in{filename, std::ios::binary};
+    if (!in) {
+        throw std::system_error{errno, std::system_category(), "Reading change file '" + filename + "' failed"};
+    }
+
+    change_file_id id;
+    boost::crc_32_type crc;
+    std::vector<char> buffer(1024 * 1024);
+    while (in) {
+        in.read(buffer.data(), buffer.size());
+        crc.process_bytes(buffer.data(), std::size_t(in.gcount()));
+        id.size += uint64_t(in.gcount());
+    }
+    id.checksum = crc.checksum() | 1; // never 0
+
+    return id;
+}
+
+/**
+ * What was found in the journal of an interrupted update.
+ */
+struct JournalRecovery {
+
+    struct mutation {
+        unsigned int nwr;
+        osmium::unsigned_object_id_type id;
+        std::size_t offset;
+    };
+
+    bool found = false;
+    uint64_t data_size = 0;
+    std::vector<mutation> mutations;
+    std::set<change_file_id> completed_files;
+
+}; // struct JournalRecovery
+
+/**
+ * Read the journal and return all committed changes. The journal is only
+ * used if it was started from the given generation, otherwise it belongs
+ * to an update that was already published.
+ */
+inline JournalRecovery recover_journal(const std::string& database, uint64_t generation) {
+    JournalRecovery recovery;
+    const std::string filename{journal_name(database)};
+    if (!file_exists(filename)) {
+        return recovery;
+    }
+
+    MappedFile mf{filename};
+    const auto* records = reinterpret_cast<const detail::journal_record*>(mf.data());
+    const std::size_t count = mf.size() / sizeof(detail::journal_record);
+
+    if (count == 0 ||
+        records[0].type != detail::journal_begin ||
+        records[0].checksum != detail::journal_checksum(records[0]) ||
+        records[0].a != generation) {
+        return recovery;
+    }
+
+    recovery.found = true;
+    recovery.data_size = records[0].b;
+
+    std::size_t pending = 0;
+    std::vector<JournalRecovery::mutation> mutations;
+    for (std::size_t i = 1; i < count; ++i) {
+        const auto& record = records[i];
+        if (record.checksum != detail::journal_checksum(record)) {
+            break; // torn write, ignore everything from here
+        }
+        if (record.type == detail::journal_mutation) {
+            mutations.push_back(JournalRecovery::mutation{unsigned(record.a), record.b, std::size_t(record.c)});
+        } else if (record.type == detail::journal_commit) {
+            // only commits completing a change file are recovery points
+            if (record.b != 0) {
+                change_file_id id;
+                id.size = record.c;
+                id.checksum = uint32_t(record.b);
+                recovery.completed_files.insert(id);
+                recovery.data_size = record.a;
+                pending = mutations.size();
+            }
+        } else {
+            break;
+        }
+    }
+    mutations.resize(pending); // rollback of uncommitted changes
+    recovery.mutations = std::move(mutations);
+
+    mf.close();
+    return recovery;
+}
+
+class Journal {
+
+    std::string m_database;
+    std::unique_ptr<OutputFile> m_file;
+    bool m_in_place = false;
+
+    void write(detail::journal_record record) {
+        record.checksum = detail::journal_checksum(record);
+        m_file->write_value(record);
+    }
+
+    void sync() {
+        m_file->sync();
+
+        // the new journal replaces the old one at the first commit
+        if (!m_in_place) {
+            if (std::rename(m_file->filename().c_str(), journal_name(m_database).c_str()) != 0) {
+                throw std::system_error{errno, std::system_category(), "Renaming journal failed"};
+            }
+            m_in_place = true;
+        }
+    }
+
+public:
+
+    /**
+     * Start a new journal for an update from this generation and data
+     * file size. Replaces any old journal.
+     */
+    Journal(const std::string& database, uint64_t generation, uint64_t data_size) :
+        m_database(database),
+        m_file(new OutputFile{journal_name(database) + ".tmp"}) {
+        write(detail::journal_record{detail::journal_begin, 0, generation, data_size, 0});
+    }
+
+    void add_mutation(unsigned int nwr, osmium::unsigned_object_id_type id, std::size_t offset) {
+        write(detail::journal_record{detail::journal_mutation, 0, nwr, id, offset});
+    }
+
+    /**
+     * Commit everything so far. The data file must have been synced up to
+     * data_size before this is called.
+     */
+    void commit(uint64_t data_size, const change_file_id& completed_file = change_file_id{}) {
+        write(detail::journal_record{detail::journal_commit, 0, data_size, completed_file.checksum, completed_file.size});
+        sync();
+    }
+
+    /**
+     * Commit everything so far, marking several change files as completed
+     * with only one sync.
+     */
+    void commit(uint64_t data_size, const std::vector<change_file_id>& completed_files) {
+        if (completed_files.empty()) {
+            commit(data_size);
+            return;
+        }
+        for (const auto& file : completed_files) {
+            write(detail::journal_record{detail::journal_commit, 0, data_size, file.checksum, file.size});
+        }
+        sync();
+    }
+
+    /// The update has been published, the journal is not needed any more.
+    void remove() {
+        m_file->close();
+        std::remove(journal_name(m_database).c_str());
+        std::remove((journal_name(m_database) + ".tmp").c_str());
+    }
+
+}; // class Journal
+
+/**
+ * Offset index decorator writing all changes into the journal.
+ */
+class JournaledIndex : public osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t> {
+
+    osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t>& m_index;
+    Journal& m_journal;
+    unsigned int m_nwr;
+
+public:
+
+    JournaledIndex(osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t>& index, Journal& journal, unsigned int nwr) :
+        m_index(index),
+        m_journal(journal),
+        m_nwr(nwr) {
+    }
+
+    void set(const osmium::unsigned_object_id_type id, const std::size_t value) override {
+        m_journal.add_mutation(m_nwr, id, value);
+        m_index.set(id, value);
+    }
+
+    std::size_t get(const osmium::unsigned_object_id_type id) const override {
+        return m_index.get(id);
+    }
+
+    std::size_t get_noexcept(const osmium::unsigned_object_id_type id) const noexcept override {
+        return m_index.get_noexcept(id);
+    }
+
+    std::size_t size() const override {
+        return m_index.size();
+    }
+
+    std::size_t used_memory() const override {
+        return m_index.used_memory();
+    }
+
+    void clear() override {
+        m_index.clear();
+    }
+
+}; // class JournaledIndex
+
+#endif // JOURNAL_HPP
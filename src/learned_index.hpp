@@ -0,0 +1,245 @@
+#ifndef LEARNED_INDEX_HPP
+#define LEARNED_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Piecewise linear model predicting the position of an ID in a sorted
+ * sparse index or map file (in the style of the PGM index). Each segment
+ * covers a range of IDs and predicts the position of the first element
+ * with a given ID to within +/- epsilon slots.
+ *
+ * The model for an index or map file is stored in a file with the same
+ * name and the suffix ".model": A header (magic, epsilon, number of
+ * segments, number of elements in the index) followed by the segments.
+ * OSM IDs are nearly uniform over large ranges, so there are only few
+ * segments and the whole model usually fits into a few cache lines.
+ */
+
+namespace detail {
+
+    constexpr const uint64_t model_magic = 0x314c444d42444f45ULL; // "EODBMDL1"
+
+    struct model_header {
+        uint64_t magic;
+        uint64_t epsilon;
+        uint64_t num_segments;
+        uint64_t num_elements;
+    };
+
+    struct model_segment {
+        uint64_t first_id;
+        uint64_t first_pos;
+        double slope;
+    };
+
+} // namespace detail
+
+inline std::string model_name(const std::string& filename) {
+    return filename + ".model";
+}
+
+class LearnedIndexBuilder {
+
+    std::vector<detail::model_segment> m_segments;
+    uint64_t m_epsilon;
+    uint64_t m_count = 0;
+
+    // the segment currently being built
+    uint64_t m_first_id = 0;
+    uint64_t m_first_pos = 0;
+    double m_slope_lo = 0.0;
+    double m_slope_hi = std::numeric_limits<double>::max();
+    bool m_in_segment = false;
+
+    void close_segment() {
+        const double slope = m_slope_hi == std::numeric_limits<double>::max() ? 0.0 : (m_slope_lo + m_slope_hi) / 2;
+        m_segments.push_back(detail::model_segment{m_first_id, m_first_pos, slope});
+    }
+
+    void start_segment(uint64_t id, uint64_t pos) {
+        m_first_id = id;
+        m_first_pos = pos;
+        m_slope_lo = 0.0;
+        m_slope_hi = std::numeric_limits<double>::max();
+        m_in_segment = true;
+    }
+
+    void add_point(uint64_t id, uint64_t pos) {
+        if (!m_in_segment) {
+            start_segment(id, pos);
+            return;
+        }
+
+        const double dx = double(id - m_first_id);
+        const double dy = double(pos) - double(m_first_pos);
+        const double lo = std::max(m_slope_lo, (dy - double(m_epsilon)) / dx);
+        const double hi = std::min(m_slope_hi, (dy + double(m_epsilon)) / dx);
+
+        if (lo > hi) {
+            close_segment();
+            start_segment(id, pos);
+        } else {
+            m_slope_lo = lo;
+            m_slope_hi = hi;
+        }
+    }
+
+public:
+
+    explicit LearnedIndexBuilder(uint64_t epsilon = 32) :
+        m_epsilon(epsilon) {
+    }
+
+    /**
+     * Build model from the IDs of the elements. The elements have to be
+     * sorted by ID, they are stride uint64_t values apart.
+     */
+    void build(const uint64_t* ids, std::size_t count, std::size_t stride) {
+        m_count = count;
+        for (std::size_t i = 0; i < count; ++i) {
+            const uint64_t id = ids[i * stride];
+            if (i > 0) {
+                const uint64_t prev = ids[(i - 1) * stride];
+                if (id < prev) {
+                    throw std::runtime_error{"index must be sorted to build learned model"};
+                }
+                if (id == prev) {
+                    continue;
+                }
+            }
+            add_point(id, i);
+        }
+        if (m_in_segment) {
+            close_segment();
+        }
+    }
+
+    std::size_t num_segments() const noexcept {
+        return m_segments.size();
+    }
+
+    void write(const std::string& filename) const {
+        OutputFile file{filename};
+        const detail::model_header header{detail::model_magic, m_epsilon, m_segments.size(), m_count};
+        file.write_value(header);
+        file.write(m_segments.data(), m_segments.size() * sizeof(detail::model_segment));
+        file.close();
+    }
+
+}; // class LearnedIndexBuilder
+
+class LearnedIndex {
+
+    std::unique_ptr<MappedFile> m_file;
+    const detail::model_header* m_header;
+    const detail::model_segment* m_segments;
+
+public:
+
+    explicit LearnedIndex(const std::string& filename) :
+        m_file(new MappedFile{filename}),
+        m_header(reinterpret_cast<const detail::model_header*>(m_file->data())),
+        m_segments(reinterpret_cast<const detail::model_segment*>(m_file->data() + sizeof(detail::model_header))) {
+        if (m_file->size() < sizeof(detail::model_header) ||
+            m_header->magic != detail::model_magic ||
+            m_file->size() != sizeof(detail::model_header) + m_header->num_segments * sizeof(detail::model_segment)) {
+            throw std::runtime_error{std::string{"Invalid model file '"} + filename + "'"};
+        }
+    }
+
+    /// Number of elements in the index this model was built for.
+    uint64_t num_elements() const noexcept {
+        return m_header->num_elements;
+    }
+
+    /**
+     * Returns the range [first, last) of positions in the index that
+     * contains the first element with this ID if there is one.
+     */
+    std::pair<std::size_t, std::size_t> search_range(osmium::unsigned_object_id_type id) const noexcept {
+        const auto end = m_segments + m_header->num_segments;
+        auto seg = std::upper_bound(m_segments, end, id, [](osmium::unsigned_object_id_type lhs, const detail::model_segment& rhs) {
+            return lhs < rhs.first_id;
+        });
+        if (seg == m_segments) {
+            return std::make_pair(std::size_t(0), std::size_t(0));
+        }
+        --seg;
+
+        const double predicted = double(seg->first_pos) + seg->slope * double(id - seg->first_id);
+        // one additional slot on each side for rounding errors
+        const double margin = double(m_header->epsilon + 1);
+        const double first = std::max(predicted - margin, 0.0);
+        const double last = std::min(predicted + margin + 1, double(m_header->num_elements));
+        if (first >= last) {
+            return std::make_pair(std::size_t(0), std::size_t(0));
+        }
+        return std::make_pair(std::size_t(first), std::size_t(last));
+    }
+
+}; // class LearnedIndex
+
+/**
+ * Open the model for the index or map file if there is one.
+ */
+inline std::unique_ptr<LearnedIndex> open_learned_index(const std::string& filename) {
+    std::unique_ptr<LearnedIndex> model;
+    if (file_exists(model_name(filename))) {
+        model.reset(new LearnedIndex{model_name(filename)});
+    }
+    return model;
+}
+
+/**
+ * Create the model for a sparse index or map file. All our sparse files
+ * contain 16 byte elements with the ID in the first 8 bytes.
+ */
+inline void write_learned_index(const std::string& filename) {
+    MappedFile mf{filename};
+
+    LearnedIndexBuilder builder;
+    builder.build(reinterpret_cast<const uint64_t*>(mf.data()), mf.size() / (2 * sizeof(uint64_t)), 2);
+    builder.write(model_name(filename));
+
+    mf.close();
+}
+
+#endif // LEARNED_INDEX_HPP
@@ -0,0 +1,417 @@
+#ifndef LEVELDB_MAP_HPP
+#define LEVELDB_MAP_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+// osmium
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/osm/types.hpp>
+
+/*
+ * LevelDB versions of the node2way, node2relation, way2relation, and
+ * relation2relation maps. Each map is a LevelDB database in the directory
+ * "MAP.leveldb" in the database directory.
+ *
+ * Optionally the node, way, and relation offset indexes are stored in
+ * LevelDB, too ("nodes.leveldb" etc.), with the offset as value ID.
+ *
+ * The key ID and value ID of each entry are stored together in the
+ * LevelDB key (see detail::leveldb_map_key()), the LevelDB value is empty.
+ */
+
+inline std::string leveldb_map_name(const std::string& database, const std::string& map) {
+    return database + "/" + map + ".leveldb";
+}
+
+inline void check_leveldb_status(const leveldb::Status& status, const std::string& message) {
+    if (!status.ok()) {
+        throw std::runtime_error{message + ": " + status.ToString()};
+    }
+}
+
+inline std::unique_ptr<leveldb::DB> open_leveldb_map(const std::string& filename, const leveldb::Options& options) {
+    leveldb::DB* db = nullptr;
+    check_leveldb_status(leveldb::DB::Open(options, filename, &db), "Can't open LevelDB map '" + filename + "'");
+    return std::unique_ptr<leveldb::DB>{db};
+}
+
+namespace detail {
+
+    constexpr const std::size_t leveldb_id_size = sizeof(osmium::unsigned_object_id_type);
+
+    inline void encode_big_endian(char* buffer, osmium::unsigned_object_id_type id) noexcept {
+        for (std::size_t i = leveldb_id_size; i > 0; --i) {
+            buffer[i - 1] = char(id & 0xffu);
+            id >>= 8u;
+        }
+    }
+
+    inline osmium::unsigned_object_id_type decode_big_endian(const char* buffer) noexcept {
+        osmium::unsigned_object_id_type id = 0;
+        for (std::size_t i = 0; i < leveldb_id_size; ++i) {
+            id = (id << 8u) | static_cast<unsigned char>(buffer[i]);
+        }
+        return id;
+    }
+
+    /**
+     * The key of a map entry is the key ID followed by the value ID, both
+     * big-endian, so that the bytewise order of LevelDB is the numeric
+     * order and all entries for one key ID are next to each other. The
+     * LevelDB value is always empty.
+     */
+    inline void leveldb_map_key(char* buffer, osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type value) noexcept {
+        encode_big_endian(buffer, key);
+        encode_big_endian(buffer + leveldb_id_size, value);
+    }
+
+} // namespace detail
+
+/**
+ * Writes the entries of one LevelDB map from a background thread.
+ *
+ * Entries are collected into large chunks which are handed to the writer
+ * thread through a bounded queue, so the thread reading the input only
+ * blocks if the writer can't keep up. The writer sorts each chunk by key
+ * before writing it in large batches. Sorted inserts are much cheaper for
+ * the memtable and lead to SST files with less overlap and so to less
+ * compaction work.
+ *
+ * Errors from LevelDB are stored and rethrown in the reading thread from
+ * the next call to add() or from close().
+ */
+class LevelDBMapWriter {
+
+    using entry_type = std::pair<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type>;
+    using chunk_type = std::vector<entry_type>;
+
+    // entries handed to the writer thread at once
+    static constexpr const std::size_t chunk_size = 1024 * 1024;
+
+    // entries per leveldb::WriteBatch
+    static constexpr const std::size_t batch_size = 64 * 1024;
+
+    // chunks in queue before add() blocks
+    static constexpr const std::size_t max_queue_size = 4;
+
+    std::string m_filename;
+    std::unique_ptr<leveldb::DB> m_db;
+
+    chunk_type m_chunk;
+
+    std::mutex m_mutex;
+    std::condition_variable m_queue_changed;
+    std::deque<chunk_type> m_queue;
+    bool m_done = false;
+    std::exception_ptr m_error;
+
+    std::thread m_thread;
+
+    void write_chunk(chunk_type& chunk) {
+        std::sort(chunk.begin(), chunk.end());
+
+        leveldb::WriteBatch batch;
+        std::size_t count = 0;
+        for (const auto& entry : chunk) {
+            char key[2 * detail::leveldb_id_size];
+            detail::leveldb_map_key(key, entry.first, entry.second);
+            batch.Put(leveldb::Slice{key, sizeof(key)}, leveldb::Slice{});
+            if (++count == batch_size) {
+                check_leveldb_status(m_db->Write(leveldb::WriteOptions{}, &batch), "Write to LevelDB map '" + m_filename + "' failed");
+                batch.Clear();
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            check_leveldb_status(m_db->Write(leveldb::WriteOptions{}, &batch), "Write to LevelDB map '" + m_filename + "' failed");
+        }
+    }
+
+    void run() {
+        try {
+            while (true) {
+                chunk_type chunk;
+                {
+                    std::unique_lock<std::mutex> lock{m_mutex};
+                    m_queue_changed.wait(lock, [this]() {
+                        return !m_queue.empty() || m_done;
+                    });
+                    if (m_queue.empty()) {
+                        return;
+                    }
+                    chunk = std::move(m_queue.front());
+                    m_queue.pop_front();
+                }
+                m_queue_changed.notify_all();
+                write_chunk(chunk);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_error = std::current_exception();
+            m_queue.clear();
+        }
+        m_queue_changed.notify_all();
+    }
+
+    void push_chunk() {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        m_queue_changed.wait(lock, [this]() {
+            return m_queue.size() < max_queue_size || m_error;
+        });
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+        m_queue.push_back(std::move(m_chunk));
+        lock.unlock();
+        m_queue_changed.notify_all();
+
+        m_chunk = chunk_type{};
+        m_chunk.reserve(chunk_size);
+    }
+
+public:
+
+    /**
+     * Options for bulk loading: A large memtable and large SST files
+     * mean fewer, larger compactions.
+     */
+    static leveldb::Options bulk_load_options() {
+        leveldb::Options options;
+        options.create_if_missing = true;
+        options.error_if_exists = true;
+        options.write_buffer_size = 128 * 1024 * 1024;
+        options.max_file_size = 64 * 1024 * 1024;
+        options.block_size = 64 * 1024;
+        return options;
+    }
+
+    explicit LevelDBMapWriter(const std::string& filename) :
+        m_filename(filename),
+        m_db(open_leveldb_map(filename, bulk_load_options())) {
+        m_chunk.reserve(chunk_size);
+        m_thread = std::thread{&LevelDBMapWriter::run, this};
+    }
+
+    LevelDBMapWriter(const LevelDBMapWriter&) = delete;
+    LevelDBMapWriter& operator=(const LevelDBMapWriter&) = delete;
+
+    ~LevelDBMapWriter() {
+        try {
+            close();
+        } catch (...) {
+            // ignore, call close() explicitly to get errors
+        }
+    }
+
+    void add(osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type value) {
+        m_chunk.emplace_back(key, value);
+        if (m_chunk.size() == chunk_size) {
+            push_chunk();
+        }
+    }
+
+    /**
+     * Write all remaining entries and wait for the writer thread. Throws
+     * if any write failed.
+     */
+    void close() {
+        if (!m_thread.joinable()) {
+            return;
+        }
+        if (!m_chunk.empty()) {
+            try {
+                push_chunk();
+            } catch (...) {
+                // the writer thread failed, its error is rethrown below
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_done = true;
+        }
+        m_queue_changed.notify_all();
+        m_thread.join();
+        m_db.reset();
+
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+}; // class LevelDBMapWriter
+
+/**
+ * Read and update access to an existing LevelDB map.
+ */
+class LevelDBMap {
+
+    std::string m_filename;
+    std::unique_ptr<leveldb::DB> m_db;
+
+    static leveldb::Options read_options() {
+        leveldb::Options options;
+        options.block_size = 64 * 1024;
+        return options;
+    }
+
+    void check_iterator(const leveldb::Iterator& it) const {
+        check_leveldb_status(it.status(), "Reading LevelDB map '" + m_filename + "' failed");
+    }
+
+public:
+
+    explicit LevelDBMap(const std::string& filename) :
+        m_filename(filename),
+        m_db(open_leveldb_map(filename, read_options())) {
+    }
+
+    /**
+     * Call func(value) for all values with the given key in order. Needs
+     * only one Seek, all entries for a key are next to each other.
+     * Returns the number of values found.
+     */
+    template <typename TFunc>
+    std::size_t for_each_value(osmium::unsigned_object_id_type key, TFunc&& func) const {
+        char prefix[detail::leveldb_id_size];
+        detail::encode_big_endian(prefix, key);
+        const leveldb::Slice prefix_slice{prefix, sizeof(prefix)};
+
+        std::unique_ptr<leveldb::Iterator> it{m_db->NewIterator(leveldb::ReadOptions{})};
+        std::size_t count = 0;
+        for (it->Seek(prefix_slice); it->Valid() && it->key().starts_with(prefix_slice); it->Next()) {
+            func(detail::decode_big_endian(it->key().data() + detail::leveldb_id_size));
+            ++count;
+        }
+        check_iterator(*it);
+
+        return count;
+    }
+
+    /**
+     * Call func(key, value) for all entries ordered by key and value.
+     */
+    template <typename TFunc>
+    void for_each(TFunc&& func) const {
+        std::unique_ptr<leveldb::Iterator> it{m_db->NewIterator(leveldb::ReadOptions{})};
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            const char* data = it->key().data();
+            func(detail::decode_big_endian(data), detail::decode_big_endian(data + detail::leveldb_id_size));
+        }
+        check_iterator(*it);
+    }
+
+    /**
+     * Get the largest (usually only) value for the given key. Returns
+     * false if there is none.
+     */
+    bool last_value(osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type& value) const {
+        return for_each_value(key, [&value](osmium::unsigned_object_id_type v) {
+            value = v;
+        }) != 0;
+    }
+
+    static void put(leveldb::WriteBatch& batch, osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type value) {
+        char buffer[2 * detail::leveldb_id_size];
+        detail::leveldb_map_key(buffer, key, value);
+        batch.Put(leveldb::Slice{buffer, sizeof(buffer)}, leveldb::Slice{});
+    }
+
+    static void remove(leveldb::WriteBatch& batch, osmium::unsigned_object_id_type key, osmium::unsigned_object_id_type value) {
+        char buffer[2 * detail::leveldb_id_size];
+        detail::leveldb_map_key(buffer, key, value);
+        batch.Delete(leveldb::Slice{buffer, sizeof(buffer)});
+    }
+
+    void write(leveldb::WriteBatch& batch) {
+        check_leveldb_status(m_db->Write(leveldb::WriteOptions{}, &batch), "Write to LevelDB map '" + m_filename + "' failed");
+    }
+
+}; // class LevelDBMap
+
+/**
+ * Offset index stored in LevelDB, for use with the DiskStore handler
+ * while creating a database. The offset is stored as the value ID of a
+ * map entry, so offset indexes can be read with LevelDBMap, too. If
+ * the input contains several versions of an object, there are several
+ * entries for its ID, the one with the largest offset is the current one.
+ */
+class LevelDBOffsetIndexWriter : public osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t> {
+
+    LevelDBMapWriter m_writer;
+    std::size_t m_size = 0;
+
+public:
+
+    explicit LevelDBOffsetIndexWriter(const std::string& filename) :
+        m_writer(filename) {
+    }
+
+    void set(const osmium::unsigned_object_id_type id, const std::size_t value) override {
+        m_writer.add(id, value);
+        ++m_size;
+    }
+
+    std::size_t get(const osmium::unsigned_object_id_type id) const override {
+        throw osmium::not_found{id}; // write only
+    }
+
+    std::size_t get_noexcept(const osmium::unsigned_object_id_type /*id*/) const noexcept override {
+        return osmium::index::empty_value<std::size_t>(); // write only
+    }
+
+    std::size_t size() const override {
+        return m_size;
+    }
+
+    std::size_t used_memory() const override {
+        return 0;
+    }
+
+    void clear() override {
+    }
+
+    void close() {
+        m_writer.close();
+    }
+
+}; // class LevelDBOffsetIndexWriter
+
+#endif // LEVELDB_MAP_HPP
@@ -0,0 +1,398 @@
+#ifndef MAP_DELTA_HPP
+#define MAP_DELTA_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "learned_index.hpp"
+#include "mapped_file.hpp"
+#include "membership_filter.hpp"
+#include "output_file.hpp"
+#include "snapshot.hpp"
+
+/*
+ * Changes to the maps (node2way, node2relation, way2relation, and
+ * relation2relation) written by eodb_update.
+ *
+ * Map files are never changed. Instead each generation can have a delta
+ * file containing the IDs of all ways or relations ("parents") changed
+ * since the map file was written and all their current entries:
+ *
+ *   map_delta_header  magic, number of parents, number of entries
+ *   uint64_t...       sorted IDs of the changed parents
+ *   map_element...    sorted (member id, parent id) entries
+ *
+ * The entries of the map file are only used for parents not in the delta.
+ * Like the index deltas, the map deltas are cumulative. If a delta gets
+ * too large, a new map file is written instead. The files of each map are
+ * recorded in the manifest (see snapshot.hpp).
+ */
+
+namespace detail {
+
+    constexpr const uint64_t map_delta_magic = 0x314c444d42444f45ULL; // "EODBMDL1"
+
+    struct map_delta_header {
+        uint64_t magic;
+        uint64_t num_parents;
+        uint64_t num_entries;
+    };
+
+} // namespace detail
+
+typedef std::pair<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> map_element;
+
+/**
+ * Files of the map in the generation of the manifest. Maps not changed by
+ * any update are the map files written by eodb_create (if there is one).
+ */
+inline SnapshotManifest::delta_files snapshot_map_files(const std::string& database, const SnapshotManifest& manifest, const std::string& name) {
+    const auto it = manifest.maps.find(name);
+    if (it != manifest.maps.end()) {
+        return it->second;
+    }
+    SnapshotManifest::delta_files files;
+    if (file_exists(map_name(database, name))) {
+        files.base = name + ".map";
+    }
+    return files;
+}
+
+/**
+ * Add the files of the old generation of a map that are not used in the
+ * next generation any more to retired.
+ */
+inline void retire_map_files(const SnapshotManifest::delta_files& old_files, const SnapshotManifest::delta_files& next_files, std::vector<std::string>& retired) {
+    if (!old_files.base.empty() && old_files.base != next_files.base) {
+        retired.push_back(old_files.base);
+        retired.push_back(filter_name(old_files.base));
+        retired.push_back(model_name(old_files.base));
+    }
+    if (!old_files.delta.empty() && old_files.delta != next_files.delta) {
+        retired.push_back(old_files.delta);
+    }
+}
+
+class MapDelta {
+
+    MappedFile m_file;
+    const uint64_t* m_parents = nullptr;
+    std::size_t m_num_parents = 0;
+    const map_element* m_entries = nullptr;
+    std::size_t m_num_entries = 0;
+
+public:
+
+    explicit MapDelta(const std::string& filename) :
+        m_file(filename) {
+        const auto* header = reinterpret_cast<const detail::map_delta_header*>(m_file.data());
+        if (m_file.size() < sizeof(detail::map_delta_header) ||
+            header->magic != detail::map_delta_magic ||
+            m_file.size() != sizeof(detail::map_delta_header) + header->num_parents * sizeof(uint64_t) + header->num_entries * sizeof(map_element)) {
+            throw std::runtime_error{"Invalid map delta file '" + filename + "'"};
+        }
+        m_num_parents = header->num_parents;
+        m_num_entries = header->num_entries;
+        m_parents = reinterpret_cast<const uint64_t*>(header + 1);
+        m_entries = reinterpret_cast<const map_element*>(m_parents + m_num_parents);
+    }
+
+    /// Has the parent been changed (or deleted) since the map file was written?
+    bool replaced(osmium::unsigned_object_id_type parent) const noexcept {
+        return std::binary_search(m_parents, m_parents + m_num_parents, parent);
+    }
+
+    const uint64_t* parents_begin() const noexcept {
+        return m_parents;
+    }
+
+    const uint64_t* parents_end() const noexcept {
+        return m_parents + m_num_parents;
+    }
+
+    const map_element* begin() const noexcept {
+        return m_entries;
+    }
+
+    const map_element* end() const noexcept {
+        return m_entries + m_num_entries;
+    }
+
+    std::pair<const map_element*, const map_element*> find(osmium::unsigned_object_id_type member) const noexcept {
+        return std::equal_range(begin(), end(), map_element{member, 0}, [](const map_element& lhs, const map_element& rhs) {
+            return lhs.first < rhs.first;
+        });
+    }
+
+}; // class MapDelta
+
+/**
+ * Read access to one map in a generation: the map file (with membership
+ * filter) and the delta, both are optional.
+ */
+class MapSnapshot {
+
+    std::unique_ptr<MappedFile> m_base;
+    std::unique_ptr<MembershipFilter> m_filter;
+    std::unique_ptr<MapDelta> m_delta;
+
+    const map_element* base_begin() const noexcept {
+        return m_base ? reinterpret_cast<const map_element*>(m_base->data()) : nullptr;
+    }
+
+    const map_element* base_end() const noexcept {
+        return m_base ? base_begin() + m_base->size() / sizeof(map_element) : nullptr;
+    }
+
+public:
+
+    MapSnapshot(const std::string& database, const SnapshotManifest::delta_files& files) {
+        if (!files.base.empty()) {
+            const std::string filename{database + "/" + files.base};
+            m_base.reset(new MappedFile{filename});
+            m_filter = open_membership_filter(filename);
+        }
+        if (!files.delta.empty()) {
+            m_delta.reset(new MapDelta{database + "/" + files.delta});
+        }
+    }
+
+    bool has_delta() const noexcept {
+        return m_delta != nullptr;
+    }
+
+    /**
+     * Entries for the member in the map file. Without delta these are all
+     * entries for the member.
+     */
+    std::pair<const map_element*, const map_element*> find_in_base(osmium::unsigned_object_id_type member) const noexcept {
+        if (!m_base || (m_filter && !m_filter->may_contain(member))) {
+            return std::make_pair(base_end(), base_end());
+        }
+        return std::equal_range(base_begin(), base_end(), map_element{member, 0}, [](const map_element& lhs, const map_element& rhs) {
+            return lhs.first < rhs.first;
+        });
+    }
+
+    /// Call func with each parent of the member (in no particular order).
+    template <typename TFunc>
+    void for_each_parent(osmium::unsigned_object_id_type member, TFunc&& func) const {
+        const auto base = find_in_base(member);
+        for (auto it = base.first; it != base.second; ++it) {
+            if (!m_delta || !m_delta->replaced(it->second)) {
+                func(it->second);
+            }
+        }
+        if (m_delta) {
+            const auto delta = m_delta->find(member);
+            for (auto it = delta.first; it != delta.second; ++it) {
+                func(it->second);
+            }
+        }
+    }
+
+    /**
+     * Add the parents of all members in [first, last) (sorted) to parents.
+     * Because the members are sorted, each lookup only has to search from
+     * the position of the last one.
+     */
+    template <typename TIterator>
+    void find_parents(TIterator first, TIterator last, std::vector<osmium::unsigned_object_id_type>& parents) const {
+        const map_element* base = base_begin();
+        const map_element* delta = m_delta ? m_delta->begin() : nullptr;
+        for (; first != last; ++first) {
+            base = std::lower_bound(base, base_end(), map_element{*first, 0});
+            for (auto it = base; it != base_end() && it->first == *first; ++it) {
+                if (!m_delta || !m_delta->replaced(it->second)) {
+                    parents.push_back(it->second);
+                }
+            }
+            if (m_delta) {
+                delta = std::lower_bound(delta, m_delta->end(), map_element{*first, 0});
+                for (auto it = delta; it != m_delta->end() && it->first == *first; ++it) {
+                    parents.push_back(it->second);
+                }
+            }
+        }
+    }
+
+    /// Call func with all entries of the map in order.
+    template <typename TFunc>
+    void for_each(TFunc&& func) const {
+        const map_element* it = base_begin();
+        const map_element* const last = base_end();
+        if (!m_delta) {
+            std::for_each(it, last, func);
+            return;
+        }
+        for (const auto& element : *m_delta) {
+            for (; it != last && *it < element; ++it) {
+                if (!m_delta->replaced(it->second)) {
+                    func(*it);
+                }
+            }
+            func(element);
+        }
+        for (; it != last; ++it) {
+            if (!m_delta->replaced(it->second)) {
+                func(*it);
+            }
+        }
+    }
+
+}; // class MapSnapshot
+
+/**
+ * Collects the current entries of all ways or relations changed in an
+ * update and writes the files of the map for the next generation.
+ */
+class MapDeltaWriter {
+
+    // write a new map file when the delta gets larger than this many
+    // entries and more than 1/16 of the map file
+    static constexpr const std::size_t min_compact_size = 1024 * 1024;
+
+    std::vector<osmium::unsigned_object_id_type> m_parents;
+    std::vector<map_element> m_entries;
+
+public:
+
+    /**
+     * The parent was changed or deleted. Its current members (if any) have
+     * to be added with add().
+     */
+    void replace(osmium::unsigned_object_id_type parent) {
+        m_parents.push_back(parent);
+    }
+
+    void add(osmium::unsigned_object_id_type member, osmium::unsigned_object_id_type parent) {
+        m_entries.emplace_back(member, parent);
+    }
+
+    bool empty() const noexcept {
+        return m_parents.empty();
+    }
+
+    /**
+     * Write the delta (or new map file) of the next generation from the
+     * files of the current one. Returns the files of the next generation.
+     */
+    SnapshotManifest::delta_files write_next(const std::string& database, const std::string& name, const SnapshotManifest::delta_files& files, uint64_t generation) {
+        if (empty()) {
+            return files;
+        }
+
+        std::sort(m_parents.begin(), m_parents.end());
+        m_parents.erase(std::unique(m_parents.begin(), m_parents.end()), m_parents.end());
+        std::sort(m_entries.begin(), m_entries.end());
+        m_entries.erase(std::unique(m_entries.begin(), m_entries.end()), m_entries.end());
+
+        // the new delta contains everything of the old one for parents not
+        // changed again
+        std::vector<osmium::unsigned_object_id_type> parents;
+        std::vector<map_element> entries;
+        if (files.delta.empty()) {
+            parents.swap(m_parents);
+            entries.swap(m_entries);
+        } else {
+            const MapDelta old_delta{database + "/" + files.delta};
+            std::set_union(old_delta.parents_begin(), old_delta.parents_end(), m_parents.cbegin(), m_parents.cend(), std::back_inserter(parents));
+            std::vector<map_element> kept;
+            std::copy_if(old_delta.begin(), old_delta.end(), std::back_inserter(kept), [this](const map_element& element) {
+                return !std::binary_search(m_parents.cbegin(), m_parents.cend(), element.second);
+            });
+            std::merge(kept.cbegin(), kept.cend(), m_entries.cbegin(), m_entries.cend(), std::back_inserter(entries));
+            m_parents.clear();
+            m_entries.clear();
+        }
+
+        std::size_t base_size = 0;
+        if (!files.base.empty()) {
+            base_size = MappedFile{database + "/" + files.base}.size() / sizeof(map_element);
+        }
+
+        SnapshotManifest::delta_files next;
+        const std::size_t delta_size = parents.size() + entries.size();
+        if (delta_size <= std::max(std::size_t(min_compact_size), base_size / 16)) {
+            next.base = files.base;
+            next.delta = name + ".delta." + std::to_string(generation);
+            OutputFile file{database + "/" + next.delta};
+            file.write_value(detail::map_delta_header{detail::map_delta_magic, parents.size(), entries.size()});
+            file.write(parents.data(), parents.size() * sizeof(uint64_t));
+            file.write(entries.data(), entries.size() * sizeof(map_element));
+            file.sync();
+            file.close();
+            return next;
+        }
+
+        // compact into a new map file
+        next.base = name + "." + std::to_string(generation) + ".map";
+        const std::string filename{database + "/" + next.base};
+        {
+            OutputFile file{filename};
+            const map_element* it = nullptr;
+            const map_element* last = nullptr;
+            std::unique_ptr<MappedFile> base;
+            if (!files.base.empty()) {
+                base.reset(new MappedFile{database + "/" + files.base});
+                it = reinterpret_cast<const map_element*>(base->data());
+                last = it + base->size() / sizeof(map_element);
+            }
+            const auto write_base_until = [&](const map_element* element) {
+                for (; it != last && (!element || *it < *element); ++it) {
+                    if (!std::binary_search(parents.cbegin(), parents.cend(), it->second)) {
+                        file.write_value(*it);
+                    }
+                }
+            };
+            for (const auto& element : entries) {
+                write_base_until(&element);
+                file.write_value(element);
+            }
+            write_base_until(nullptr);
+            file.sync();
+            file.close();
+        }
+        write_membership_filter(filename);
+        write_learned_index(filename);
+
+        return next;
+    }
+
+}; // class MapDeltaWriter
+
+#endif // MAP_DELTA_HPP
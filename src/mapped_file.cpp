@@ -40,6 +40,11 @@ MappedFile::MappedFile(const std::string& filename) :
 
     m_size = s.st_size;
 
+    // mmap() can not map zero-length files
+    if (m_size == 0) {
+        return;
+    }
+
     m_ptr = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
     if (m_ptr == MAP_FAILED) {
         throw std::system_error{errno, std::system_category(),
@@ -52,11 +57,14 @@ void MappedFile::close() {
         throw std::system_error{errno, std::system_category(),
             std::string{"Closing of input file '"} + m_filename + "' failed"};
     }
+    m_ptr = nullptr;
 
     if (m_fd != -1 && ::close(m_fd) != 0) {
+        m_fd = -1;
         throw std::system_error{errno, std::system_category(),
             std::string{"Closing of input file '"} + m_filename + "' failed"};
     }
+    m_fd = -1;
 }
 
 MappedFile::~MappedFile() {
@@ -1,3 +1,6 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
 /*
 
 EODB -- An experimental OSM database based on Libosmium.
@@ -55,3 +58,4 @@ public:
 
 }; // class MappedFile
 
+#endif // MAPPED_FILE_HPP
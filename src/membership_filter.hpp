@@ -0,0 +1,187 @@
+#ifndef MEMBERSHIP_FILTER_HPP
+#define MEMBERSHIP_FILTER_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Blocked Bloom filter for IDs. Each ID sets one bit in each of the eight
+ * 32-bit words of one 256-bit block, so a lookup touches only one block
+ * (half a cache line). With the default of 16 bits per ID the false
+ * positive rate is about 0.1%.
+ *
+ * The filter for an index or map file is stored in a file with the same
+ * name and the suffix ".bloom". It starts with a header (magic and
+ * number of blocks) followed by the blocks.
+ */
+
+namespace detail {
+
+    constexpr const uint64_t bloom_magic = 0x314d4c4242444f45ULL; // "EODBBLM1"
+
+    struct bloom_block {
+        uint32_t word[8];
+    };
+
+    inline uint64_t hash_id(osmium::unsigned_object_id_type id) noexcept {
+        // splitmix64 finalizer
+        uint64_t h = id + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    inline bloom_block bloom_mask(uint32_t h) noexcept {
+        static const uint32_t salt[8] = {
+            0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+            0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+        };
+        bloom_block mask;
+        for (int i = 0; i < 8; ++i) {
+            mask.word[i] = uint32_t(1) << ((h * salt[i]) >> 27);
+        }
+        return mask;
+    }
+
+    inline uint64_t bloom_block_num(uint64_t h, uint64_t num_blocks) noexcept {
+        return ((h >> 32) * num_blocks) >> 32;
+    }
+
+} // namespace detail
+
+inline std::string filter_name(const std::string& filename) {
+    return filename + ".bloom";
+}
+
+class MembershipFilterBuilder {
+
+    std::vector<detail::bloom_block> m_blocks;
+
+public:
+
+    explicit MembershipFilterBuilder(std::size_t num_ids, std::size_t bits_per_id = 16) :
+        m_blocks((num_ids * bits_per_id + 255) / 256 + 1) {
+        if (m_blocks.size() >= (uint64_t(1) << 32)) {
+            throw std::runtime_error{"too many IDs for membership filter"};
+        }
+    }
+
+    void add(osmium::unsigned_object_id_type id) noexcept {
+        const uint64_t h = detail::hash_id(id);
+        const auto mask = detail::bloom_mask(uint32_t(h));
+        auto& block = m_blocks[detail::bloom_block_num(h, m_blocks.size())];
+        for (int i = 0; i < 8; ++i) {
+            block.word[i] |= mask.word[i];
+        }
+    }
+
+    void write(const std::string& filename) const {
+        OutputFile file{filename};
+        file.write_value(detail::bloom_magic);
+        file.write_value(uint64_t(m_blocks.size()));
+        file.write(m_blocks.data(), m_blocks.size() * sizeof(detail::bloom_block));
+        file.close();
+    }
+
+}; // class MembershipFilterBuilder
+
+class MembershipFilter {
+
+    std::unique_ptr<MappedFile> m_file;
+    const detail::bloom_block* m_blocks = nullptr;
+    uint64_t m_num_blocks = 0;
+
+public:
+
+    explicit MembershipFilter(const std::string& filename) :
+        m_file(new MappedFile{filename}) {
+        const uint64_t* header = reinterpret_cast<const uint64_t*>(m_file->data());
+        if (m_file->size() < 2 * sizeof(uint64_t) || header[0] != detail::bloom_magic) {
+            throw std::runtime_error{std::string{"Invalid membership filter file '"} + filename + "'"};
+        }
+        m_num_blocks = header[1];
+        if (m_file->size() != 2 * sizeof(uint64_t) + m_num_blocks * sizeof(detail::bloom_block)) {
+            throw std::runtime_error{std::string{"Invalid membership filter file '"} + filename + "'"};
+        }
+        m_blocks = reinterpret_cast<const detail::bloom_block*>(header + 2);
+    }
+
+    /**
+     * Returns false if the ID is definitely not in the index or map.
+     */
+    bool may_contain(osmium::unsigned_object_id_type id) const noexcept {
+        const uint64_t h = detail::hash_id(id);
+        const auto mask = detail::bloom_mask(uint32_t(h));
+        const auto& block = m_blocks[detail::bloom_block_num(h, m_num_blocks)];
+        uint32_t missing = 0;
+        for (int i = 0; i < 8; ++i) {
+            missing |= mask.word[i] & ~block.word[i];
+        }
+        return missing == 0;
+    }
+
+}; // class MembershipFilter
+
+/**
+ * Open the filter for the index or map file if there is one.
+ */
+inline std::unique_ptr<MembershipFilter> open_membership_filter(const std::string& filename) {
+    std::unique_ptr<MembershipFilter> filter;
+    if (file_exists(filter_name(filename))) {
+        filter.reset(new MembershipFilter{filter_name(filename)});
+    }
+    return filter;
+}
+
+/**
+ * Create the filter for a sparse index or map file. All our sparse files
+ * contain 16 byte elements with the ID in the first 8 bytes.
+ */
+inline void write_membership_filter(const std::string& filename) {
+    MappedFile mf{filename};
+    const uint64_t* elements = reinterpret_cast<const uint64_t*>(mf.data());
+    const std::size_t count = mf.size() / (2 * sizeof(uint64_t));
+
+    MembershipFilterBuilder builder{count};
+    for (std::size_t i = 0; i < count; ++i) {
+        builder.add(elements[i * 2]);
+    }
+    builder.write(filter_name(filename));
+
+    mf.close();
+}
+
+#endif // MEMBERSHIP_FILTER_HPP
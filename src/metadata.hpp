@@ -0,0 +1,309 @@
+#ifndef METADATA_HPP
+#define METADATA_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+// boost
+#include <boost/crc.hpp>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Binary metadata file ("metadata") in the database directory. It is
+ * written by eodb_create and updated by eodb_update and records for the
+ * data file and each index and map: the format, the number of objects or
+ * entries, the smallest and largest ID, the file size, and a quick
+ * checksum. Tools use it to find the index formats without probing for
+ * files and to decide on strategies (dense or sparse, buffer sizes)
+ * without reading the files.
+ *
+ * The file has a header (magic, version, number of entries) followed by
+ * fixed size records.
+ */
+
+namespace detail {
+
+    constexpr const uint64_t metadata_magic = 0x3154454d42444f45ULL; // "EODBMET1"
+
+    constexpr const uint32_t metadata_version = 1;
+
+    struct metadata_header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t num_entries;
+    };
+
+    struct metadata_record {
+        char name[24];
+        uint32_t format;
+        uint32_t format_version;
+        uint64_t count;
+        uint64_t min_id;
+        uint64_t max_id;
+        uint64_t file_size;
+        uint32_t checksum;
+        uint32_t reserved;
+    };
+
+    // bytes at the beginning and end of a file used for the checksum
+    constexpr const std::size_t checksum_range = 64 * 1024;
+
+} // namespace detail
+
+inline std::string metadata_name(const std::string& database) {
+    return database + "/metadata";
+}
+
+/**
+ * Checksum of the size and the first and last 64 kB of a file. This is
+ * cheap even for huge files and finds files that have been replaced or
+ * truncated, but not all changes in the middle of a file.
+ */
+inline uint32_t quick_file_checksum(const std::string& filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error{errno, std::system_category(), "Can't open '" + filename + "'"};
+    }
+
+    boost::crc_32_type crc;
+    const off_t size = ::lseek(fd, 0, SEEK_END);
+    crc.process_bytes(&size, sizeof(size));
+
+    std::vector<char> buffer(detail::checksum_range);
+    for (const off_t offset : {off_t(0), std::max(off_t(0), size - off_t(detail::checksum_range))}) {
+        const auto length = ::pread(fd, buffer.data(), buffer.size(), offset);
+        if (length < 0) {
+            ::close(fd);
+            throw std::system_error{errno, std::system_category(), "Read from '" + filename + "' failed"};
+        }
+        crc.process_bytes(buffer.data(), length);
+    }
+
+    ::close(fd);
+    return crc.checksum();
+}
+
+/**
+ * Handler counting the objects of each type and their smallest and
+ * largest IDs.
+ */
+class ObjectStatistics : public osmium::handler::Handler {
+
+public:
+
+    struct counts {
+        uint64_t count = 0;
+        uint64_t min_id = std::numeric_limits<uint64_t>::max();
+        uint64_t max_id = 0;
+    };
+
+    counts types[3];
+
+    void add(unsigned int nwr, osmium::unsigned_object_id_type id) noexcept {
+        auto& c = types[nwr];
+        ++c.count;
+        c.min_id = std::min(c.min_id, uint64_t(id));
+        c.max_id = std::max(c.max_id, uint64_t(id));
+    }
+
+    void node(const osmium::Node& node) noexcept {
+        add(0, node.positive_id());
+    }
+
+    void way(const osmium::Way& way) noexcept {
+        add(1, way.positive_id());
+    }
+
+    void relation(const osmium::Relation& relation) noexcept {
+        add(2, relation.positive_id());
+    }
+
+}; // class ObjectStatistics
+
+class DatabaseMetadata {
+
+public:
+
+    struct entry {
+        index_format format = index_format::none;
+        uint32_t format_version = 1;
+        uint64_t count = 0;
+        uint64_t min_id = 0;
+        uint64_t max_id = 0;
+        uint64_t file_size = 0;
+        uint32_t checksum = 0;
+    };
+
+    std::map<std::string, entry> entries;
+
+    /**
+     * Read the metadata. Returns false if there is none.
+     */
+    bool read(const std::string& database) {
+        const std::string filename{metadata_name(database)};
+        if (!file_exists(filename)) {
+            return false;
+        }
+
+        MappedFile mf{filename};
+        const auto header = reinterpret_cast<const detail::metadata_header*>(mf.data());
+        if (mf.size() < sizeof(detail::metadata_header) ||
+            header->magic != detail::metadata_magic ||
+            header->version != detail::metadata_version ||
+            mf.size() != sizeof(detail::metadata_header) + header->num_entries * sizeof(detail::metadata_record)) {
+            throw std::runtime_error{"Invalid metadata file '" + filename + "'"};
+        }
+
+        const auto records = reinterpret_cast<const detail::metadata_record*>(mf.data() + sizeof(detail::metadata_header));
+        for (uint32_t i = 0; i < header->num_entries; ++i) {
+            const auto& record = records[i];
+            entry e;
+            e.format = index_format(record.format);
+            e.format_version = record.format_version;
+            e.count = record.count;
+            e.min_id = record.min_id;
+            e.max_id = record.max_id;
+            e.file_size = record.file_size;
+            e.checksum = record.checksum;
+            entries[std::string{record.name, strnlen(record.name, sizeof(record.name))}] = e;
+        }
+
+        mf.close();
+        return true;
+    }
+
+    /**
+     * Atomically replace the metadata file.
+     */
+    void write(const std::string& database) const {
+        const std::string filename{metadata_name(database)};
+        const std::string tmp_filename{filename + ".tmp"};
+
+        OutputFile file{tmp_filename};
+        file.write_value(detail::metadata_header{detail::metadata_magic, detail::metadata_version, uint32_t(entries.size())});
+        for (const auto& e : entries) {
+            detail::metadata_record record;
+            std::memset(&record, 0, sizeof(record));
+            std::strncpy(record.name, e.first.c_str(), sizeof(record.name) - 1);
+            record.format = uint32_t(e.second.format);
+            record.format_version = e.second.format_version;
+            record.count = e.second.count;
+            record.min_id = e.second.min_id;
+            record.max_id = e.second.max_id;
+            record.file_size = e.second.file_size;
+            record.checksum = e.second.checksum;
+            file.write_value(record);
+        }
+        file.sync();
+        file.close();
+
+        if (::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            throw std::system_error{errno, std::system_category(), "Renaming metadata file failed"};
+        }
+    }
+
+    const entry* find(const std::string& name) const {
+        const auto it = entries.find(name);
+        return it == entries.end() ? nullptr : &it->second;
+    }
+
+    /**
+     * Set the entry for a file from the object statistics. File size and
+     * checksum are taken from the file.
+     */
+    void set(const std::string& name, const std::string& filename, index_format format, const ObjectStatistics::counts& counts) {
+        entry& e = entries[name];
+        e.format = format;
+        e.count = counts.count;
+        e.min_id = counts.count ? counts.min_id : 0;
+        e.max_id = counts.max_id;
+        e.file_size = file_size(filename);
+        e.checksum = quick_file_checksum(filename);
+    }
+
+    /**
+     * Set the entry for a map file. The counts are taken from the file.
+     */
+    void set_map(const std::string& name, const std::string& filename) {
+        ObjectStatistics::counts counts;
+        MappedFile mf{filename};
+        const auto elements = reinterpret_cast<const uint64_t*>(mf.data());
+        counts.count = mf.size() / (2 * sizeof(uint64_t));
+        if (counts.count > 0) {
+            counts.min_id = elements[0];
+            counts.max_id = elements[(counts.count - 1) * 2];
+        }
+        mf.close();
+        set(name, filename, index_format::sparse, counts);
+    }
+
+    static uint64_t file_size(const std::string& filename) {
+        struct stat s;
+        if (::stat(filename.c_str(), &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "stat on '" + filename + "' failed"};
+        }
+        return s.st_size;
+    }
+
+}; // class DatabaseMetadata
+
+/**
+ * Find out in which format an index is stored in the database. Uses the
+ * metadata if there is any and only probes for files if not.
+ */
+inline index_format lookup_index_format(const std::string& database, const std::string& index) {
+    DatabaseMetadata metadata;
+    if (metadata.read(database)) {
+        const auto* e = metadata.find(index);
+        if (e && e->format != index_format::none) {
+            return e->format;
+        }
+    }
+    return detect_index_format(database, index);
+}
+
+#endif // METADATA_HPP
@@ -0,0 +1,299 @@
+#ifndef NODE_COLUMNS_HPP
+#define NODE_COLUMNS_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/**
+ * Metadata of one node as stored in the "meta" column. The user name is
+ * stored in the "users" column, user_offset points to its start.
+ */
+struct NodeMeta {
+    uint64_t user_offset;
+    uint32_t version;
+    uint32_t changeset;
+    uint32_t timestamp;
+    uint32_t uid;
+}; // struct NodeMeta
+
+static_assert(sizeof(NodeMeta) == 24, "NodeMeta must be packed");
+
+/**
+ * Handler writing all nodes into a set of column files:
+ *
+ * ids       - sorted node IDs (unsigned_object_id_type)
+ * locations - node locations (osmium::Location), same order as ids
+ * tagged    - bitmap with one bit per node, set if the node has tags
+ * tagoffs   - offset into the tags column for each tagged node
+ * tags      - the osmium::TagList items of all tagged nodes
+ * meta      - NodeMeta for each node
+ * users     - \0-terminated user names referenced from the meta column
+ *
+ * The input has to be sorted by ID.
+ */
+class NodeColumnsWriter : public osmium::handler::Handler {
+
+    OutputFile m_ids;
+    OutputFile m_locations;
+    OutputFile m_tagged;
+    OutputFile m_tagoffs;
+    OutputFile m_tags;
+    OutputFile m_meta;
+    OutputFile m_users;
+
+    std::unordered_map<std::string, uint64_t> m_user_offsets;
+
+    osmium::unsigned_object_id_type m_last_id = 0;
+    uint64_t m_tagged_bits = 0;
+    std::size_t m_count = 0;
+
+    uint64_t user_offset(const char* user) {
+        const auto result = m_user_offsets.emplace(user, m_users.size());
+        if (result.second) {
+            m_users.write(user, result.first->first.size() + 1);
+        }
+        return result.first->second;
+    }
+
+public:
+
+    explicit NodeColumnsWriter(const std::string& database) :
+        m_ids(column_name(database, "ids")),
+        m_locations(column_name(database, "locations")),
+        m_tagged(column_name(database, "tagged")),
+        m_tagoffs(column_name(database, "tagoffs")),
+        m_tags(column_name(database, "tags")),
+        m_meta(column_name(database, "meta")),
+        m_users(column_name(database, "users")) {
+    }
+
+    void node(const osmium::Node& node) {
+        const auto id = node.positive_id();
+        if (m_count > 0 && id <= m_last_id) {
+            throw std::runtime_error{"Input must be sorted by ID for the node columns"};
+        }
+        m_last_id = id;
+
+        m_ids.write_value(id);
+        m_locations.write_value(node.location());
+
+        const NodeMeta meta{
+            user_offset(node.user()),
+            node.version(),
+            node.changeset(),
+            uint32_t(node.timestamp().seconds_since_epoch()),
+            uint32_t(node.uid())
+        };
+        m_meta.write_value(meta);
+
+        if (!node.tags().empty()) {
+            m_tagged_bits |= uint64_t(1) << (m_count % 64);
+            m_tagoffs.write_value(uint64_t(m_tags.size()));
+            m_tags.write(&node.tags(), node.tags().padded_size());
+        }
+
+        ++m_count;
+        if (m_count % 64 == 0) {
+            m_tagged.write_value(m_tagged_bits);
+            m_tagged_bits = 0;
+        }
+    }
+
+    void close() {
+        if (m_count % 64 != 0) {
+            m_tagged.write_value(m_tagged_bits);
+        }
+        m_ids.close();
+        m_locations.close();
+        m_tagged.close();
+        m_tagoffs.close();
+        m_tags.close();
+        m_meta.close();
+        m_users.close();
+    }
+
+}; // class NodeColumnsWriter
+
+/**
+ * Read access to the node columns. All columns are memory mapped, so
+ * scans only touch the pages of the columns they actually use.
+ */
+class NodeColumns {
+
+    std::string m_database;
+    std::unique_ptr<MappedFile> m_ids;
+    std::unique_ptr<MappedFile> m_locations;
+    std::unique_ptr<MappedFile> m_tagged;
+    std::unique_ptr<MappedFile> m_tagoffs;
+    std::unique_ptr<MappedFile> m_tags;
+    std::unique_ptr<MappedFile> m_meta;
+    std::unique_ptr<MappedFile> m_users;
+
+    // number of tagged nodes before each word of the tagged bitmap
+    std::vector<uint64_t> m_rank;
+
+    std::size_t m_size;
+
+    MappedFile& column(std::unique_ptr<MappedFile>& file, const char* name) {
+        if (!file) {
+            file.reset(new MappedFile{column_name(m_database, name)});
+        }
+        return *file;
+    }
+
+    const uint64_t* tagged_words() {
+        return reinterpret_cast<const uint64_t*>(column(m_tagged, "tagged").data());
+    }
+
+    void build_rank() {
+        const uint64_t* words = tagged_words();
+        const std::size_t num_words = (m_size + 63) / 64;
+        m_rank.reserve(num_words);
+        uint64_t count = 0;
+        for (std::size_t i = 0; i < num_words; ++i) {
+            m_rank.push_back(count);
+            count += __builtin_popcountll(words[i]);
+        }
+    }
+
+public:
+
+    /**
+     * Open the node columns in the database. The ids column is always
+     * opened, all other columns are opened on first use.
+     */
+    explicit NodeColumns(const std::string& database) :
+        m_database(database),
+        m_ids(new MappedFile{column_name(database, "ids")}),
+        m_size(m_ids->size() / sizeof(osmium::unsigned_object_id_type)) {
+    }
+
+    static bool exist(const std::string& database) {
+        return file_exists(column_name(database, "ids"));
+    }
+
+    std::size_t size() const noexcept {
+        return m_size;
+    }
+
+    const osmium::unsigned_object_id_type* ids() const noexcept {
+        return reinterpret_cast<const osmium::unsigned_object_id_type*>(m_ids->data());
+    }
+
+    const osmium::Location* locations() {
+        return reinterpret_cast<const osmium::Location*>(column(m_locations, "locations").data());
+    }
+
+    const NodeMeta* meta() {
+        return reinterpret_cast<const NodeMeta*>(column(m_meta, "meta").data());
+    }
+
+    const char* user(const NodeMeta& meta) {
+        return reinterpret_cast<const char*>(column(m_users, "users").data()) + meta.user_offset;
+    }
+
+    /// Position of the node with the given ID or size() if not found.
+    std::size_t find(osmium::unsigned_object_id_type id) const {
+        const auto begin = ids();
+        const auto end = begin + m_size;
+        const auto it = std::lower_bound(begin, end, id);
+        if (it == end || *it != id) {
+            return m_size;
+        }
+        return std::size_t(it - begin);
+    }
+
+    bool has_tags(std::size_t pos) {
+        return (tagged_words()[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    /**
+     * Tags of the node at position pos. Must only be called if
+     * has_tags(pos) is true.
+     */
+    const osmium::TagList& tags(std::size_t pos) {
+        if (m_rank.empty()) {
+            build_rank();
+        }
+        const uint64_t mask = (uint64_t(1) << (pos % 64)) - 1;
+        const uint64_t rank = m_rank[pos / 64] + __builtin_popcountll(tagged_words()[pos / 64] & mask);
+        const uint64_t offset = reinterpret_cast<const uint64_t*>(column(m_tagoffs, "tagoffs").data())[rank];
+        return *reinterpret_cast<const osmium::TagList*>(column(m_tags, "tags").data() + offset);
+    }
+
+    /**
+     * Call func(id, location) for all nodes. This only reads the ids
+     * and locations columns.
+     */
+    template <typename TFunc>
+    void for_each_location(TFunc&& func) {
+        const osmium::unsigned_object_id_type* id = ids();
+        const osmium::Location* location = locations();
+        for (std::size_t i = 0; i < m_size; ++i) {
+            func(id[i], location[i]);
+        }
+    }
+
+    /**
+     * Call func(id, tags) for all tagged nodes. This only reads the
+     * ids, tagged, tagoffs, and tags columns.
+     */
+    template <typename TFunc>
+    void for_each_tagged(TFunc&& func) {
+        const uint64_t* words = tagged_words();
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(column(m_tagoffs, "tagoffs").data());
+        const unsigned char* tags = column(m_tags, "tags").data();
+        std::size_t rank = 0;
+        for (std::size_t w = 0; w < (m_size + 63) / 64; ++w) {
+            uint64_t word = words[w];
+            while (word) {
+                const std::size_t pos = w * 64 + __builtin_ctzll(word);
+                func(ids()[pos], *reinterpret_cast<const osmium::TagList*>(tags + offsets[rank++]));
+                word &= word - 1;
+            }
+        }
+    }
+
+}; // class NodeColumns
+
+#endif // NODE_COLUMNS_HPP
@@ -12,6 +12,9 @@
 #include <osmium/index/map/sparse_mem_table.hpp>
 #include <osmium/index/map/sparse_mmap_array.hpp>
 
+// eodb indexes
+#include "packed_index.hpp"
+
 using offset_index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, size_t>;
 
 #ifdef OSMIUM_HAS_INDEX_MAP_DENSE_FILE_ARRAY
@@ -38,4 +41,9 @@ using offset_index_type = osmium::index::map::Map<osmium::unsigned_object_id_typ
     REGISTER_MAP(osmium::unsigned_object_id_type, size_t, osmium::index::map::SparseMmapArray, sparse_mmap_array)
 #endif
 
+REGISTER_MAP(osmium::unsigned_object_id_type, size_t, Packed32DenseFileArray, packed32_dense_file_array)
+REGISTER_MAP(osmium::unsigned_object_id_type, size_t, Packed32DenseMemArray, packed32_dense_mem_array)
+REGISTER_MAP(osmium::unsigned_object_id_type, size_t, Packed40DenseFileArray, packed40_dense_file_array)
+REGISTER_MAP(osmium::unsigned_object_id_type, size_t, Packed40DenseMemArray, packed40_dense_mem_array)
+
 #endif // OFFSET_INDEX_HPP
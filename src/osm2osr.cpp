@@ -25,6 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <iostream>
 #include <string>
 #include <sys/types.h>
+#include <utility>
 #include <vector>
 
 #ifdef _MSC_VER
@@ -36,9 +37,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 // osmium
 #include <osmium/io/any_input.hpp>
+#include <osmium/io/detail/read_write.hpp>
 
 // eodb
+#include "external_sort.hpp"
 #include "options.hpp"
+#include "output_file.hpp"
 #include "eodb.hpp"
 
 class Options : public OptionsBase {
@@ -56,6 +60,8 @@ public:
                 ("output,o", po::value<std::string>(), "Output file")
                 ("overwrite,O", "Overwrite existing output file")
                 ("append,a", "Append to output file")
+                ("sort,s", "Sort objects by type, ID, and version")
+                ("memory,M", po::value<std::size_t>()->default_value(1024), "Memory used for sorting (in MB)")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -86,6 +92,11 @@ public:
                 std::exit(return_code::fatal);
             }
 
+            if (vm.count("append") && vm.count("sort")) {
+                std::cerr << "Can not use --append,-a and --sort,-s together.\n";
+                std::exit(return_code::fatal);
+            }
+
             if (!vm.count("output")) {
                 std::cerr << "Missing --output option\n";
                 std::exit(return_code::fatal);
@@ -109,6 +120,14 @@ public:
         return vm["output"].as<std::string>();
     }
 
+    bool sort() const {
+        return vm.count("sort") != 0;
+    }
+
+    std::size_t memory() const {
+        return vm["memory"].as<std::size_t>() * 1024 * 1024;
+    }
+
 }; // class Options
 
 int main(int argc, char* argv[]) {
@@ -132,18 +151,34 @@ int main(int argc, char* argv[]) {
         std::exit(return_code::fatal);
     }
 
-    for (const auto& fn : options.input_filenames()) {
-        osmium::io::Reader reader{fn};
+    try {
+        if (options.sort()) {
+            ExternalSorter sorter{options.output_filename() + ".sort.", options.memory()};
 
-        while (osmium::memory::Buffer buffer = reader.read()) {
-            const int len = ::write(data_fd, buffer.data(), buffer.committed());
-            if (len == -1) {
-                std::cerr << "Write error: " << std::strerror(errno) << '\n';
-                std::exit(return_code::fatal);
+            for (const auto& fn : options.input_filenames()) {
+                osmium::io::Reader reader{fn};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    sorter.add(std::move(buffer));
+                }
+                reader.close();
             }
-        }
 
-        reader.close();
+            OutputFile output{data_fd, options.output_filename()};
+            sorter.write(output);
+            output.close();
+        } else {
+            for (const auto& fn : options.input_filenames()) {
+                osmium::io::Reader reader{fn};
+                while (osmium::memory::Buffer buffer = reader.read()) {
+                    osmium::io::detail::reliable_write(data_fd, buffer.data(), buffer.committed());
+                }
+                reader.close();
+            }
+            ::close(data_fd);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << '\n';
+        std::exit(return_code::fatal);
     }
 
     return return_code::okay;
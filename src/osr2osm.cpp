@@ -23,11 +23,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cerrno>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 #ifdef _MSC_VER
@@ -40,8 +43,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // osmium
 #include <osmium/io/pbf_output.hpp>
 #include <osmium/io/xml_output.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/object_comparisons.hpp>
 
 // eodb
+#include "external_sort.hpp"
 #include "mapped_file.hpp"
 #include "options.hpp"
 #include "eodb.hpp"
@@ -62,6 +69,8 @@ public:
                 ("output,o", po::value<std::string>()->default_value("-"), "Output file")
                 ("overwrite,O", "Overwrite existing output file")
                 ("output-format,f", po::value<std::string>()->default_value(""), "Format of output file")
+                ("merge,m", "Merge sorted input files into one sorted output file")
+                ("newest,n", "Only write newest version of each object (needs --merge)")
             ;
 
             po::options_description hidden{"Hidden options"};
@@ -91,6 +100,11 @@ public:
                 std::cerr << "You have to set the output file name with --output,-o or the output format with --output-format,-f\n";
                 std::exit(return_code::fatal);
             }
+
+            if (vm.count("newest") && !vm.count("merge")) {
+                std::cerr << "Option --newest,-n only works together with --merge,-m\n";
+                std::exit(return_code::fatal);
+            }
         } catch (const boost::program_options::error& e) {
             std::cerr << "Error parsing command line: " << e.what() << '\n';
             std::exit(return_code::fatal);
@@ -117,6 +131,14 @@ public:
         return vm["output-format"].as<std::string>();
     }
 
+    bool merge() const {
+        return vm.count("merge") != 0;
+    }
+
+    bool newest() const {
+        return vm.count("newest") != 0;
+    }
+
     const std::vector<std::string> input_filenames() const {
         std::vector<std::string> input_filenames;
 
@@ -131,6 +153,56 @@ public:
 
 }; // class Options
 
+/**
+ * Merge the objects from all input files, which must each be sorted, and
+ * write them to the writer. The objects are read directly from the memory
+ * mapped input files and only copied into the output buffers.
+ */
+void merge_files(const std::vector<std::string>& filenames, osmium::io::Writer& writer, bool newest) {
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::vector<object_range> ranges;
+    for (const auto& filename : filenames) {
+        files.emplace_back(new MappedFile{filename});
+        ranges.emplace_back(files.back()->data(), files.back()->data() + files.back()->size());
+    }
+
+    constexpr const std::size_t buffer_size = 16 * 1024 * 1024;
+    osmium::memory::Buffer buffer{buffer_size, osmium::memory::Buffer::auto_grow::yes};
+
+    const auto add_object = [&](const osmium::OSMObject& object) {
+        buffer.add_item(object);
+        buffer.commit();
+        if (buffer.committed() >= buffer_size - 1024 * 1024) {
+            writer(std::move(buffer));
+            buffer = osmium::memory::Buffer{buffer_size, osmium::memory::Buffer::auto_grow::yes};
+        }
+    };
+
+    const osmium::OSMObject* last = nullptr;
+    merge_sorted_objects(ranges, [&](const osmium::OSMObject& object) {
+        if (last && osmium::object_order_type_id_version{}(object, *last)) {
+            throw std::runtime_error{"Input files must be sorted for --merge (use osm2osr --sort)"};
+        }
+        if (newest && last && (last->type() != object.type() || last->id() != object.id())) {
+            add_object(*last);
+        } else if (!newest) {
+            add_object(object);
+        }
+        last = &object;
+    });
+    if (newest && last) {
+        add_object(*last);
+    }
+
+    if (buffer.committed() > 0) {
+        writer(std::move(buffer));
+    }
+
+    for (auto& file : files) {
+        file->close();
+    }
+}
+
 int main(int argc, char* argv[]) {
     std::ios_base::sync_with_stdio(false);
 
@@ -139,6 +211,9 @@ int main(int argc, char* argv[]) {
 
     osmium::io::Header header;
     header.set("generator", options.generator());
+    if (options.merge()) {
+        header.set("sorting", "Type_then_ID");
+    }
 
     osmium::io::Writer writer{
         options.output_filename(),
@@ -149,15 +224,19 @@ int main(int argc, char* argv[]) {
     };
 
     try {
-        for (const auto& filename : options.input_filenames()) {
-            MappedFile mf{filename};
+        if (options.merge()) {
+            merge_files(options.input_filenames(), writer, options.newest());
+        } else {
+            for (const auto& filename : options.input_filenames()) {
+                MappedFile mf{filename};
 
-            osmium::memory::Buffer buffer{mf.data(), mf.size()};
-            writer(std::move(buffer));
+                osmium::memory::Buffer buffer{mf.data(), mf.size()};
+                writer(std::move(buffer));
 
-            mf.close();
+                mf.close();
+            }
         }
-    } catch (const std::system_error& e) {
+    } catch (const std::exception& e) {
         std::cerr << e.what() << '\n';
         return return_code::fatal;
     }
@@ -166,4 +245,3 @@ int main(int argc, char* argv[]) {
 
     return return_code::okay;
 }
-
@@ -0,0 +1,144 @@
+#ifndef OUTPUT_FILE_HPP
+#define OUTPUT_FILE_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cerrno>
+#include <cstddef>
+#include <fcntl.h>
+#include <string>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <osmium/io/detail/read_write.hpp>
+
+/**
+ * Write-only file with a user space buffer in front of it. Used for all
+ * the side files (columns, postings, ...) that are written sequentially
+ * in lots of small pieces.
+ */
+class OutputFile {
+
+    static constexpr const std::size_t flush_size = 4 * 1024 * 1024;
+
+    std::string m_filename;
+    std::string m_buffer;
+    std::size_t m_written = 0;
+    int m_fd = -1;
+
+public:
+
+    explicit OutputFile(const std::string& filename) :
+        m_filename(filename) {
+        m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (m_fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                std::string{"Opening output file '"} + filename + "' failed"};
+        }
+        m_buffer.reserve(flush_size);
+    }
+
+    /// Take over an already opened file descriptor.
+    OutputFile(int fd, const std::string& filename) :
+        m_filename(filename),
+        m_fd(fd) {
+        m_buffer.reserve(flush_size);
+    }
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    ~OutputFile() noexcept {
+        try {
+            close();
+        } catch (...) {
+            // ignore errors
+        }
+    }
+
+    const std::string& filename() const noexcept {
+        return m_filename;
+    }
+
+    void write(const void* data, std::size_t size) {
+        // large pieces (whole arrays) are not copied into the buffer
+        if (size >= flush_size) {
+            flush();
+            osmium::io::detail::reliable_write(m_fd, static_cast<const unsigned char*>(data), size);
+            m_written += size;
+            return;
+        }
+
+        m_buffer.append(static_cast<const char*>(data), size);
+        if (m_buffer.size() >= flush_size) {
+            // only write whole blocks, so all writes are flush_size aligned
+            const std::size_t length = m_buffer.size() / flush_size * flush_size;
+            osmium::io::detail::reliable_write(m_fd, reinterpret_cast<const unsigned char*>(m_buffer.data()), length);
+            m_written += length;
+            m_buffer.erase(0, length);
+        }
+    }
+
+    template <typename T>
+    void write_value(const T& value) {
+        write(&value, sizeof(T));
+    }
+
+    /// Number of bytes written so far (including buffered bytes).
+    std::size_t size() const noexcept {
+        return m_written + m_buffer.size();
+    }
+
+    void flush() {
+        if (!m_buffer.empty()) {
+            osmium::io::detail::reliable_write(m_fd, reinterpret_cast<const unsigned char*>(m_buffer.data()), m_buffer.size());
+            m_written += m_buffer.size();
+            m_buffer.clear();
+        }
+    }
+
+    /// Flush and make sure the data is on disk.
+    void sync() {
+        flush();
+        if (::fsync(m_fd) != 0) {
+            throw std::system_error{errno, std::system_category(),
+                std::string{"Syncing output file '"} + m_filename + "' failed"};
+        }
+    }
+
+    void close() {
+        if (m_fd != -1) {
+            flush();
+            const int fd = m_fd;
+            m_fd = -1;
+            if (::close(fd) != 0) {
+                throw std::system_error{errno, std::system_category(),
+                    std::string{"Closing output file '"} + m_filename + "' failed"};
+            }
+        }
+    }
+
+}; // class OutputFile
+
+#endif // OUTPUT_FILE_HPP
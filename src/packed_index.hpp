@@ -0,0 +1,271 @@
+#ifndef PACKED_INDEX_HPP
+#define PACKED_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+// osmium
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/io/detail/read_write.hpp>
+#include <osmium/util/file.hpp>
+#include <osmium/util/memory_mapping.hpp>
+
+/**
+ * Store an offset in a packed slot of num_bytes bytes. Throws if the
+ * offset is not 8-byte aligned or too large.
+ */
+inline void pack_offset(unsigned char* slot, uint64_t offset, std::size_t num_bytes) {
+    if (offset % 8 != 0 || (num_bytes < 8 && (offset / 8 + 1) >> (num_bytes * 8) != 0)) {
+        throw std::runtime_error{"offset " + std::to_string(offset) + " can not be stored in packed index"};
+    }
+    const uint64_t packed = offset / 8 + 1;
+    std::memcpy(slot, &packed, num_bytes);
+}
+
+/**
+ * Read an offset from a packed slot of num_bytes bytes. Returns false if
+ * the slot is empty.
+ */
+inline bool unpack_offset(const unsigned char* slot, uint64_t& offset, std::size_t num_bytes) noexcept {
+    uint64_t packed = 0;
+    std::memcpy(&packed, slot, num_bytes);
+    if (packed == 0) {
+        return false;
+    }
+    offset = (packed - 1) * 8;
+    return true;
+}
+
+/*
+ * Dense offset index storing each offset in 4 or 5 bytes instead of 8.
+ * All OSM objects in the data file start at 8-byte aligned offsets, so we
+ * store offset/8 + 1 (0 marks an empty slot). With 5 bytes this covers data
+ * files of up to 8 TB, with 4 bytes up to 32 GB.
+ *
+ * The values are stored in host byte order like all other index files.
+ */
+template <typename TId, typename TValue, std::size_t TBytes>
+class PackedDenseArray : public osmium::index::map::Map<TId, TValue> {
+
+    static_assert(TBytes >= 4 && TBytes <= 8, "TBytes must be between 4 and 8");
+    static_assert(std::is_integral<TValue>::value, "PackedDenseArray can only store integer offsets");
+
+    // grow the mapping by this many slots at a time
+    static constexpr const std::size_t grow_size = 1024 * 1024;
+
+    osmium::util::MemoryMapping m_mapping;
+    std::size_t m_size;
+
+    unsigned char* slot(const TId id) const noexcept {
+        return m_mapping.template get_addr<unsigned char>() + id * TBytes;
+    }
+
+    std::size_t capacity() const noexcept {
+        return m_mapping.size() / TBytes;
+    }
+
+public:
+
+    /// Create index in anonymous memory.
+    PackedDenseArray() :
+        m_mapping(grow_size * TBytes),
+        m_size(0) {
+    }
+
+    /// Create index backed by the file fd, reusing any data in it.
+    explicit PackedDenseArray(const int fd) :
+        m_mapping(std::max(osmium::util::file_size(fd), TBytes), osmium::util::MemoryMapping::mapping_mode::write_shared, fd),
+        m_size(osmium::util::file_size(fd) / TBytes) {
+    }
+
+    ~PackedDenseArray() noexcept override = default;
+
+    void reserve(const std::size_t size) override {
+        if (size > capacity()) {
+            m_mapping.resize(size * TBytes);
+        }
+    }
+
+    void set(const TId id, const TValue value) override {
+        if (id >= capacity()) {
+            reserve(std::max(std::size_t(id) + 1, capacity() + grow_size));
+        }
+        pack_offset(slot(id), static_cast<uint64_t>(value), TBytes);
+        if (id >= m_size) {
+            m_size = id + 1;
+        }
+    }
+
+    /**
+     * Look up the id. Returns false if it is not in the index.
+     */
+    bool find(const TId id, TValue& value) const noexcept {
+        if (id >= m_size) {
+            return false;
+        }
+        uint64_t offset;
+        if (!unpack_offset(slot(id), offset, TBytes)) {
+            return false;
+        }
+        value = static_cast<TValue>(offset);
+        return true;
+    }
+
+    TValue get(const TId id) const override {
+        TValue value;
+        if (!find(id, value)) {
+            throw osmium::not_found{id};
+        }
+        return value;
+    }
+
+    TValue get_noexcept(const TId id) const noexcept override {
+        TValue value;
+        if (!find(id, value)) {
+            return osmium::index::empty_value<TValue>();
+        }
+        return value;
+    }
+
+    std::size_t size() const override {
+        return m_size;
+    }
+
+    std::size_t used_memory() const override {
+        return m_mapping.size();
+    }
+
+    void clear() override {
+        std::memset(slot(0), 0, m_size * TBytes);
+        m_size = 0;
+    }
+
+    void dump_as_array(const int fd) override {
+        osmium::io::detail::reliable_write(fd, slot(0), m_size * TBytes);
+    }
+
+    void dump_as_list(const int fd) override {
+        std::vector<std::pair<TId, TValue>> list;
+        list.reserve(grow_size);
+        for (TId id = 0; id < m_size; ++id) {
+            TValue value;
+            if (find(id, value)) {
+                list.emplace_back(id, value);
+            }
+            if (list.size() == grow_size || (id + 1 == m_size && !list.empty())) {
+                osmium::io::detail::reliable_write(fd, reinterpret_cast<const unsigned char*>(list.data()), list.size() * sizeof(list[0]));
+                list.clear();
+            }
+        }
+    }
+
+}; // class PackedDenseArray
+
+template <typename TId, typename TValue>
+class Packed40DenseMemArray : public PackedDenseArray<TId, TValue, 5> {
+}; // class Packed40DenseMemArray
+
+template <typename TId, typename TValue>
+class Packed40DenseFileArray : public PackedDenseArray<TId, TValue, 5> {
+
+public:
+
+    Packed40DenseFileArray() = default;
+
+    explicit Packed40DenseFileArray(const int fd) :
+        PackedDenseArray<TId, TValue, 5>(fd) {
+    }
+
+}; // class Packed40DenseFileArray
+
+template <typename TId, typename TValue>
+class Packed32DenseMemArray : public PackedDenseArray<TId, TValue, 4> {
+}; // class Packed32DenseMemArray
+
+template <typename TId, typename TValue>
+class Packed32DenseFileArray : public PackedDenseArray<TId, TValue, 4> {
+
+public:
+
+    Packed32DenseFileArray() = default;
+
+    explicit Packed32DenseFileArray(const int fd) :
+        PackedDenseArray<TId, TValue, 4>(fd) {
+    }
+
+}; // class Packed32DenseFileArray
+
+namespace osmium {
+
+    namespace index {
+
+        namespace detail {
+
+            inline int open_packed_index_file(const std::vector<std::string>& config) {
+                const int fd = ::open(config[1].c_str(), O_CREAT | O_RDWR, 0644);
+                if (fd == -1) {
+                    throw std::system_error{errno, std::system_category(),
+                        std::string{"can't open file '"} + config[1] + "'"};
+                }
+                return fd;
+            }
+
+            template <typename TId, typename TValue>
+            struct create_map<TId, TValue, Packed40DenseFileArray> {
+                Packed40DenseFileArray<TId, TValue>* operator()(const std::vector<std::string>& config) {
+                    if (config.size() == 1) {
+                        return new Packed40DenseFileArray<TId, TValue>();
+                    }
+                    return new Packed40DenseFileArray<TId, TValue>(open_packed_index_file(config));
+                }
+            };
+
+            template <typename TId, typename TValue>
+            struct create_map<TId, TValue, Packed32DenseFileArray> {
+                Packed32DenseFileArray<TId, TValue>* operator()(const std::vector<std::string>& config) {
+                    if (config.size() == 1) {
+                        return new Packed32DenseFileArray<TId, TValue>();
+                    }
+                    return new Packed32DenseFileArray<TId, TValue>(open_packed_index_file(config));
+                }
+            };
+
+        } // namespace detail
+
+    } // namespace index
+
+} // namespace osmium
+
+#endif // PACKED_INDEX_HPP
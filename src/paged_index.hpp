@@ -0,0 +1,215 @@
+#ifndef PAGED_INDEX_HPP
+#define PAGED_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// osmium
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * Two-level dense index: The ID space is split into pages of a fixed
+ * number of slots. Only pages with at least one non-empty slot are stored.
+ * A directory with one presence bit per page and the number of stored
+ * pages before each 64-bit word of the bitmap finds the stored page in
+ * O(1).
+ *
+ * File layout: header, directory, padding to a 4k boundary, stored pages.
+ */
+
+namespace detail {
+
+    constexpr const uint64_t paged_magic = 0x3149475042444f45ULL; // "EODBPGI1"
+
+    constexpr const std::size_t paged_alignment = 4096;
+
+    struct paged_header {
+        uint64_t magic;
+        uint64_t page_bits;
+        uint64_t num_pages;
+        uint64_t num_stored_pages;
+    };
+
+    struct paged_directory_entry {
+        uint64_t present;
+        uint64_t rank;
+    };
+
+    inline std::size_t paged_data_offset(uint64_t num_pages) noexcept {
+        const std::size_t size = sizeof(paged_header) + ((num_pages + 63) / 64) * sizeof(paged_directory_entry);
+        return (size + paged_alignment - 1) / paged_alignment * paged_alignment;
+    }
+
+} // namespace detail
+
+/**
+ * Convert a dense index file (as written by dump_as_array) into a paged
+ * index file.
+ */
+template <typename TValue>
+void write_paged_index(const std::string& dense_filename, const std::string& filename, uint64_t page_bits = 12) {
+    MappedFile mf{dense_filename};
+    const TValue* values = reinterpret_cast<const TValue*>(mf.data());
+    const std::size_t size = mf.size() / sizeof(TValue);
+    const std::size_t page_size = std::size_t(1) << page_bits;
+
+    detail::paged_header header{detail::paged_magic, page_bits, (size + page_size - 1) / page_size, 0};
+    std::vector<detail::paged_directory_entry> directory((header.num_pages + 63) / 64, detail::paged_directory_entry{0, 0});
+
+    for (uint64_t page = 0; page < header.num_pages; ++page) {
+        const std::size_t end = std::min(size, (page + 1) * page_size);
+        for (std::size_t i = page * page_size; i < end; ++i) {
+            if (values[i] != TValue{}) {
+                directory[page / 64].present |= uint64_t(1) << (page % 64);
+                ++header.num_stored_pages;
+                break;
+            }
+        }
+    }
+
+    uint64_t rank = 0;
+    for (auto& entry : directory) {
+        entry.rank = rank;
+        rank += __builtin_popcountll(entry.present);
+    }
+
+    OutputFile file{filename};
+    file.write_value(header);
+    file.write(directory.data(), directory.size() * sizeof(detail::paged_directory_entry));
+    const std::string padding(detail::paged_data_offset(header.num_pages) - file.size(), '\0');
+    file.write(padding.data(), padding.size());
+
+    const std::vector<TValue> empty_page(page_size, TValue{});
+    for (uint64_t page = 0; page < header.num_pages; ++page) {
+        if (!(directory[page / 64].present & (uint64_t(1) << (page % 64)))) {
+            continue;
+        }
+        const std::size_t begin = page * page_size;
+        const std::size_t count = std::min(size - begin, page_size);
+        file.write(values + begin, count * sizeof(TValue));
+        // the last page might be short
+        file.write(empty_page.data(), (page_size - count) * sizeof(TValue));
+    }
+    file.close();
+
+    mf.close();
+}
+
+template <typename TValue>
+class PagedIndex {
+
+    std::unique_ptr<MappedFile> m_file;
+    const detail::paged_header* m_header;
+    const detail::paged_directory_entry* m_directory;
+    const TValue* m_pages;
+    uint64_t m_page_mask;
+
+    const TValue* find_page(uint64_t page) const noexcept {
+        if (page >= m_header->num_pages) {
+            return nullptr;
+        }
+        const auto& entry = m_directory[page / 64];
+        const uint64_t bit = uint64_t(1) << (page % 64);
+        if (!(entry.present & bit)) {
+            return nullptr;
+        }
+        const uint64_t n = entry.rank + __builtin_popcountll(entry.present & (bit - 1));
+        return m_pages + (n << m_header->page_bits);
+    }
+
+public:
+
+    explicit PagedIndex(const std::string& filename) :
+        m_file(new MappedFile{filename}),
+        m_header(reinterpret_cast<const detail::paged_header*>(m_file->data())),
+        m_directory(reinterpret_cast<const detail::paged_directory_entry*>(m_file->data() + sizeof(detail::paged_header))),
+        m_pages(nullptr),
+        m_page_mask(0) {
+        if (m_file->size() < sizeof(detail::paged_header) ||
+            m_header->magic != detail::paged_magic ||
+            m_file->size() != detail::paged_data_offset(m_header->num_pages) + (m_header->num_stored_pages << m_header->page_bits) * sizeof(TValue)) {
+            throw std::runtime_error{std::string{"Invalid paged index file '"} + filename + "'"};
+        }
+        m_pages = reinterpret_cast<const TValue*>(m_file->data() + detail::paged_data_offset(m_header->num_pages));
+        m_page_mask = (uint64_t(1) << m_header->page_bits) - 1;
+    }
+
+    /// Size of the ID space covered by this index.
+    std::size_t size() const noexcept {
+        return m_header->num_pages << m_header->page_bits;
+    }
+
+    /// Number of pages actually stored.
+    std::size_t stored_pages() const noexcept {
+        return m_header->num_stored_pages;
+    }
+
+    /**
+     * Look up the id. Returns false if it is not in the index.
+     */
+    bool get(osmium::unsigned_object_id_type id, TValue& value) const noexcept {
+        const TValue* page = find_page(id >> m_header->page_bits);
+        if (!page || page[id & m_page_mask] == TValue{}) {
+            return false;
+        }
+        value = page[id & m_page_mask];
+        return true;
+    }
+
+    /**
+     * Call func(id, value) for all non-empty slots in ID order. Pages
+     * that are not stored are skipped without looking at them.
+     */
+    template <typename TFunc>
+    void for_each(TFunc&& func) const {
+        const std::size_t page_size = std::size_t(1) << m_header->page_bits;
+        const TValue* page = m_pages;
+        for (uint64_t word = 0; word < (m_header->num_pages + 63) / 64; ++word) {
+            uint64_t present = m_directory[word].present;
+            while (present) {
+                const uint64_t first_id = (word * 64 + __builtin_ctzll(present)) << m_header->page_bits;
+                for (std::size_t i = 0; i < page_size; ++i) {
+                    if (page[i] != TValue{}) {
+                        func(osmium::unsigned_object_id_type(first_id + i), page[i]);
+                    }
+                }
+                page += page_size;
+                present &= present - 1;
+            }
+        }
+    }
+
+}; // class PagedIndex
+
+#endif // PAGED_INDEX_HPP
@@ -0,0 +1,239 @@
+#ifndef RELATION_MAPS_HPP
+#define RELATION_MAPS_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "learned_index.hpp"
+#include "membership_filter.hpp"
+#include "output_file.hpp"
+
+/**
+ * Builds the node2way, node2relation, way2relation, and relation2relation
+ * maps with several threads. The ways and relations of each buffer are
+ * split between the threads, each thread adds the map entries into its
+ * own shard of each map. At the end each thread sorts its shards, then
+ * the sorted shards of each map are merged into the map file, all four
+ * maps at the same time.
+ */
+class RelationMapsBuilder {
+
+public:
+
+    static constexpr const unsigned int num_maps = 4;
+
+    static const char* map_name(unsigned int n) noexcept {
+        static const char* names[num_maps] = {"node2way", "node2relation", "way2relation", "relation2relation"};
+        return names[n];
+    }
+
+private:
+
+    typedef std::pair<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> element_type;
+
+    struct shard {
+        std::vector<element_type> maps[num_maps];
+    };
+
+    std::vector<shard> m_shards;
+    std::vector<const osmium::OSMObject*> m_objects;
+    std::vector<std::future<void>> m_tasks;
+
+    static void add_object(shard& s, const osmium::OSMObject& object) {
+        if (object.type() == osmium::item_type::way) {
+            const auto& way = static_cast<const osmium::Way&>(object);
+            for (const auto& node_ref : way.nodes()) {
+                s.maps[0].emplace_back(node_ref.positive_ref(), way.positive_id());
+            }
+            return;
+        }
+
+        const auto& relation = static_cast<const osmium::Relation&>(object);
+        for (const auto& member : relation.members()) {
+            switch (member.type()) {
+                case osmium::item_type::node:
+                    s.maps[1].emplace_back(member.positive_ref(), relation.positive_id());
+                    break;
+                case osmium::item_type::way:
+                    s.maps[2].emplace_back(member.positive_ref(), relation.positive_id());
+                    break;
+                case osmium::item_type::relation:
+                    s.maps[3].emplace_back(member.positive_ref(), relation.positive_id());
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    /// Merge the sorted shards of map n into the file.
+    void write_map(const std::string& filename, unsigned int n) {
+        typedef std::pair<element_type, std::size_t> queue_element; // element, shard
+        std::priority_queue<queue_element, std::vector<queue_element>, std::greater<queue_element>> queue;
+        std::vector<std::size_t> positions(m_shards.size());
+
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            if (!m_shards[i].maps[n].empty()) {
+                queue.emplace(m_shards[i].maps[n].front(), i);
+            }
+        }
+
+        OutputFile file{filename};
+        while (!queue.empty()) {
+            const auto top = queue.top();
+            queue.pop();
+            file.write_value(top.first);
+            const auto& map = m_shards[top.second].maps[n];
+            if (++positions[top.second] < map.size()) {
+                queue.emplace(map[positions[top.second]], top.second);
+            }
+        }
+        file.close();
+
+        for (auto& s : m_shards) {
+            std::vector<element_type>{}.swap(s.maps[n]);
+        }
+
+        write_membership_filter(filename);
+        write_learned_index(filename);
+    }
+
+public:
+
+    explicit RelationMapsBuilder(unsigned int num_threads) :
+        m_shards(std::max(1u, num_threads)) {
+    }
+
+    ~RelationMapsBuilder() noexcept {
+        for (auto& task : m_tasks) {
+            if (task.valid()) {
+                task.wait();
+            }
+        }
+    }
+
+    RelationMapsBuilder(const RelationMapsBuilder&) = delete;
+    RelationMapsBuilder& operator=(const RelationMapsBuilder&) = delete;
+
+    /**
+     * Start adding the map entries for all ways and relations in the
+     * buffer in the background. The buffer must not be changed or
+     * destroyed before wait() has been called.
+     */
+    void start(const osmium::memory::Buffer& buffer) {
+        start(buffer, [](const osmium::OSMObject& /*object*/) {
+            return true;
+        });
+    }
+
+    /**
+     * Like start(), but only add the ways and relations for which
+     * keep(object) returns true (called in this thread).
+     */
+    template <typename TFilter>
+    void start(const osmium::memory::Buffer& buffer, TFilter&& keep) {
+        wait();
+
+        m_objects.clear();
+        for (const auto& item : buffer) {
+            if (item.type() == osmium::item_type::way || item.type() == osmium::item_type::relation) {
+                const auto& object = static_cast<const osmium::OSMObject&>(item);
+                if (keep(object)) {
+                    m_objects.push_back(&object);
+                }
+            }
+        }
+
+        const std::size_t slice_size = (m_objects.size() + m_shards.size() - 1) / m_shards.size();
+        for (std::size_t i = 0; i < m_shards.size(); ++i) {
+            const std::size_t first = std::min(m_objects.size(), i * slice_size);
+            const std::size_t last = std::min(m_objects.size(), first + slice_size);
+            if (first == last) {
+                break;
+            }
+            m_tasks.push_back(std::async(std::launch::async, [this, i, first, last]() {
+                for (std::size_t n = first; n < last; ++n) {
+                    add_object(m_shards[i], *m_objects[n]);
+                }
+            }));
+        }
+    }
+
+    /// Wait until the entries of the last buffer have been added.
+    void wait() {
+        for (auto& task : m_tasks) {
+            task.get();
+        }
+        m_tasks.clear();
+    }
+
+    /**
+     * Sort the shards (one thread per shard) and write all map files (one
+     * thread per map) with their filters and models.
+     */
+    void write(const std::string& database) {
+        wait();
+
+        std::vector<std::future<void>> tasks;
+        for (auto& s : m_shards) {
+            tasks.push_back(std::async(std::launch::async, [&s]() {
+                for (auto& map : s.maps) {
+                    std::sort(map.begin(), map.end());
+                }
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+
+        tasks.clear();
+        for (unsigned int n = 0; n < num_maps; ++n) {
+            tasks.push_back(std::async(std::launch::async, [this, &database, n]() {
+                write_map(::map_name(database, map_name(n)), n);
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+
+}; // class RelationMapsBuilder
+
+#endif // RELATION_MAPS_HPP
@@ -0,0 +1,167 @@
+#ifndef REPLICATION_HPP
+#define REPLICATION_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/io/any_input.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/osm/object_comparisons.hpp>
+
+/*
+ * Reading a local copy of an OSM replication directory for eodb_update.
+ *
+ * The directory contains the file "state.txt" with the newest sequence
+ * number and the change files in the usual layout: sequence number
+ * 1234567 is in "001/234/567.osc.gz". Consecutive change files are merged
+ * into batches. Each batch is read into one buffer in which the objects
+ * are sorted by type, ID, and version and only the newest version of each
+ * object is kept, so it can be applied to the database in one go.
+ */
+
+/**
+ * Read the sequence number from a replication state file.
+ */
+inline int64_t read_replication_state(const std::string& filename) {
+    std::ifstream file{filename};
+    if (!file) {
+        throw std::runtime_error{"Can't open replication state file '" + filename + "'"};
+    }
+
+    const std::string key{"sequenceNumber="};
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.size(), key) == 0) {
+            return std::stoll(line.substr(key.size()));
+        }
+    }
+
+    throw std::runtime_error{"No sequenceNumber in replication state file '" + filename + "'"};
+}
+
+inline std::string replication_file_name(const std::string& directory, int64_t sequence) {
+    char path[16];
+    std::snprintf(path, sizeof(path), "%03d/%03d/%03d", int(sequence / 1000000), int(sequence / 1000 % 1000), int(sequence % 1000));
+    return directory + "/" + path + ".osc.gz";
+}
+
+/**
+ * A range of consecutive change files [first, last] applied together.
+ */
+struct ChangeBatch {
+
+    int64_t first;
+    int64_t last;
+    std::vector<std::string> filenames;
+
+}; // struct ChangeBatch
+
+/**
+ * Split the change files between sequence numbers first and last (both
+ * inclusive) into batches. Files are added to a batch until their total
+ * (compressed) size reaches max_size. Files for which skip() returns true
+ * end the current batch and are not included.
+ */
+template <typename TSkip>
+std::vector<ChangeBatch> plan_change_batches(const std::string& directory, int64_t first, int64_t last, std::size_t max_size, TSkip&& skip) {
+    std::vector<ChangeBatch> batches;
+    std::size_t size = max_size;
+
+    for (int64_t sequence = first; sequence <= last; ++sequence) {
+        const std::string filename{replication_file_name(directory, sequence)};
+        struct stat s;
+        if (::stat(filename.c_str(), &s) != 0) {
+            throw std::system_error{errno, std::system_category(), "Missing change file '" + filename + "'"};
+        }
+        if (skip(filename)) {
+            size = max_size;
+            continue;
+        }
+        if (size >= max_size) {
+            batches.push_back(ChangeBatch{sequence, sequence, {}});
+            size = 0;
+        }
+        batches.back().last = sequence;
+        batches.back().filenames.push_back(filename);
+        size += s.st_size;
+    }
+
+    return batches;
+}
+
+/**
+ * Read all change files of a batch and return one buffer with the newest
+ * version of each object in the batch, sorted by type and ID.
+ */
+inline osmium::memory::Buffer read_change_batch(const ChangeBatch& batch) {
+    std::vector<osmium::memory::Buffer> buffers;
+    std::vector<const osmium::OSMObject*> objects;
+
+    for (const auto& filename : batch.filenames) {
+        osmium::io::Reader reader{filename};
+        while (osmium::memory::Buffer buffer = reader.read()) {
+            for (auto it = buffer.begin<osmium::OSMObject>(); it != buffer.end<osmium::OSMObject>(); ++it) {
+                objects.push_back(&*it);
+            }
+            buffers.push_back(std::move(buffer));
+        }
+        reader.close();
+    }
+
+    // stable, so that of two copies of the same version the later wins
+    std::stable_sort(objects.begin(), objects.end(), osmium::object_order_type_id_version{});
+
+    std::size_t size = 0;
+    for (const auto& buffer : buffers) {
+        size += buffer.committed();
+    }
+
+    osmium::memory::Buffer out{std::max(size, std::size_t(1024 * 1024)), osmium::memory::Buffer::auto_grow::yes};
+    for (auto it = objects.begin(); it != objects.end(); ++it) {
+        const auto next = std::next(it);
+        if (next != objects.end() && (*next)->type() == (*it)->type() && (*next)->id() == (*it)->id()) {
+            continue; // there is a newer version in this batch
+        }
+        out.add_item(**it);
+        out.commit();
+    }
+
+    return out;
+}
+
+#endif // REPLICATION_HPP
@@ -0,0 +1,541 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+// osmium
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+#include "packed_index.hpp"
+
+/*
+ * Snapshots for updatable (dense and packed) offset indexes.
+ *
+ * eodb_update never changes index files in place. Changed index pages are
+ * written copy-on-write into a delta file per index, and a new generation
+ * is published by atomically renaming a new manifest file ("generation")
+ * into place. The manifest names the base and delta file for each index and
+ * the size of the data file. Readers read the manifest once when they open
+ * the database and only ever see one consistent generation. Data appended
+ * to data.osr later is never referenced by the indexes of that generation.
+ *
+ * The delta file is cumulative, it contains all pages changed since the
+ * base file was written. When it gets too large, a new base file is
+ * written instead. Files of a generation are only removed when the
+ * generation after the next one is published, so that readers that have
+ * just read the manifest can still open them.
+ *
+ * The maps and the way geometry index are handled the same way, but with
+ * their own delta format (see map_delta.hpp and way_geometry.hpp).
+ *
+ * Without a manifest file the database is in generation 0: the index
+ * files as written by eodb_create and the whole data file.
+ */
+
+namespace detail {
+
+    constexpr const uint64_t delta_magic = 0x31544c4442444f45ULL; // "EODBDLT1"
+
+    constexpr const std::size_t delta_alignment = 4096;
+
+    struct delta_header {
+        uint64_t magic;
+        uint64_t element_size;
+        uint64_t num_pages;
+        uint64_t num_slots;
+    };
+
+    inline std::size_t delta_data_offset(uint64_t num_pages) noexcept {
+        const std::size_t size = sizeof(delta_header) + num_pages * sizeof(uint64_t);
+        return (size + delta_alignment - 1) / delta_alignment * delta_alignment;
+    }
+
+} // namespace detail
+
+constexpr const std::size_t snapshot_page_slots = 4096;
+
+inline std::string manifest_name(const std::string& database) {
+    return database + "/generation";
+}
+
+/// Size of one slot in index files of this format, 0 if not updatable.
+inline std::size_t offset_element_size(index_format format) noexcept {
+    switch (format) {
+        case index_format::dense:
+            return sizeof(uint64_t);
+        case index_format::packed32:
+            return 4;
+        case index_format::packed40:
+            return 5;
+        default:
+            break;
+    }
+    return 0;
+}
+
+class SnapshotManifest {
+
+public:
+
+    struct index_files {
+        index_format format;
+        std::string base;  // file names relative to database directory
+        std::string delta; // empty if there is no delta (yet)
+    };
+
+    /// Sorted list files (maps, way geometry index) changed by updates.
+    struct delta_files {
+        std::string base;  // empty if there is none
+        std::string delta; // empty if there is no delta (yet)
+    };
+
+    uint64_t generation = 0;
+    uint64_t data_size = 0;
+    std::map<std::string, index_files> indexes;
+    std::map<std::string, delta_files> maps;
+    delta_files way_geometries;
+
+    // last replication sequence number applied (-1 if none)
+    int64_t sequence = -1;
+
+    // files of the previous generation that are not used any more
+    std::vector<std::string> retired;
+
+    /**
+     * Read the manifest. Returns false if there is none (generation 0 of
+     * a database created before eodb_create wrote a manifest).
+     */
+    bool read(const std::string& database) {
+        std::ifstream file{manifest_name(database)};
+        if (!file) {
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream in{line};
+            std::string keyword;
+            in >> keyword;
+            if (keyword == "generation") {
+                in >> generation;
+            } else if (keyword == "data_size") {
+                in >> data_size;
+            } else if (keyword == "sequence") {
+                in >> sequence;
+            } else if (keyword == "index") {
+                std::string name;
+                std::string format;
+                index_files files{index_format::none, "", ""};
+                in >> name >> format >> files.base >> files.delta;
+                for (const auto f : {index_format::dense, index_format::packed32, index_format::packed40}) {
+                    if (format == index_format_name(f)) {
+                        files.format = f;
+                    }
+                }
+                if (files.format == index_format::none) {
+                    throw std::runtime_error{"Unknown index format '" + format + "' in manifest"};
+                }
+                if (files.delta == "-") {
+                    files.delta.clear();
+                }
+                indexes[name] = files;
+            } else if (keyword == "map" || keyword == "geometry") {
+                std::string name{keyword};
+                if (keyword == "map") {
+                    in >> name;
+                }
+                delta_files files;
+                in >> files.base >> files.delta;
+                if (files.base == "-") {
+                    files.base.clear();
+                }
+                if (files.delta == "-") {
+                    files.delta.clear();
+                }
+                if (keyword == "map") {
+                    maps[name] = files;
+                } else {
+                    way_geometries = files;
+                }
+            } else if (keyword == "retired") {
+                std::string name;
+                in >> name;
+                retired.push_back(name);
+            } else if (!keyword.empty()) {
+                throw std::runtime_error{"Unknown keyword '" + keyword + "' in manifest"};
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Atomically replace the manifest with this one.
+     */
+    void write(const std::string& database) const {
+        const std::string filename{manifest_name(database)};
+        const std::string tmp_filename{filename + ".tmp"};
+
+        std::ostringstream out;
+        out << "generation " << generation << '\n';
+        out << "data_size " << data_size << '\n';
+        if (sequence >= 0) {
+            out << "sequence " << sequence << '\n';
+        }
+        for (const auto& index : indexes) {
+            out << "index " << index.first << ' ' << index_format_name(index.second.format) << ' '
+                << index.second.base << ' ' << (index.second.delta.empty() ? "-" : index.second.delta) << '\n';
+        }
+        const auto file_or_dash = [](const std::string& name) {
+            return name.empty() ? std::string{"-"} : name;
+        };
+        for (const auto& map : maps) {
+            out << "map " << map.first << ' ' << file_or_dash(map.second.base) << ' ' << file_or_dash(map.second.delta) << '\n';
+        }
+        if (!way_geometries.base.empty() || !way_geometries.delta.empty()) {
+            out << "geometry " << file_or_dash(way_geometries.base) << ' ' << file_or_dash(way_geometries.delta) << '\n';
+        }
+        for (const auto& name : retired) {
+            out << "retired " << name << '\n';
+        }
+        const std::string data{out.str()};
+
+        OutputFile file{tmp_filename};
+        file.write(data.data(), data.size());
+        file.sync();
+        file.close();
+
+        if (::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            throw std::system_error{errno, std::system_category(), "Renaming manifest failed"};
+        }
+
+        const int dir_fd = ::open(database.c_str(), O_RDONLY);
+        if (dir_fd != -1) {
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+
+}; // class SnapshotManifest
+
+/**
+ * Read access to one offset index (base file plus delta) of a snapshot.
+ */
+class SnapshotIndex {
+
+    std::unique_ptr<MappedFile> m_base;
+    std::unique_ptr<MappedFile> m_delta;
+    std::size_t m_element_size;
+    std::size_t m_page_size;
+    std::size_t m_num_slots;
+    const uint64_t* m_pages = nullptr;
+    const uint64_t* m_pages_end = nullptr;
+    const unsigned char* m_page_data = nullptr;
+
+public:
+
+    SnapshotIndex(const std::string& database, const SnapshotManifest::index_files& files) :
+        m_base(new MappedFile{database + "/" + files.base}),
+        m_element_size(offset_element_size(files.format)),
+        m_page_size(snapshot_page_slots * m_element_size),
+        m_num_slots(m_base->size() / m_element_size) {
+        if (files.delta.empty()) {
+            return;
+        }
+
+        m_delta.reset(new MappedFile{database + "/" + files.delta});
+        const auto* header = reinterpret_cast<const detail::delta_header*>(m_delta->data());
+        if (m_delta->size() < sizeof(detail::delta_header) ||
+            header->magic != detail::delta_magic ||
+            header->element_size != m_element_size ||
+            m_delta->size() != detail::delta_data_offset(header->num_pages) + header->num_pages * m_page_size) {
+            throw std::runtime_error{"Invalid delta file '" + files.delta + "'"};
+        }
+        m_num_slots = std::max(m_num_slots, std::size_t(header->num_slots));
+        m_pages = reinterpret_cast<const uint64_t*>(m_delta->data() + sizeof(detail::delta_header));
+        m_pages_end = m_pages + header->num_pages;
+        m_page_data = m_delta->data() + detail::delta_data_offset(header->num_pages);
+    }
+
+    std::size_t element_size() const noexcept {
+        return m_element_size;
+    }
+
+    /// Read a slot. Returns false if it is empty.
+    bool decode(const unsigned char* slot, std::size_t& value) const noexcept {
+        uint64_t offset = 0;
+        if (m_element_size == sizeof(uint64_t)) {
+            std::memcpy(&offset, slot, sizeof(uint64_t));
+        } else if (!unpack_offset(slot, offset, m_element_size)) {
+            return false;
+        }
+        value = offset;
+        return offset != 0 || m_element_size != sizeof(uint64_t);
+    }
+
+    /// Write a slot.
+    void encode(unsigned char* slot, std::size_t value) const {
+        if (m_element_size == sizeof(uint64_t)) {
+            const uint64_t offset = value;
+            std::memcpy(slot, &offset, sizeof(uint64_t));
+        } else {
+            pack_offset(slot, value, m_element_size);
+        }
+    }
+
+    std::size_t size() const noexcept {
+        return m_num_slots;
+    }
+
+    /**
+     * Copy the contents of page into the buffer (which must have room for
+     * a whole page). Parts of the page not in any file are zeroed.
+     */
+    void copy_page(uint64_t page, unsigned char* buffer) const {
+        const auto it = std::lower_bound(m_pages, m_pages_end, page);
+        if (it != m_pages_end && *it == page) {
+            std::memcpy(buffer, m_page_data + (it - m_pages) * m_page_size, m_page_size);
+            return;
+        }
+
+        std::memset(buffer, 0, m_page_size);
+        const std::size_t begin = page * m_page_size;
+        if (begin < m_base->size()) {
+            std::memcpy(buffer, m_base->data() + begin, std::min(m_page_size, m_base->size() - begin));
+        }
+    }
+
+    /**
+     * Look up the id. Returns false if it is not in the index.
+     */
+    bool get(osmium::unsigned_object_id_type id, std::size_t& value) const noexcept {
+        if (id >= m_num_slots) {
+            return false;
+        }
+
+        const uint64_t page = id / snapshot_page_slots;
+        const auto it = std::lower_bound(m_pages, m_pages_end, page);
+        if (it != m_pages_end && *it == page) {
+            return decode(m_page_data + (it - m_pages) * m_page_size + (id % snapshot_page_slots) * m_element_size, value);
+        }
+
+        const std::size_t pos = id * m_element_size;
+        if (pos + m_element_size > m_base->size()) {
+            return false;
+        }
+        return decode(m_base->data() + pos, value);
+    }
+
+    /**
+     * Call func(id, value) for all ids in the index in order.
+     */
+    template <typename TFunc>
+    void for_each(TFunc&& func) const {
+        for (std::size_t id = 0; id < m_num_slots; ++id) {
+            std::size_t value;
+            if (get(id, value)) {
+                func(osmium::unsigned_object_id_type(id), value);
+            }
+        }
+    }
+
+}; // class SnapshotIndex
+
+/**
+ * Open the index with this name from the snapshot described by the
+ * manifest. Returns nullptr if the index is not in the manifest.
+ */
+inline std::unique_ptr<SnapshotIndex> open_snapshot_index(const std::string& database, const SnapshotManifest& manifest, const std::string& name) {
+    std::unique_ptr<SnapshotIndex> index;
+    const auto it = manifest.indexes.find(name);
+    if (it != manifest.indexes.end()) {
+        index.reset(new SnapshotIndex{database, it->second});
+    }
+    return index;
+}
+
+/**
+ * Offset index used by eodb_update. Reads through to the current snapshot
+ * and keeps copies of all changed pages in memory until they are written
+ * into the delta file of the next generation.
+ */
+class SnapshotIndexWriter : public osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t> {
+
+    const std::string m_database;
+    SnapshotManifest::index_files m_files;
+    SnapshotIndex m_view;
+    std::map<uint64_t, std::vector<unsigned char>> m_dirty;
+    std::size_t m_num_slots;
+
+    std::vector<unsigned char>& page(uint64_t page_num) {
+        auto it = m_dirty.find(page_num);
+        if (it == m_dirty.end()) {
+            std::vector<unsigned char> data(snapshot_page_slots * m_view.element_size());
+            m_view.copy_page(page_num, data.data());
+            it = m_dirty.emplace(page_num, std::move(data)).first;
+        }
+        return it->second;
+    }
+
+public:
+
+    SnapshotIndexWriter(const std::string& database, const SnapshotManifest::index_files& files) :
+        m_database(database),
+        m_files(files),
+        m_view(database, files),
+        m_num_slots(m_view.size()) {
+    }
+
+    void set(const osmium::unsigned_object_id_type id, const std::size_t value) override {
+        m_view.encode(page(id / snapshot_page_slots).data() + (id % snapshot_page_slots) * m_view.element_size(), value);
+        m_num_slots = std::max(m_num_slots, std::size_t(id) + 1);
+    }
+
+    /**
+     * Look up the id in the changed pages or the current snapshot.
+     * Returns false if it is not in the index.
+     */
+    bool find(const osmium::unsigned_object_id_type id, std::size_t& value) const noexcept {
+        const auto it = m_dirty.find(id / snapshot_page_slots);
+        return (it == m_dirty.end()) ?
+            m_view.get(id, value) :
+            m_view.decode(it->second.data() + (id % snapshot_page_slots) * m_view.element_size(), value);
+    }
+
+    std::size_t get(const osmium::unsigned_object_id_type id) const override {
+        std::size_t value;
+        if (!find(id, value)) {
+            throw osmium::not_found{id};
+        }
+        return value;
+    }
+
+    std::size_t get_noexcept(const osmium::unsigned_object_id_type id) const noexcept override {
+        std::size_t value;
+        if (!find(id, value)) {
+            return osmium::index::empty_value<std::size_t>();
+        }
+        return value;
+    }
+
+    std::size_t size() const override {
+        return m_num_slots;
+    }
+
+    std::size_t used_memory() const override {
+        return m_dirty.size() * snapshot_page_slots * m_view.element_size();
+    }
+
+    void clear() override {
+        throw std::runtime_error{"Can not clear snapshot index"};
+    }
+
+    /**
+     * Write the files for index name in the next generation and return
+     * them. Usually this is a new delta file containing all pages of the
+     * old delta and all changed pages. If the delta would get larger than
+     * half of the base file, a new base file is written instead.
+     */
+    SnapshotManifest::index_files write_next(const std::string& name, uint64_t generation) const {
+        const std::size_t element_size = m_view.element_size();
+        const std::size_t page_size = snapshot_page_slots * element_size;
+        std::vector<unsigned char> buffer(page_size);
+
+        // pages changed now and pages from the old delta
+        std::vector<uint64_t> pages;
+        for (const auto& dirty : m_dirty) {
+            pages.push_back(dirty.first);
+        }
+        if (!m_files.delta.empty()) {
+            MappedFile old{m_database + "/" + m_files.delta};
+            const auto* header = reinterpret_cast<const detail::delta_header*>(old.data());
+            const auto* old_pages = reinterpret_cast<const uint64_t*>(old.data() + sizeof(detail::delta_header));
+            pages.insert(pages.end(), old_pages, old_pages + header->num_pages);
+            old.close();
+        }
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+        const auto write_page = [&](OutputFile& file, uint64_t p, std::size_t size) {
+            const auto it = m_dirty.find(p);
+            if (it != m_dirty.end()) {
+                file.write(it->second.data(), size);
+            } else {
+                m_view.copy_page(p, buffer.data());
+                file.write(buffer.data(), size);
+            }
+        };
+
+        if (pages.size() * page_size * 2 > m_num_slots * element_size) {
+            SnapshotManifest::index_files files{m_files.format, name + "." + index_format_name(m_files.format) + "." + std::to_string(generation) + ".idx", ""};
+            OutputFile file{m_database + "/" + files.base};
+            for (uint64_t p = 0; p * snapshot_page_slots < m_num_slots; ++p) {
+                write_page(file, p, std::min(snapshot_page_slots, m_num_slots - p * snapshot_page_slots) * element_size);
+            }
+            file.sync();
+            file.close();
+            return files;
+        }
+
+        SnapshotManifest::index_files files{m_files.format, m_files.base, name + ".delta." + std::to_string(generation)};
+        OutputFile file{m_database + "/" + files.delta};
+        const detail::delta_header header{detail::delta_magic, element_size, pages.size(), m_num_slots};
+        file.write_value(header);
+        file.write(pages.data(), pages.size() * sizeof(uint64_t));
+        const std::string padding(detail::delta_data_offset(pages.size()) - file.size(), '\0');
+        file.write(padding.data(), padding.size());
+        for (const auto p : pages) {
+            write_page(file, p, page_size);
+        }
+        file.sync();
+        file.close();
+
+        return files;
+    }
+
+}; // class SnapshotIndexWriter
+
+#endif // SNAPSHOT_HPP
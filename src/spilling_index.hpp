@@ -0,0 +1,266 @@
+#ifndef SPILLING_INDEX_HPP
+#define SPILLING_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+// osmium
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
+#include <osmium/io/detail/read_write.hpp>
+#include <osmium/osm/types.hpp>
+
+// eodb
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+class SpillingOffsetIndex;
+
+/**
+ * Memory budget shared by several SpillingOffsetIndexes. If the indexes
+ * together use more than the budget, the largest one is spilled to disk.
+ */
+class MemoryBudget {
+
+    std::size_t m_limit;
+    std::size_t m_used = 0;
+    std::vector<SpillingOffsetIndex*> m_indexes;
+
+public:
+
+    explicit MemoryBudget(std::size_t limit) noexcept :
+        m_limit(limit) {
+    }
+
+    void add_index(SpillingOffsetIndex* index) {
+        m_indexes.push_back(index);
+    }
+
+    /// Spill indexes until there is room for bytes more.
+    void make_room(std::size_t bytes);
+
+    void allocate(std::size_t bytes) noexcept {
+        m_used += bytes;
+    }
+
+    void release(std::size_t bytes) noexcept {
+        m_used -= bytes;
+    }
+
+}; // class MemoryBudget
+
+/**
+ * Offset index for eodb_create that keeps (id, offset) pairs in memory
+ * like the sparse_mem_array index, but within a memory budget. The pairs
+ * are kept in fixed size chunks, so growing the index never needs more
+ * memory than what is charged to the budget. If the budget is exhausted,
+ * the entries in memory are sorted and written as a run into a temporary
+ * file. dump_as_list() merges all runs and the entries still in memory.
+ */
+class SpillingOffsetIndex : public osmium::index::map::Map<osmium::unsigned_object_id_type, std::size_t> {
+
+public:
+
+    typedef std::pair<osmium::unsigned_object_id_type, std::size_t> element_type;
+
+private:
+
+    static constexpr const std::size_t chunk_elements = 64 * 1024;
+
+    typedef std::pair<const element_type*, const element_type*> range;
+
+    MemoryBudget& m_budget;
+    std::string m_run_prefix;
+    std::vector<std::vector<element_type>> m_chunks;
+    std::vector<std::string> m_runs;
+    std::size_t m_size = 0;
+
+    /// Merge the sorted ranges calling func for each element in order.
+    template <typename TFunc>
+    static void merge(std::vector<range>& ranges, TFunc&& func) {
+        typedef std::pair<element_type, std::size_t> queue_element; // element, range
+        std::priority_queue<queue_element, std::vector<queue_element>, std::greater<queue_element>> queue;
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            if (ranges[i].first != ranges[i].second) {
+                queue.emplace(*ranges[i].first++, i);
+            }
+        }
+
+        while (!queue.empty()) {
+            const auto top = queue.top();
+            queue.pop();
+            func(top.first);
+            auto& r = ranges[top.second];
+            if (r.first != r.second) {
+                queue.emplace(*r.first++, top.second);
+            }
+        }
+    }
+
+    void add_chunk_ranges(std::vector<range>& ranges) const {
+        for (const auto& chunk : m_chunks) {
+            ranges.emplace_back(chunk.data(), chunk.data() + chunk.size());
+        }
+    }
+
+    void free_chunks() noexcept {
+        m_budget.release(used_memory());
+        m_chunks.clear();
+    }
+
+public:
+
+    /// Runs are written to files named run_prefix + number.
+    SpillingOffsetIndex(MemoryBudget& budget, const std::string& run_prefix) :
+        m_budget(budget),
+        m_run_prefix(run_prefix) {
+        budget.add_index(this);
+    }
+
+    ~SpillingOffsetIndex() noexcept override {
+        remove_runs();
+    }
+
+    void set(const osmium::unsigned_object_id_type id, const std::size_t value) override {
+        if (m_chunks.empty() || m_chunks.back().size() == chunk_elements) {
+            // might spill this index
+            m_budget.make_room(chunk_elements * sizeof(element_type));
+            m_chunks.emplace_back();
+            m_chunks.back().reserve(chunk_elements);
+            m_budget.allocate(chunk_elements * sizeof(element_type));
+        }
+        m_chunks.back().emplace_back(id, value);
+        ++m_size;
+    }
+
+    std::size_t get(const osmium::unsigned_object_id_type id) const override {
+        throw osmium::not_found{id}; // write only
+    }
+
+    std::size_t get_noexcept(const osmium::unsigned_object_id_type /*id*/) const noexcept override {
+        return osmium::index::empty_value<std::size_t>(); // write only
+    }
+
+    std::size_t size() const override {
+        return m_size;
+    }
+
+    std::size_t used_memory() const override {
+        return m_chunks.size() * chunk_elements * sizeof(element_type);
+    }
+
+    void clear() override {
+        free_chunks();
+        remove_runs();
+        m_size = 0;
+    }
+
+    /// Sort each chunk, they are merged when written.
+    void sort() override {
+        for (auto& chunk : m_chunks) {
+            std::sort(chunk.begin(), chunk.end());
+        }
+    }
+
+    /// Write the elements in memory as sorted run and free the memory.
+    void spill() {
+        if (m_chunks.empty()) {
+            return;
+        }
+        sort();
+
+        std::vector<range> ranges;
+        add_chunk_ranges(ranges);
+
+        const std::string filename{m_run_prefix + std::to_string(m_runs.size())};
+        OutputFile file{filename};
+        m_runs.push_back(filename);
+        merge(ranges, [&file](const element_type& element) {
+            file.write_value(element);
+        });
+        file.close();
+
+        free_chunks();
+    }
+
+    /**
+     * Write all entries (sorted by id) into the file. The entries in
+     * memory must have been sorted with sort() before.
+     */
+    void dump_as_list(const int fd) override {
+        std::vector<std::unique_ptr<MappedFile>> runs;
+        std::vector<range> ranges;
+        for (const auto& filename : m_runs) {
+            runs.emplace_back(new MappedFile{filename});
+            const auto* first = reinterpret_cast<const element_type*>(runs.back()->data());
+            ranges.emplace_back(first, first + runs.back()->size() / sizeof(element_type));
+        }
+        add_chunk_ranges(ranges);
+
+        std::vector<element_type> buffer;
+        buffer.reserve(chunk_elements);
+        const auto flush = [&]() {
+            osmium::io::detail::reliable_write(fd, reinterpret_cast<const unsigned char*>(buffer.data()), buffer.size() * sizeof(element_type));
+            buffer.clear();
+        };
+
+        merge(ranges, [&](const element_type& element) {
+            buffer.push_back(element);
+            if (buffer.size() == chunk_elements) {
+                flush();
+            }
+        });
+        flush();
+    }
+
+    void remove_runs() noexcept {
+        for (const auto& filename : m_runs) {
+            std::remove(filename.c_str());
+        }
+        m_runs.clear();
+    }
+
+}; // class SpillingOffsetIndex
+
+inline void MemoryBudget::make_room(std::size_t bytes) {
+    while (m_used + bytes > m_limit) {
+        auto it = std::max_element(m_indexes.begin(), m_indexes.end(), [](const SpillingOffsetIndex* a, const SpillingOffsetIndex* b) {
+            return a->used_memory() < b->used_memory();
+        });
+        if (it == m_indexes.end() || (*it)->used_memory() == 0) {
+            return;
+        }
+        (*it)->spill();
+    }
+}
+
+#endif // SPILLING_INDEX_HPP
@@ -0,0 +1,530 @@
+#ifndef TAG_INDEX_HPP
+#define TAG_INDEX_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// protozero
+#include <protozero/varint.hpp>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/osm/item_type.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/tag.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+
+/*
+ * The tag index maps terms to posting lists of object IDs, one list for
+ * each object type. There are two kinds of terms: "KEY" matches all
+ * objects with that key, "KEY=VALUE" all objects with that tag.
+ *
+ * Files:
+ *
+ * tags.terms    - one TagIndexTerm for each term, sorted by term
+ * tags.strings  - \0-terminated term strings
+ * tags.postings - posting lists, sorted IDs as varint-encoded deltas
+ */
+
+struct TagIndexTerm {
+    uint64_t string_offset;
+    uint64_t posting_offset[3];
+    uint64_t posting_count[3];
+}; // struct TagIndexTerm
+
+/**
+ * Handler collecting the posting lists. Lists are kept delta encoded in
+ * memory while the input is read. Whenever they need more than the memory
+ * limit, all terms are written sorted by term as a run into a temporary
+ * file and the memory is freed. write() merges the runs into the index.
+ *
+ * Run records: varint term length, term, and for each object type the
+ * varint number of IDs, varint length of the list, and the list (sorted
+ * unique IDs, encoded as in tags.postings).
+ */
+class TagIndexBuilder : public osmium::handler::Handler {
+
+    struct posting_list {
+        std::string data;
+        osmium::unsigned_object_id_type last_id = 0;
+        uint64_t count = 0;
+        bool sorted = true;
+    };
+
+    // postings for node, way, and relation
+    struct term_postings {
+        posting_list lists[3];
+    };
+
+    // estimated memory used by the hash table for each term
+    static constexpr const std::size_t term_overhead = sizeof(std::string) + sizeof(term_postings) + 64;
+
+    // flush merged posting lists to the file after this many bytes
+    static constexpr const std::size_t flush_size = 1024 * 1024;
+
+    /// Read access to the records of a run.
+    struct run_cursor {
+        const char* data;
+        const char* end;
+        std::string term;
+        const char* lists[3];
+        std::size_t sizes[3];
+        uint64_t counts[3];
+
+        run_cursor(const char* first, const char* last) :
+            data(first),
+            end(last) {
+        }
+
+        /// Go to the next record, returns false at the end of the run.
+        bool next() {
+            if (data == end) {
+                return false;
+            }
+            const auto length = std::size_t(protozero::decode_varint(&data, end));
+            term.assign(data, length);
+            data += length;
+            for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+                counts[nwr] = protozero::decode_varint(&data, end);
+                sizes[nwr] = std::size_t(protozero::decode_varint(&data, end));
+                lists[nwr] = data;
+                data += sizes[nwr];
+            }
+            return true;
+        }
+    };
+
+    std::unordered_map<std::string, term_postings> m_terms;
+    std::string m_term;
+    std::string m_run_prefix;
+    std::size_t m_memory_limit;
+    std::size_t m_memory = 0;
+    std::vector<std::string> m_runs;
+
+    void add(const std::string& term, unsigned int nwr, osmium::unsigned_object_id_type id) {
+        auto it = m_terms.find(term);
+        if (it == m_terms.end()) {
+            it = m_terms.emplace(term, term_postings{}).first;
+            m_memory += term.size() + term_overhead;
+        }
+        posting_list& list = it->second.lists[nwr];
+        if (list.count > 0 && id <= list.last_id) {
+            if (id == list.last_id) {
+                return;
+            }
+            list.sorted = false;
+        }
+        const auto size = list.data.size();
+        protozero::write_varint(std::back_inserter(list.data), protozero::encode_zigzag64(int64_t(id - list.last_id)));
+        m_memory += list.data.size() - size;
+        list.last_id = id;
+        ++list.count;
+    }
+
+    void add_object(const osmium::OSMObject& object) {
+        const unsigned int nwr = osmium::item_type_to_nwr_index(object.type());
+        for (const auto& tag : object.tags()) {
+            m_term = tag.key();
+            add(m_term, nwr, object.positive_id());
+            m_term += '=';
+            m_term += tag.value();
+            add(m_term, nwr, object.positive_id());
+        }
+        if (m_memory > m_memory_limit) {
+            spill();
+        }
+    }
+
+    static std::vector<osmium::unsigned_object_id_type> decode(const posting_list& list) {
+        std::vector<osmium::unsigned_object_id_type> ids;
+        ids.reserve(list.count);
+
+        const char* data = list.data.data();
+        const char* end = data + list.data.size();
+        osmium::unsigned_object_id_type id = 0;
+        while (data != end) {
+            id += osmium::unsigned_object_id_type(protozero::decode_zigzag64(protozero::decode_varint(&data, end)));
+            ids.push_back(id);
+        }
+
+        if (!list.sorted) {
+            std::sort(ids.begin(), ids.end());
+            ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        }
+
+        return ids;
+    }
+
+    /// Write all terms in memory as sorted run and free the memory.
+    void spill() {
+        if (m_terms.empty()) {
+            return;
+        }
+
+        std::vector<const std::string*> terms;
+        terms.reserve(m_terms.size());
+        for (const auto& t : m_terms) {
+            terms.push_back(&t.first);
+        }
+        std::sort(terms.begin(), terms.end(), [](const std::string* lhs, const std::string* rhs) {
+            return *lhs < *rhs;
+        });
+
+        const std::string filename{m_run_prefix + std::to_string(m_runs.size())};
+        OutputFile file{filename};
+        m_runs.push_back(filename);
+
+        std::string record;
+        std::string encoded;
+        for (const std::string* term : terms) {
+            record.clear();
+            protozero::write_varint(std::back_inserter(record), term->size());
+            record += *term;
+
+            const posting_list* lists = m_terms[*term].lists;
+            for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+                const posting_list& list = lists[nwr];
+                uint64_t count = list.count;
+                if (!list.sorted) {
+                    const auto ids = decode(list);
+                    encoded.clear();
+                    osmium::unsigned_object_id_type last_id = 0;
+                    for (const auto id : ids) {
+                        protozero::write_varint(std::back_inserter(encoded), protozero::encode_zigzag64(int64_t(id - last_id)));
+                        last_id = id;
+                    }
+                    count = ids.size();
+                }
+                const std::string& data = list.sorted ? list.data : encoded;
+                protozero::write_varint(std::back_inserter(record), count);
+                protozero::write_varint(std::back_inserter(record), data.size());
+                record += data;
+            }
+            file.write(record.data(), record.size());
+        }
+        file.close();
+
+        m_terms.clear();
+        m_memory = 0;
+    }
+
+    /**
+     * Merge the posting lists of the object type from the runs whose
+     * cursors are at the same term into the file. Returns the number of
+     * IDs written.
+     */
+    static uint64_t merge_postings(const std::vector<run_cursor>& cursors, const std::vector<std::size_t>& current, unsigned int nwr, OutputFile& file) {
+        if (current.size() == 1) {
+            const run_cursor& cursor = cursors[current.front()];
+            file.write(cursor.lists[nwr], cursor.sizes[nwr]);
+            return cursor.counts[nwr];
+        }
+
+        struct list_state {
+            const char* data;
+            const char* end;
+            uint64_t remaining;
+            osmium::unsigned_object_id_type id;
+        };
+
+        std::vector<list_state> lists;
+        typedef std::pair<osmium::unsigned_object_id_type, std::size_t> queue_element; // id, list
+        std::priority_queue<queue_element, std::vector<queue_element>, std::greater<queue_element>> queue;
+        for (const auto index : current) {
+            const run_cursor& cursor = cursors[index];
+            if (cursor.counts[nwr] == 0) {
+                continue;
+            }
+            list_state list{cursor.lists[nwr], cursor.lists[nwr] + cursor.sizes[nwr], cursor.counts[nwr], 0};
+            list.id = osmium::unsigned_object_id_type(protozero::decode_zigzag64(protozero::decode_varint(&list.data, list.end)));
+            queue.emplace(list.id, lists.size());
+            lists.push_back(list);
+        }
+
+        std::string encoded;
+        uint64_t count = 0;
+        osmium::unsigned_object_id_type last_id = 0;
+        while (!queue.empty()) {
+            const auto top = queue.top();
+            queue.pop();
+            if (count == 0 || top.first != last_id) {
+                protozero::write_varint(std::back_inserter(encoded), protozero::encode_zigzag64(int64_t(top.first - last_id)));
+                last_id = top.first;
+                ++count;
+                if (encoded.size() >= flush_size) {
+                    file.write(encoded.data(), encoded.size());
+                    encoded.clear();
+                }
+            }
+            auto& list = lists[top.second];
+            if (--list.remaining > 0) {
+                list.id += osmium::unsigned_object_id_type(protozero::decode_zigzag64(protozero::decode_varint(&list.data, list.end)));
+                queue.emplace(list.id, top.second);
+            }
+        }
+        file.write(encoded.data(), encoded.size());
+
+        return count;
+    }
+
+    void remove_runs() noexcept {
+        for (const auto& filename : m_runs) {
+            std::remove(filename.c_str());
+        }
+        m_runs.clear();
+    }
+
+public:
+
+    /**
+     * Runs are written to files named run_prefix + number. The memory
+     * limit is in bytes.
+     */
+    TagIndexBuilder(const std::string& run_prefix, std::size_t memory_limit) :
+        m_run_prefix(run_prefix),
+        m_memory_limit(memory_limit) {
+    }
+
+    ~TagIndexBuilder() noexcept {
+        remove_runs();
+    }
+
+    void node(const osmium::Node& node) {
+        add_object(node);
+    }
+
+    void way(const osmium::Way& way) {
+        add_object(way);
+    }
+
+    void relation(const osmium::Relation& relation) {
+        add_object(relation);
+    }
+
+    void write(const std::string& database) {
+        spill();
+
+        std::vector<std::unique_ptr<MappedFile>> runs;
+        std::vector<run_cursor> cursors;
+        for (const auto& filename : m_runs) {
+            runs.emplace_back(new MappedFile{filename});
+            const char* data = reinterpret_cast<const char*>(runs.back()->data());
+            cursors.emplace_back(data, data + runs.back()->size());
+        }
+
+        // runs ordered by their current term
+        const auto greater = [&cursors](std::size_t lhs, std::size_t rhs) {
+            return cursors[lhs].term > cursors[rhs].term;
+        };
+        std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(greater)> queue{greater};
+        for (std::size_t i = 0; i < cursors.size(); ++i) {
+            if (cursors[i].next()) {
+                queue.push(i);
+            }
+        }
+
+        OutputFile terms_file{database + "/tags.terms"};
+        OutputFile strings_file{database + "/tags.strings"};
+        OutputFile postings_file{database + "/tags.postings"};
+
+        std::vector<std::size_t> current;
+        while (!queue.empty()) {
+            current.clear();
+            current.push_back(queue.top());
+            queue.pop();
+            while (!queue.empty() && cursors[queue.top()].term == cursors[current.front()].term) {
+                current.push_back(queue.top());
+                queue.pop();
+            }
+
+            const std::string& term = cursors[current.front()].term;
+            TagIndexTerm entry;
+            entry.string_offset = strings_file.size();
+            strings_file.write(term.c_str(), term.size() + 1);
+            for (unsigned int nwr = 0; nwr < 3; ++nwr) {
+                entry.posting_offset[nwr] = postings_file.size();
+                entry.posting_count[nwr] = merge_postings(cursors, current, nwr, postings_file);
+            }
+            terms_file.write_value(entry);
+
+            for (const auto index : current) {
+                if (cursors[index].next()) {
+                    queue.push(index);
+                }
+            }
+        }
+
+        terms_file.close();
+        strings_file.close();
+        postings_file.close();
+
+        runs.clear();
+        remove_runs();
+    }
+
+}; // class TagIndexBuilder
+
+/**
+ * Intersect two sorted ID lists. Uses galloping search in the longer
+ * list, so the cost depends mostly on the length of the shorter one.
+ */
+inline std::vector<osmium::unsigned_object_id_type> intersect_postings(const std::vector<osmium::unsigned_object_id_type>& a, const std::vector<osmium::unsigned_object_id_type>& b) {
+    if (a.size() > b.size()) {
+        return intersect_postings(b, a);
+    }
+
+    std::vector<osmium::unsigned_object_id_type> result;
+    auto it = b.begin();
+    for (const auto id : a) {
+        std::size_t step = 1;
+        auto hi = it;
+        while (hi != b.end() && *hi < id) {
+            it = hi;
+            hi = std::size_t(b.end() - hi) > step ? hi + step : b.end();
+            step *= 2;
+        }
+        it = std::lower_bound(it, hi, id);
+        if (it == b.end()) {
+            break;
+        }
+        if (*it == id) {
+            result.push_back(id);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Read access to the tag index.
+ */
+class TagIndex {
+
+    std::unique_ptr<MappedFile> m_terms;
+    std::unique_ptr<MappedFile> m_strings;
+    std::unique_ptr<MappedFile> m_postings;
+
+    const TagIndexTerm* terms_begin() const {
+        return reinterpret_cast<const TagIndexTerm*>(m_terms->data());
+    }
+
+    const TagIndexTerm* terms_end() const {
+        return terms_begin() + m_terms->size() / sizeof(TagIndexTerm);
+    }
+
+    const char* term_string(const TagIndexTerm& term) const {
+        return reinterpret_cast<const char*>(m_strings->data()) + term.string_offset;
+    }
+
+public:
+
+    explicit TagIndex(const std::string& database) :
+        m_terms(new MappedFile{database + "/tags.terms"}),
+        m_strings(new MappedFile{database + "/tags.strings"}),
+        m_postings(new MappedFile{database + "/tags.postings"}) {
+    }
+
+    static bool exists(const std::string& database) {
+        return file_exists(database + "/tags.terms");
+    }
+
+    /**
+     * Get sorted IDs of all objects of the given type matching the term.
+     */
+    std::vector<osmium::unsigned_object_id_type> postings(const std::string& term, osmium::item_type type) const {
+        std::vector<osmium::unsigned_object_id_type> ids;
+
+        const auto it = std::lower_bound(terms_begin(), terms_end(), term, [this](const TagIndexTerm& lhs, const std::string& rhs) {
+            return std::strcmp(term_string(lhs), rhs.c_str()) < 0;
+        });
+        if (it == terms_end() || term != term_string(*it)) {
+            return ids;
+        }
+
+        const unsigned int nwr = osmium::item_type_to_nwr_index(type);
+        ids.reserve(it->posting_count[nwr]);
+
+        const char* data = reinterpret_cast<const char*>(m_postings->data()) + it->posting_offset[nwr];
+        const char* end = reinterpret_cast<const char*>(m_postings->data()) + m_postings->size();
+        osmium::unsigned_object_id_type id = 0;
+        for (uint64_t i = 0; i < it->posting_count[nwr]; ++i) {
+            id += osmium::unsigned_object_id_type(protozero::decode_zigzag64(protozero::decode_varint(&data, end)));
+            ids.push_back(id);
+        }
+
+        return ids;
+    }
+
+    /**
+     * Get sorted IDs of all objects of the given type matching all
+     * of the terms.
+     */
+    std::vector<osmium::unsigned_object_id_type> query(const std::vector<std::string>& terms, osmium::item_type type) const {
+        std::vector<std::vector<osmium::unsigned_object_id_type>> lists;
+        for (const auto& term : terms) {
+            lists.push_back(postings(term, type));
+            if (lists.back().empty()) {
+                return {};
+            }
+        }
+        if (lists.empty()) {
+            return {};
+        }
+
+        // intersect shortest lists first to keep intermediate results small
+        std::sort(lists.begin(), lists.end(), [](const std::vector<osmium::unsigned_object_id_type>& lhs, const std::vector<osmium::unsigned_object_id_type>& rhs) {
+            return lhs.size() < rhs.size();
+        });
+
+        std::vector<osmium::unsigned_object_id_type> result{std::move(lists.front())};
+        for (auto it = std::next(lists.begin()); it != lists.end() && !result.empty(); ++it) {
+            result = intersect_postings(result, *it);
+        }
+
+        return result;
+    }
+
+}; // class TagIndex
+
+#endif // TAG_INDEX_HPP
@@ -81,6 +81,11 @@ namespace osmium {
 
             ~UpdatableDiskStore() noexcept = default;
 
+            /// Size of the data file after everything written so far.
+            size_t offset() const noexcept {
+                return m_offset;
+            }
+
             void node(const osmium::Node& node) {
                 m_node_index.set(node.positive_id(), m_offset);
                 m_offset += node.byte_size();
@@ -0,0 +1,448 @@
+#ifndef WAY_GEOMETRY_HPP
+#define WAY_GEOMETRY_HPP
+
+/*
+
+EODB -- An experimental OSM database based on Libosmium.
+
+Copyright (C) 2015-2018  Jochen Topf <jochen@topf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+// c++
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+// protozero
+#include <protozero/varint.hpp>
+
+// osmium
+#include <osmium/handler.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/way.hpp>
+
+// eodb
+#include "eodb.hpp"
+#include "mapped_file.hpp"
+#include "output_file.hpp"
+#include "snapshot.hpp"
+
+/*
+ * Way geometry store: The coordinates of all nodes of each way, so the
+ * geometry of a way can be read with one sequential read instead of one
+ * lookup in the locations index per node.
+ *
+ * ways.geom contains one record for each way (8-byte aligned):
+ *
+ *   geometry_header  bounding box, number of locations, size of the rest
+ *   zvarint...       delta encoded x and y of each location
+ *
+ * ways.geom.idx is a sorted list of (way id, offset in ways.geom), the
+ * same format as a sparse index. Updates append new records to ways.geom
+ * and write a delta ways.geom.delta.GENERATION in the same format with
+ * all ways changed since the index was written (deleted ways with offset
+ * removed_geometry). Like the map deltas (see map_delta.hpp) the deltas
+ * are cumulative and recorded in the manifest. A large delta is merged
+ * into a new index ways.geom.GENERATION.idx instead.
+ *
+ * Nodes without location are left out of the geometry.
+ */
+
+namespace detail {
+
+    struct geometry_header {
+        int32_t min_x;
+        int32_t min_y;
+        int32_t max_x;
+        int32_t max_y;
+        uint32_t num_locations;
+        uint32_t size;
+    };
+
+    inline std::size_t geometry_padding(std::size_t size) noexcept {
+        return (8 - size % 8) % 8;
+    }
+
+} // namespace detail
+
+inline std::string way_geometry_name(const std::string& database) {
+    return database + "/ways.geom";
+}
+
+inline std::string way_geometry_index_name(const std::string& database) {
+    return database + "/ways.geom.idx";
+}
+
+typedef std::pair<osmium::unsigned_object_id_type, osmium::unsigned_object_id_type> id_pair;
+
+// offset in the delta for ways deleted since the index was written
+constexpr const std::size_t removed_geometry = std::numeric_limits<std::size_t>::max();
+
+/**
+ * Index files of the way geometry store in the generation of the manifest.
+ * Both names are empty if there is no way geometry store.
+ */
+inline SnapshotManifest::delta_files snapshot_way_geometry_files(const std::string& database, const SnapshotManifest& manifest) {
+    if (!manifest.way_geometries.base.empty()) {
+        return manifest.way_geometries;
+    }
+    SnapshotManifest::delta_files files;
+    if (file_exists(way_geometry_index_name(database))) {
+        files.base = "ways.geom.idx";
+    }
+    return files;
+}
+
+/**
+ * Merge two sorted (way id, offset) lists calling func for each entry.
+ * For ways in both lists the entry from the newer list is used.
+ */
+template <typename TFunc>
+inline void merge_way_geometry_entries(const id_pair* old_first, const id_pair* old_last, const id_pair* new_first, const id_pair* new_last, TFunc&& func) {
+    while (old_first != old_last || new_first != new_last) {
+        if (new_first == new_last || (old_first != old_last && old_first->first < new_first->first)) {
+            func(*old_first++);
+        } else {
+            if (old_first != old_last && old_first->first == new_first->first) {
+                ++old_first;
+            }
+            func(*new_first++);
+        }
+    }
+}
+
+/**
+ * Geometry of one way in the store.
+ */
+class WayGeometry {
+
+    const detail::geometry_header* m_header;
+
+    static const unsigned char* empty() noexcept {
+        static const detail::geometry_header header{0, 0, 0, 0, 0, 0};
+        return reinterpret_cast<const unsigned char*>(&header);
+    }
+
+public:
+
+    WayGeometry() noexcept :
+        WayGeometry(empty()) {
+    }
+
+    explicit WayGeometry(const unsigned char* data) noexcept :
+        m_header(reinterpret_cast<const detail::geometry_header*>(data)) {
+    }
+
+    std::size_t size() const noexcept {
+        return m_header->num_locations;
+    }
+
+    osmium::Box bbox() const {
+        if (m_header->num_locations == 0) {
+            return osmium::Box{};
+        }
+        return osmium::Box{osmium::Location{m_header->min_x, m_header->min_y},
+                           osmium::Location{m_header->max_x, m_header->max_y}};
+    }
+
+    template <typename TFunc>
+    void for_each_location(TFunc&& func) const {
+        const char* data = reinterpret_cast<const char*>(m_header + 1);
+        const char* const end = data + m_header->size;
+        int64_t x = 0;
+        int64_t y = 0;
+        for (uint32_t n = 0; n < m_header->num_locations; ++n) {
+            x += protozero::decode_zigzag64(protozero::decode_varint(&data, end));
+            y += protozero::decode_zigzag64(protozero::decode_varint(&data, end));
+            func(osmium::Location{int32_t(x), int32_t(y)});
+        }
+    }
+
+    std::vector<osmium::Location> locations() const {
+        std::vector<osmium::Location> result;
+        result.reserve(size());
+        for_each_location([&result](const osmium::Location& location) {
+            result.push_back(location);
+        });
+        return result;
+    }
+
+}; // class WayGeometry
+
+/**
+ * Read access to the way geometry store in one generation.
+ */
+class WayGeometryStore {
+
+    MappedFile m_data;
+    MappedFile m_index;
+    std::unique_ptr<MappedFile> m_delta;
+
+    static const id_pair* find_entry(const MappedFile& file, osmium::unsigned_object_id_type id) noexcept {
+        const auto* const first = reinterpret_cast<const id_pair*>(file.data());
+        const auto* const last = first + file.size() / sizeof(id_pair);
+        const auto it = std::lower_bound(first, last, id_pair{id, 0}, [](const id_pair& lhs, const id_pair& rhs) {
+            return lhs.first < rhs.first;
+        });
+        return (it == last || it->first != id) ? nullptr : it;
+    }
+
+public:
+
+    WayGeometryStore(const std::string& database, const SnapshotManifest::delta_files& files) :
+        m_data(way_geometry_name(database)),
+        m_index(database + "/" + files.base) {
+        if (!files.delta.empty()) {
+            m_delta.reset(new MappedFile{database + "/" + files.delta});
+        }
+    }
+
+    WayGeometry get(std::size_t offset) const {
+        if (offset + sizeof(detail::geometry_header) > m_data.size()) {
+            throw std::runtime_error{"Offset beyond end of way geometry file"};
+        }
+        return WayGeometry{m_data.data() + offset};
+    }
+
+    /**
+     * Find the geometry of the way. Returns false if it is not in the
+     * store.
+     */
+    bool find(osmium::unsigned_object_id_type id, WayGeometry& geometry) const {
+        const id_pair* entry = m_delta ? find_entry(*m_delta, id) : nullptr;
+        if (!entry) {
+            entry = find_entry(m_index, id);
+        }
+        if (!entry || entry->second == removed_geometry) {
+            return false;
+        }
+        geometry = get(entry->second);
+        return true;
+    }
+
+}; // class WayGeometryStore
+
+/**
+ * Writes the way geometry store. Used as handler in eodb_create (after the
+ * NodeLocationsForWays handler) and with add() in eodb_update.
+ */
+class WayGeometryWriter : public osmium::handler::Handler {
+
+    // merge the delta into a new index when it gets larger than this many
+    // entries and more than 1/16 of the index
+    static constexpr const std::size_t min_compact_size = 1024 * 1024;
+
+    std::string m_database;
+    SnapshotManifest::delta_files m_files;
+    std::unique_ptr<OutputFile> m_file;
+    std::size_t m_base_offset = 0;
+    std::vector<id_pair> m_index;
+    std::vector<osmium::unsigned_object_id_type> m_removed;
+    std::string m_record;
+
+    void append(osmium::unsigned_object_id_type id, const std::vector<osmium::Location>& locations) {
+        detail::geometry_header header{std::numeric_limits<int32_t>::max(), std::numeric_limits<int32_t>::max(),
+                                       std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::min(),
+                                       uint32_t(locations.size()), 0};
+        if (locations.empty()) {
+            header.min_x = header.min_y = header.max_x = header.max_y = 0;
+        }
+
+        m_record.clear();
+        int64_t x = 0;
+        int64_t y = 0;
+        for (const auto& location : locations) {
+            header.min_x = std::min(header.min_x, location.x());
+            header.min_y = std::min(header.min_y, location.y());
+            header.max_x = std::max(header.max_x, location.x());
+            header.max_y = std::max(header.max_y, location.y());
+            protozero::write_varint(std::back_inserter(m_record), protozero::encode_zigzag64(location.x() - x));
+            protozero::write_varint(std::back_inserter(m_record), protozero::encode_zigzag64(location.y() - y));
+            x = location.x();
+            y = location.y();
+        }
+        header.size = uint32_t(m_record.size());
+        m_record.append(detail::geometry_padding(sizeof(header) + m_record.size()), '\0');
+
+        m_index.emplace_back(id, m_base_offset + m_file->size());
+        m_file->write_value(header);
+        m_file->write(m_record.data(), m_record.size());
+    }
+
+    /// Sort the index entries written, later entries for the same way win.
+    std::vector<id_pair> sorted_index() {
+        std::stable_sort(m_index.begin(), m_index.end(), [](const id_pair& lhs, const id_pair& rhs) {
+            return lhs.first < rhs.first;
+        });
+        std::vector<id_pair> index;
+        index.reserve(m_index.size());
+        for (std::size_t i = 0; i < m_index.size(); ++i) {
+            if (i + 1 == m_index.size() || m_index[i].first != m_index[i + 1].first) {
+                index.push_back(m_index[i]);
+            }
+        }
+        m_index.clear();
+        return index;
+    }
+
+    void close_data_file() {
+        m_file->sync();
+        m_file->close();
+    }
+
+public:
+
+    /// Create a new store.
+    explicit WayGeometryWriter(const std::string& database) :
+        m_database(database),
+        m_file(new OutputFile{way_geometry_name(database)}) {
+    }
+
+    /// Add to the existing store with these index files.
+    WayGeometryWriter(const std::string& database, const SnapshotManifest::delta_files& files) :
+        m_database(database),
+        m_files(files) {
+        if (files.base.empty()) {
+            throw std::runtime_error{"No way geometry index"};
+        }
+
+        const std::string filename{way_geometry_name(database)};
+        const int fd = ::open(filename.c_str(), O_WRONLY | O_APPEND);
+        if (fd < 0) {
+            throw std::system_error{errno, std::system_category(),
+                std::string{"Opening way geometry file '"} + filename + "' failed"};
+        }
+        struct stat s;
+        if (::fstat(fd, &s) != 0) {
+            ::close(fd);
+            throw std::system_error{errno, std::system_category(), "stat on way geometry file failed"};
+        }
+        m_base_offset = s.st_size;
+        m_file.reset(new OutputFile{fd, filename});
+    }
+
+    void way(const osmium::Way& way) {
+        std::vector<osmium::Location> locations;
+        locations.reserve(way.nodes().size());
+        for (const auto& node_ref : way.nodes()) {
+            if (node_ref.location().valid()) {
+                locations.push_back(node_ref.location());
+            }
+        }
+        append(way.positive_id(), locations);
+    }
+
+    /// Add (or replace) geometry of a way (update only).
+    void add(osmium::unsigned_object_id_type id, const std::vector<osmium::Location>& locations) {
+        append(id, locations);
+    }
+
+    /// Remove geometry of a deleted way (update only).
+    void remove(osmium::unsigned_object_id_type id) {
+        m_removed.push_back(id);
+    }
+
+    /// Write the index of a new store.
+    void close() {
+        close_data_file();
+
+        const std::vector<id_pair> index{sorted_index()};
+        OutputFile file{way_geometry_index_name(m_database)};
+        file.write(index.data(), index.size() * sizeof(id_pair));
+        file.sync();
+        file.close();
+    }
+
+    /**
+     * Write the delta (or a new index) with all changes of this update
+     * for the next generation (update only). Returns the index files of
+     * the next generation.
+     */
+    SnapshotManifest::delta_files write_next(uint64_t generation) {
+        close_data_file();
+
+        std::sort(m_removed.begin(), m_removed.end());
+        m_removed.erase(std::unique(m_removed.begin(), m_removed.end()), m_removed.end());
+        std::vector<id_pair> removed;
+        removed.reserve(m_removed.size());
+        for (const auto id : m_removed) {
+            removed.emplace_back(id, removed_geometry);
+        }
+        const std::vector<id_pair> changes{sorted_index()};
+
+        std::vector<id_pair> changed;
+        merge_way_geometry_entries(removed.data(), removed.data() + removed.size(), changes.data(), changes.data() + changes.size(), [&changed](const id_pair& entry) {
+            changed.push_back(entry);
+        });
+
+        // the delta is cumulative
+        std::vector<id_pair> delta;
+        if (m_files.delta.empty()) {
+            delta.swap(changed);
+        } else {
+            const MappedFile old_delta{m_database + "/" + m_files.delta};
+            const auto* const first = reinterpret_cast<const id_pair*>(old_delta.data());
+            merge_way_geometry_entries(first, first + old_delta.size() / sizeof(id_pair), changed.data(), changed.data() + changed.size(), [&delta](const id_pair& entry) {
+                delta.push_back(entry);
+            });
+        }
+
+        const MappedFile index{m_database + "/" + m_files.base};
+        const std::size_t index_size = index.size() / sizeof(id_pair);
+
+        SnapshotManifest::delta_files next;
+        if (delta.size() <= std::max(std::size_t(min_compact_size), index_size / 16)) {
+            next.base = m_files.base;
+            next.delta = "ways.geom.delta." + std::to_string(generation);
+            OutputFile file{m_database + "/" + next.delta};
+            file.write(delta.data(), delta.size() * sizeof(id_pair));
+            file.sync();
+            file.close();
+            return next;
+        }
+
+        next.base = "ways.geom." + std::to_string(generation) + ".idx";
+        OutputFile file{m_database + "/" + next.base};
+        const auto* const first = reinterpret_cast<const id_pair*>(index.data());
+        merge_way_geometry_entries(first, first + index_size, delta.data(), delta.data() + delta.size(), [&file](const id_pair& entry) {
+            if (entry.second != removed_geometry) {
+                file.write_value(entry);
+            }
+        });
+        file.sync();
+        file.close();
+        return next;
+    }
+
+}; // class WayGeometryWriter
+
+#endif // WAY_GEOMETRY_HPP
@@ -6,13 +6,20 @@
 DATAFILE=...
 CHANGEFILE=...
 
-time eodb_create $DATAFILE
+# seconds after which the interrupted update is killed
+KILL_AFTER=2
+
+# eodb_update needs a dense or packed index
+time eodb_create -i dense_file_array $DATAFILE
 
 eodb_export -o data_export_1.osm.opl
 eodb_dump -i nodes >nodes_export_1.csv
 eodb_dump -i ways >ways_export_1.csv
 eodb_dump -i relations >relations_export_1.csv
 
+rm -fr killed.eodb
+cp -a test.eodb killed.eodb
+
 time eodb_update $CHANGEFILE
 
 eodb_export -o data_export_2.osm.opl
@@ -20,3 +27,53 @@ eodb_dump -i nodes >nodes_export_2.csv
 eodb_dump -i ways >ways_export_2.csv
 eodb_dump -i relations >relations_export_2.csv
 
+# kill an update and let the next one recover, the result must be the
+# same as after the update above
+eodb_update -d killed.eodb $CHANGEFILE &
+sleep $KILL_AFTER
+kill -9 $!
+wait $!
+
+if [ ! -f killed.eodb/journal -a ! -f killed.eodb/journal.tmp ]; then
+    echo "Update finished before it was killed, use a smaller KILL_AFTER"
+fi
+
+time eodb_update -d killed.eodb $CHANGEFILE
+
+eodb_export -d killed.eodb -o data_export_killed.osm.opl
+eodb_dump -d killed.eodb -i nodes >nodes_export_killed.csv
+eodb_dump -d killed.eodb -i ways >ways_export_killed.csv
+eodb_dump -d killed.eodb -i relations >relations_export_killed.csv
+
+for name in data_export nodes_export ways_export relations_export; do
+    ext=csv
+    if [ $name = data_export ]; then
+        ext=osm.opl
+    fi
+    if cmp ${name}_2.$ext ${name}_killed.$ext; then
+        echo "recovery: $name ok"
+    else
+        echo "recovery: $name differs"
+    fi
+done
+
+# look up the same IDs (and some that are not there) in all index formats
+rm -fr sparse.eodb eytzinger.eodb paged.eodb packed.eodb
+eodb_create -d sparse.eodb $DATAFILE
+eodb_create -d eytzinger.eodb -L eytzinger $DATAFILE
+eodb_create -d paged.eodb -i dense_file_array -L paged $DATAFILE
+eodb_create -d packed.eodb -i packed40_dense_file_array $DATAFILE
+
+for index in nodes ways relations; do
+    ids="1 2 3 $(cut -d' ' -f1 ${index}_export_1.csv | head -n 1000)"
+    for format in sparse eytzinger paged packed; do
+        eodb_lookup -d $format.eodb -i $index $ids >lookup_${index}_$format.txt
+    done
+    for format in eytzinger paged packed; do
+        if cmp lookup_${index}_sparse.txt lookup_${index}_$format.txt; then
+            echo "lookup: $index $format ok"
+        else
+            echo "lookup: $index $format differs from sparse"
+        fi
+    done
+done